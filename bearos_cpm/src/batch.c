@@ -0,0 +1,358 @@
+/*-----------------------------------------------------------------------*\
+ |  batch.c  --  run a batch of CP/M jobs at once (--batch)  --  each    |
+ |  job is a command typed into a machine of its own, in a directory of  |
+ |  its own, and the jobs are shared out among one thread for each of    |
+ |  the host's processors                                                |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "defs.h"
+#include "vt.h"
+
+#ifdef BATCH
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+
+/* A job file has a line for each job, with its working directory, the
+   command line to type at the first CP/M prompt and, if it needs one, a
+   file of keystrokes for the rest of its input, separated by '|':
+
+	# directory	| command		| keystrokes
+	build/main	| m80 =main		|
+	build/main	| l80 main,main/n/e
+	test		| mbasic test		| test.key
+
+   Blank lines and lines starting with '#' are left out, and paths are
+   taken from the current directory.  The console output of job "n" goes
+   to the file "<job file>.<n>.out". */
+
+#define JOBLINE		512	/* longest line in a job file */
+#define JOBCMD		127	/* longest command, as for the CCP */
+
+typedef struct job
+{
+	int line;		/* in the job file */
+	char *dir;
+	char *cmd;
+	char *script;		/* NULL for none */
+	char *out;		/* where the console output goes */
+
+	int status;		/* JOB_* */
+	unsigned long ms;	/* wall time taken */
+	unsigned long insns, cycles;
+} job;
+
+static job *jobs;
+static int njobs;
+static int nextjob;		/* next one for a worker to take */
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* the time in ms */
+static unsigned long
+batchms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (unsigned long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* take the spaces off both ends of "s" */
+static char *
+trim(char *s)
+{
+	char *e;
+
+	while (isspace(*(unsigned char *)s))
+		s++;
+
+	for (e = s + strlen(s); e > s && isspace(((unsigned char *)e)[-1]); e--)
+		;
+
+	*e = '\0';
+	return s;
+}
+
+static char *
+dupstr(const char *s)
+{
+	char *t = malloc(strlen(s) + 1);
+
+	if (t != NULL)
+		strcpy(t, s);
+
+	return t;
+}
+
+/* read the jobs in "fname", FALSE if it cannot be read or is bad */
+static boolean
+readjobs(const char *fname)
+{
+	char buf[JOBLINE], outname[JOBLINE + 16];
+	char *s, *field[3];
+	FILE *fp;
+	int line = 0, max = 0, i;
+
+	if ((fp = fopen(fname, "r")) == NULL)
+	{
+		perror(fname);
+		return FALSE;
+	}
+
+	while (fgets(buf, sizeof buf, fp) != NULL)
+	{
+		line++;
+		s = trim(buf);
+
+		if (*s == '\0' || *s == '#')
+			continue;
+
+		for (i = 0; i < 3; i++)
+		{
+			field[i] = s;
+
+			if (s != NULL && (s = strchr(s, '|')) != NULL)
+				*s++ = '\0';
+		}
+
+		for (i = 0; i < 3; i++)
+			if (field[i] != NULL)
+				field[i] = trim(field[i]);
+
+		if (s != NULL || field[1] == NULL || *field[0] == '\0' ||
+				*field[1] == '\0' || strlen(field[1]) > JOBCMD)
+		{
+			fprintf(stderr, "%s:%d: want \"directory | command "
+				"[| keystrokes]\", with a command of up to "
+				"%d characters\n", fname, line, JOBCMD);
+			fclose(fp);
+			return FALSE;
+		}
+
+		if (njobs == max)
+		{
+			job *p;
+
+			max = max ? max * 2 : 16;
+
+			if ((p = realloc(jobs, max * sizeof *p)) == NULL)
+			{
+				fprintf(stderr, "Out of memory for jobs\n");
+				fclose(fp);
+				return FALSE;
+			}
+
+			jobs = p;
+		}
+
+		sprintf(outname, "%s.%d.out", fname, njobs + 1);
+		memset(&jobs[njobs], 0, sizeof *jobs);
+		jobs[njobs].line = line;
+		jobs[njobs].dir = dupstr(field[0]);
+		jobs[njobs].cmd = dupstr(field[1]);
+		jobs[njobs].script = field[2] != NULL && *field[2] != '\0' ?
+				dupstr(field[2]) : NULL;
+		jobs[njobs].out = dupstr(outname);
+		njobs++;
+	}
+
+	fclose(fp);
+	return TRUE;
+}
+
+/* the end of a job's keystrokes, when it waits for another one */
+static void
+noinput(void *arg)
+{
+	exit_cpm((z80info *)arg, JOB_NOINPUT);
+}
+
+/* run job "j" on machine "z80", from a reset to its return to the
+   CP/M prompt  --  "z80" is set up afresh for it */
+static void
+runjob(z80info *z80, job *j)
+{
+	jmp_buf done;
+	int in, out;
+	unsigned long start = batchms();
+
+	j->status = JOB_NOSTART;
+	in = open(j->script != NULL ? j->script : "/dev/null", O_RDONLY);
+
+	if (in < 0)
+	{
+		perror(j->script);
+		return;
+	}
+
+	if ((out = open(j->out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	{
+		perror(j->out);
+		close(in);
+		return;
+	}
+
+	destroy_z80info(z80);
+	init_z80info(z80);
+
+	if (init_cpm(z80, j->dir, in, out))
+	{
+		z80->stuff_cmd = j->cmd;
+		z80->exec = TRUE;
+		z80->vt->script = TRUE;
+		z80->vt->ended = noinput;
+		z80->vt->arg = z80;
+		z80->exitjmp = &done;
+
+		if (setjmp(done) == 0)
+		{
+			sysreset(z80);
+
+			while (1)
+				z80_emulator(z80, 100000);
+		}
+
+		j->status = z80->exitstatus;
+		j->insns = z80->insns;
+		j->cycles = z80->cycles;
+		destroy_cpm(z80);
+	}
+
+	close(in);
+	close(out);
+	j->ms = batchms() - start;
+}
+
+/* a worker thread: runs the jobs no other worker has taken yet */
+static void *
+worker(void *arg)
+{
+	z80info *z80 = arg;
+	int n;
+
+	while (1)
+	{
+		pthread_mutex_lock(&joblock);
+		n = nextjob < njobs ? nextjob++ : -1;
+		pthread_mutex_unlock(&joblock);
+
+		if (n < 0)
+			break;
+
+		runjob(z80, &jobs[n]);
+	}
+
+	return NULL;
+}
+
+static const char *
+jobstatus(int status)
+{
+	switch (status)
+	{
+	case JOB_OK:		return "ok";
+	case JOB_FAILED:	return "failed";
+	case JOB_NOINPUT:	return "no input";
+	case JOB_NOSTART:	return "not run";
+	default:		return "?";
+	}
+}
+
+/*-----------------------------------------------------------------------*\
+ |  runbatch  --  run the jobs in "fname" & show how each went  --  the
+ |  return is the exit status for the process, 0 if all of them were ok
+\*-----------------------------------------------------------------------*/
+
+int
+runbatch(const char *fname)
+{
+	z80info **z80s;
+	pthread_t *threads;
+	unsigned long start, ms, insns = 0;
+	int nworkers, nok = 0, i;
+	long n;
+
+	if (!readjobs(fname))
+		return 1;
+
+	if (njobs == 0)
+	{
+		fprintf(stderr, "%s: no jobs\n", fname);
+		return 1;
+	}
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = n < 1 ? 1 : n > njobs ? njobs : (int)n;
+
+	/* the machines are made here, not by the workers, since the first
+	   new_z80info() builds tables that they all share */
+	z80s = malloc(nworkers * sizeof *z80s);
+	threads = malloc(nworkers * sizeof *threads);
+
+	if (z80s == NULL || threads == NULL)
+	{
+		fprintf(stderr, "Out of memory for workers\n");
+		return 1;
+	}
+
+	for (i = 0; i < nworkers; i++)
+		if ((z80s[i] = new_z80info()) == NULL)
+			return 1;
+
+	start = batchms();
+
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&threads[i], NULL, worker, z80s[i]) != 0)
+		{
+			fprintf(stderr, "Cannot start a worker thread\n");
+			nworkers = i;
+			break;
+		}
+
+	/* with no threads at all, do the work here */
+	if (nworkers == 0)
+		worker(z80s[0]);
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(threads[i], NULL);
+
+	ms = batchms() - start;
+
+	printf("%4s  %-8s  %9s  %14s  %s\n", "job", "status", "seconds",
+			"instructions", "directory | command");
+
+	for (i = 0; i < njobs; i++)
+	{
+		job *j = &jobs[i];
+
+		printf("%4d  %-8s  %5lu.%03lu  %14lu  %s | %s\n", i + 1,
+				jobstatus(j->status), j->ms / 1000, j->ms % 1000,
+				j->insns, j->dir, j->cmd);
+
+		if (j->status == JOB_OK)
+			nok++;
+
+		insns += j->insns;
+	}
+
+	printf("%d of %d jobs ok, %lu.%03lu s on %d workers, %lu instructions"
+			" (output in %s.<job>.out)\n", nok, njobs, ms / 1000,
+			ms % 1000, nworkers > 0 ? nworkers : 1, insns, fname);
+
+	for (i = 0; i < (nworkers > 0 ? nworkers : 1); i++)
+		delete_z80info(z80s[i]);
+
+	free(z80s);
+	free(threads);
+	return nok == njobs ? 0 : 1;
+}
+
+#endif /* BATCH */
@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef BEAROS
 #include <bearos/compat.h>
@@ -13,58 +14,80 @@
 #endif
 #include "defs.h"
 #include "vt.h"
+#ifdef HOST_AT
+#include <fcntl.h>
+#endif
 
 #define BIOS 0xFE00
 #define DPH0 (BIOS + 0x0036)
 #define DPB0 (DPH0 + 0x0010)
 #define DIRBUF 0xff80
 #define CPMLIBDIR "./"
-static int storedfps = 0;
-unsigned short usercode = 0x00;
 int restricted_mode = 0;
-int silent_exit = 0;
-char *stuff_cmd = 0;
-int exec = 0;
 int trace_bdos = 0;
 
+#define FPHASH 256
+
+/* Everything the BDOS emulation keeps for one machine, in z80->bdos:
+   the host files open for FCBs, and the directory snapshot for search
+   first/next (both below) */
+struct bdosinfo {
+    unsigned short usercode;
+    char cmdline[259];		/* the line rdcmdline() read */
+    struct stfps *stfps;
+    int maxfps;
+    int freefps;
+    int wherehash[FPHASH], namehash[FPHASH];
+    struct {
+	unsigned char (*name)[11];	/* the 8.3 names: name then type */
+	int n, max;
+	int dollar;			/* a host name has a '$' in it */
+	int valid;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+    } dir;
+    int dirpos;		/* next snapshot name for search next */
+    unsigned sfn;
+};
+
 /* Kill CP/M command line prompt */
 
-static void killprompt()
+static void killprompt(z80info *z80)
 {
-    vt52('\b');
-    vt52(' ');
-    vt52('\b');
-    vt52('\b');
-    vt52(' ');
-    vt52('\b');
+    vt52(z80->vt, '\b');
+    vt52(z80->vt, ' ');
+    vt52(z80->vt, '\b');
+    vt52(z80->vt, '\b');
+    vt52(z80->vt, ' ');
+    vt52(z80->vt, '\b');
 }
 
 char *rdcmdline(z80info *z80, int max, int ctrl_c_enable)
 {
     int i, c;
-    static char s[259];
+    char *s = z80->bdos->cmdline;
 
-    fflush(stdout);
     max &= 0xff;
     i = 1;      /* number of next character */
 
-    if (stuff_cmd) {
-        killprompt();
-    	strcpy(s + i, stuff_cmd);
+    if (z80->stuff_cmd) {
+        killprompt(z80);
+    	strcpy(s + i, z80->stuff_cmd);
     	/* printf("'%s'\n", stuff_cmd); */
     	i = 1 + strlen(s + i);
-    	stuff_cmd = 0;
-    	silent_exit = 1;
+    	z80->stuff_cmd = 0;
+    	z80->silent_exit = 1;
     	goto hit_rtn;
-    } else if (exec) {
-        killprompt();
-        printf("\r\n");
+    } else if (z80->exec) {
+        killprompt(z80);
+        vtputs(z80->vt, "\r\n", 2);
         finish(z80);
         return s;
     }
 
 loop:
-    c = kget(0);
+    c = kget(z80->vt, 0);
     if (c == INTR_CHAR) {
     	command(z80);
     	i = 1;
@@ -75,8 +98,8 @@ loop:
         switch (c) {
 	case 3:
 	    if (ctrl_c_enable) {
-		vt52('^');
-		vt52('C');
+		vt52(z80->vt, '^');
+		vt52(z80->vt, 'C');
 		z80->regpc = BIOS+3;
 		s[0] = 0;
 		return s;
@@ -86,10 +109,9 @@ loop:
 	case 0x7f:
 	    if (i > 1) {
 		--i;
-		vt52('\b');
-		vt52(' ');
-		vt52('\b');
-		fflush(stdout);
+		vt52(z80->vt, '\b');
+		vt52(z80->vt, ' ');
+		vt52(z80->vt, '\b');
 	    }
 	    break;
         case '\n':
@@ -98,7 +120,7 @@ loop:
 	    s[0] = i-1;
 	    s[i] = 0;
 	    if (!strcmp(s + 1, "bye")) {
-	    	printf("\r\n");
+	    	vtputs(z80->vt, "\r\n", 2);
 	    	finish(z80);
 	    }
 	    if (i <= max)
@@ -108,8 +130,7 @@ loop:
         goto loop;
     } else if (i <= max) {
         s[i++] = c;
-        vt52(c);
-	fflush(stdout);
+        vt52(z80->vt, c);
     }
     goto loop;
 }
@@ -161,88 +182,376 @@ static void FCB_to_ufilename(unsigned char *p, char *name) {
     	printf("File name is %s\r\n", org);
 }
 
-static struct stfps {
+/* Each host file open for an FCB has a window of it kept in memory, so
+   that the records read & written by functions 20, 21, 33 & 34 do not
+   each need an fseek() and an fread() or fwrite().  Records written go
+   into the window, and only go to the file when it moves elsewhere or
+   by bdos_flush() on closing the file, a disk reset or a warm boot.  A
+   file open through more than one FCB is not cached, since the windows
+   would not see each other's writes. */
+
+#ifdef BEAROS
+#define RECBUF 1024
+#else
+#define RECBUF 8192
+#endif
+
+typedef struct cpmfile {
     FILE *fp;
+    long size;		/* size of the file, with what is in "buf" */
+    long pos;		/* offset after the last record read or written */
+    long base;		/* offset of "buf" in the file, or -1 */
+    int len;		/* bytes of the file in "buf" */
+    int lo, hi;		/* the part of "buf" still to be written */
+    int shared;		/* open through another FCB too: do not cache */
+    dev_t dev;
+    ino_t ino;
+    char path[32];	/* the host file name, for a snapshot */
+    unsigned char buf[RECBUF];
+} cpmfile;
+
+/* The host files open for FCBs.  The table grows as needed, and is
+   indexed by hash chains on both the FCB address and the FCB name, so
+   that finding the file for a record read or write does not scan it.
+   Free slots have "where" set to 0xffff and are kept on "freefps". */
+
+struct stfps {
+    cpmfile *cf;
     unsigned where;
     char name[12];
-} stfps[100];
+    int nextwhere;	/* next slot in the same "wherehash" chain, or -1 */
+    int nextname;	/* next slot in the same "namehash" chain, or -1 */
+};
+
+#define WHEREHASH(where) (((where) ^ ((where) >> 8)) & (FPHASH - 1))
 
-static void storefp(z80info *z80, FILE *fp, unsigned where) {
+static int namehashof(const unsigned char *name) {
+    unsigned h = 0;
     int i;
-    int ind = -1;
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where == 0xffffU)
+    for (i = 0; i < 11; ++i)
+	h = h * 31 + name[i];
+    return (h ^ (h >> 8)) & (FPHASH - 1);
+}
+
+/* Take slot "ind" off the hash chain starting at "*head". */
+
+static void unchain(struct bdosinfo *bd, int *head, int ind, int isname) {
+    int *p;
+    for (p = head; *p != ind;
+	 p = isname ? &bd->stfps[*p].nextname : &bd->stfps[*p].nextwhere)
+	;
+    *p = isname ? bd->stfps[ind].nextname : bd->stfps[ind].nextwhere;
+}
+
+static void chainwhere(struct bdosinfo *bd, int ind, unsigned where) {
+    int *head = &bd->wherehash[WHEREHASH(where)];
+    bd->stfps[ind].where = where;
+    bd->stfps[ind].nextwhere = *head;
+    *head = ind;
+}
+
+static void chainname(struct bdosinfo *bd, int ind,
+		      const unsigned char *name) {
+    int *head = &bd->namehash[namehashof(name)];
+    memcpy(bd->stfps[ind].name, name, 11);
+    bd->stfps[ind].name[11] = '\0';
+    bd->stfps[ind].nextname = *head;
+    *head = ind;
+}
+
+/* Find the first slot for the FCB at "where", or with its name. */
+
+static int findwhere(struct bdosinfo *bd, unsigned where,
+		     const unsigned char *name) {
+    int i, ind = -1;
+    for (i = bd->wherehash[WHEREHASH(where)]; i >= 0;
+	 i = bd->stfps[i].nextwhere)
+	if (bd->stfps[i].where == where && (ind < 0 || i < ind) &&
+	    (!name || memcmp(bd->stfps[i].name, name, 11) == 0))
 	    ind = i;
-	else if (stfps[i].where == where) {
+    return ind;
+}
+
+static int findname(struct bdosinfo *bd, const unsigned char *name) {
+    int i, ind = -1;
+    for (i = bd->namehash[namehashof(name)]; i >= 0;
+	 i = bd->stfps[i].nextname)
+	if (memcmp(bd->stfps[i].name, name, 11) == 0 && (ind < 0 || i < ind))
 	    ind = i;
-	    goto putfp;
-	}
-    if (ind < 0) {
-	if (++storedfps > 100) {
+    return ind;
+}
+
+/* Get a free slot, growing the table when there are none. */
+
+static int newfp(z80info *z80) {
+    struct bdosinfo *bd = z80->bdos;
+    int i, ind;
+    if (bd->freefps < 0) {
+	struct stfps *p;
+	int n = bd->maxfps ? bd->maxfps * 2 : 16;
+	if (!(p = realloc(bd->stfps, n * sizeof *p))) {
 	    fprintf(stderr, "out of fp stores!\n");
-            resetterm();
-	    exit(1);
+	    exit_cpm(z80, 1);
+	}
+	bd->stfps = p;
+	/* put the new slots on the free list, lowest first */
+	for (i = n - 1; i >= bd->maxfps; --i) {
+	    bd->stfps[i].where = 0xffffU;
+	    bd->stfps[i].nextwhere = bd->freefps;
+	    bd->freefps = i;
 	}
-	ind = storedfps - 1;
+	bd->maxfps = n;
     }
-    stfps[ind].where = where;
- putfp:
-    stfps[ind].fp = fp;
-    memcpy(stfps[ind].name, z80->mem+z80->regde+1, 11);
-    stfps[ind].name[11] = '\0';
+    ind = bd->freefps;
+    bd->freefps = bd->stfps[ind].nextwhere;
+    return ind;
 }
 
 /* Lookup an FCB to find the host file. */
 
-static FILE *lookfp(z80info *z80, unsigned where) {
-    int i;
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where == where)
-            if (memcmp(stfps[i].name, z80->mem+z80->regde+1, 11) == 0)
-	    return stfps[i].fp;
+static cpmfile *lookfp(z80info *z80, unsigned where) {
+    struct bdosinfo *bd = z80->bdos;
+    unsigned char *name = z80->mem+z80->regde+1;
+    int ind;
+    if ((ind = findwhere(bd, where, name)) >= 0)
+	return bd->stfps[ind].cf;
     /* fcb not found. maybe it has been moved? */
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where != 0xffffU &&
-	    !memcmp(z80->mem+z80->regde+1, stfps[i].name, 11)) {
-	    stfps[i].where = where;	/* moved FCB */
-	    return stfps[i].fp;
-	}
+    if ((ind = findname(bd, name)) >= 0) {
+	unchain(bd, &bd->wherehash[WHEREHASH(bd->stfps[ind].where)], ind, 0);
+	chainwhere(bd, ind, where);	/* moved FCB */
+	return bd->stfps[ind].cf;
+    }
     return NULL;
 }
 
 /* Report an error finding an FCB. */
 
 static void fcberr(z80info *z80, unsigned where) {
+    struct bdosinfo *bd = z80->bdos;
     int i;
 
     fprintf(stderr, "error: cannot find fp entry for FCB at %04x"
 	    " fctn %d, FCB named %s\n", where, z80->regbc & 0xff,
 	    z80->mem+where+1);
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where != 0xffffU)
-	    printf("%s %04x\n", stfps[i].name, stfps[i].where);
-    resetterm();
-    exit(1);
+    for (i = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU)
+	    printf("%s %04x\n", bd->stfps[i].name, bd->stfps[i].where);
+    exit_cpm(z80, 1);
 }
 
 /* Get the host file for an FCB when it should be open. */
 
-static FILE *getfp(z80info *z80, unsigned where) {
-    FILE *fp;
+static cpmfile *getfp(z80info *z80, unsigned where) {
+    cpmfile *cf;
 
-    if (!(fp = lookfp(z80, where)))
+    if (!(cf = lookfp(z80, where)))
         fcberr(z80, where);
-    return fp;
+    return cf;
 }
 
 static void delfp(z80info *z80, unsigned where) {
+    struct bdosinfo *bd = z80->bdos;
+    int ind = findwhere(bd, where, NULL);
+    if (ind < 0)
+	fcberr(z80, where);
+    unchain(bd, &bd->wherehash[WHEREHASH(where)], ind, 0);
+    unchain(bd, &bd->namehash[namehashof((unsigned char *)
+					 bd->stfps[ind].name)], ind, 1);
+    bd->stfps[ind].where = 0xffffU;
+    bd->stfps[ind].nextwhere = bd->freefps;
+    bd->freefps = ind;
+}
+
+/* Write out what has been written to the window of a file. */
+
+static void cfflush(cpmfile *cf) {
+    if (cf->hi > cf->lo) {
+	if (fseek(cf->fp, cf->base + cf->lo, SEEK_SET) ||
+	    fwrite(cf->buf + cf->lo, 1, cf->hi - cf->lo, cf->fp) !=
+	    (size_t)(cf->hi - cf->lo) || fflush(cf->fp))
+	    fprintf(stderr, "error writing to a host file!\n");
+	cf->lo = cf->hi = 0;
+    }
+}
+
+void bdos_flush(z80info *z80) {
+    struct bdosinfo *bd = z80->bdos;
     int i;
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where == where) {
-	    stfps[i].where = 0xffffU;
-	    return;
+    for (i = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU)
+	    cfflush(bd->stfps[i].cf);
+}
+
+/* Set up the cache for a newly opened host file, or return NULL if it
+   is not a real file. */
+
+static cpmfile *newcf(z80info *z80, FILE *fp, const char *path) {
+    struct bdosinfo *bd = z80->bdos;
+    struct stat stbuf;
+    cpmfile *cf;
+    int i;
+
+    if (fstat(fileno(fp), &stbuf) || !S_ISREG(stbuf.st_mode))
+        return NULL;
+    if (!(cf = malloc(sizeof *cf))) {
+	fprintf(stderr, "out of fp stores!\n");
+	exit_cpm(z80, 1);
+    }
+    cf->fp = fp;
+    cf->size = stbuf.st_size;
+    cf->pos = 0;
+    cf->base = -1;
+    cf->len = cf->lo = cf->hi = 0;
+    cf->shared = 0;
+    cf->dev = stbuf.st_dev;
+    cf->ino = stbuf.st_ino;
+    strncpy(cf->path, path, sizeof cf->path - 1);
+    cf->path[sizeof cf->path - 1] = '\0';
+    for (i = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU &&
+	    bd->stfps[i].cf->dev == cf->dev &&
+	    bd->stfps[i].cf->ino == cf->ino) {
+	    cfflush(bd->stfps[i].cf);
+	    bd->stfps[i].cf->base = -1;
+	    bd->stfps[i].cf->shared = cf->shared = 1;
 	}
-    fcberr(z80, where);
+    return cf;
+}
+
+static void delcf(cpmfile *cf) {
+    cfflush(cf);
+    fclose(cf->fp);
+    free(cf);
+}
+
+/* Keep the host file for the FCB at "where".  A file still open on the
+   same FCB is closed, with what was written to it. */
+
+static void storefp(z80info *z80, cpmfile *cf, unsigned where,
+		    const unsigned char *name) {
+    struct bdosinfo *bd = z80->bdos;
+    int ind = findwhere(bd, where, NULL);
+    if (ind < 0) {
+	ind = newfp(z80);
+	chainwhere(bd, ind, where);
+    } else {
+	unchain(bd, &bd->namehash[namehashof((unsigned char *)
+					     bd->stfps[ind].name)], ind, 1);
+	if (bd->stfps[ind].cf != cf)
+	    delcf(bd->stfps[ind].cf);
+    }
+    bd->stfps[ind].cf = cf;
+    chainname(bd, ind, name);
+}
+
+/* Set up the BDOS emulation for a machine, FALSE if out of memory */
+
+boolean bdos_init(z80info *z80) {
+    struct bdosinfo *bd;
+    int i;
+
+    if (!(bd = calloc(1, sizeof *bd)))
+	return FALSE;
+    for (i = 0; i < FPHASH; ++i)
+	bd->wherehash[i] = bd->namehash[i] = -1;
+    bd->freefps = -1;
+    bd->dirpos = -1;
+    z80->bdos = bd;
+    return TRUE;
+}
+
+/* Close the files a machine still has open, and drop the rest */
+
+void bdos_destroy(z80info *z80) {
+    struct bdosinfo *bd = z80->bdos;
+    int i;
+
+    if (!bd)
+	return;
+    for (i = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU)
+	    delcf(bd->stfps[i].cf);
+    free(bd->stfps);
+    free(bd->dir.name);
+    free(bd);
+    z80->bdos = NULL;
+}
+
+/* Get the size of a file, which the cache knows unless it is shared. */
+
+static long cfsize(cpmfile *cf) {
+    struct stat stbuf;
+    if (cf->shared && !fstat(fileno(cf->fp), &stbuf))
+	return stbuf.st_size;
+    return cf->size;
+}
+
+/* Move the window of a file so that it has the offset "addr" in it. */
+
+static void cfload(cpmfile *cf, long addr) {
+    size_t n;
+    cfflush(cf);
+    cf->base = addr - addr % RECBUF;
+    cf->len = 0;
+    if (!fseek(cf->fp, cf->base, SEEK_SET) &&
+	(n = fread(cf->buf, 1, RECBUF, cf->fp)) > 0)
+	cf->len = n;
+}
+
+/* Read the record at "addr" into "rec", returning how much of it there
+   was in the file. */
+
+static int cfread(cpmfile *cf, long addr, byte *rec) {
+    long n;
+    if (cf->shared) {
+	if (fseek(cf->fp, addr, SEEK_SET))
+	    return 0;
+	n = fread(rec, 1, 128, cf->fp);
+    } else {
+	if (cf->base < 0 || addr < cf->base || addr >= cf->base + RECBUF)
+	    cfload(cf, addr);
+	n = cf->base + cf->len - addr;
+	if (n > 128)
+	    n = 128;
+	else if (n < 0)
+	    n = 0;
+	memcpy(rec, cf->buf + (addr - cf->base), n);
+    }
+    cf->pos = addr + n;
+    return n;
+}
+
+/* Write the record "rec" at "addr", returning 0 if all went well. */
+
+static int cfwrite(cpmfile *cf, long addr, const byte *rec) {
+    int ofst;
+    if (cf->shared) {
+	if (fseek(cf->fp, addr, SEEK_SET) || fwrite(rec, 1, 128, cf->fp) != 128)
+	    return -1;
+        fflush(cf->fp);
+    } else {
+	if (cf->base < 0 || addr < cf->base || addr >= cf->base + RECBUF)
+	    cfload(cf, addr);
+	ofst = addr - cf->base;
+	if (ofst > cf->len)	/* past the end: the gap reads as zeros */
+	    memset(cf->buf + cf->len, 0, ofst - cf->len);
+	memcpy(cf->buf + ofst, rec, 128);
+	if (ofst + 128 > cf->len)
+	    cf->len = ofst + 128;
+	if (cf->hi <= cf->lo) {
+	    cf->lo = ofst;
+	    cf->hi = ofst + 128;
+	} else {
+	    if (ofst < cf->lo)
+		cf->lo = ofst;
+	    if (ofst + 128 > cf->hi)
+		cf->hi = ofst + 128;
+	}
+    }
+    cf->pos = addr + 128;
+    if (cf->pos > cf->size)
+	cf->size = cf->pos;
+    return 0;
 }
 
 /* FCB fields */
@@ -298,8 +607,97 @@ static void delfp(z80info *z80, unsigned where) {
 /* Convert offset to high byte of extent number */
 #define SEQ_S2(n) (SEQ_EXTENT(n) / 32)
 
-static DIR *dp = NULL;
-static unsigned sfn = 0;
+/* Search first/next and disk reset work from a snapshot of the current
+   directory with the names already in FCB form - there is only the one
+   drive, the host's current directory.  The snapshot is kept until the
+   directory's mtime changes, or we create, delete or rename a file
+   ourselves.  A snapshot taken in the same second as that mtime is not
+   trusted, since a later change in that second would not show. */
+
+/* Convert a host name to an 8.3 FCB name, zero if it has no CP/M name */
+static int dirname83(const char *s, unsigned char *p)
+{
+    int i;
+
+    if (*s == '.')
+	return 0;
+    if (strchr(s, '.')) {
+	if (strlen(s) > 12)	/* POSIX: namlen */
+	    return 0;
+    } else if (strlen(s) > 8)
+	return 0;
+    for (i = 0; i < 8; ++i)
+	if (*s != '.' && *s) {
+	    *p++ = toupper(*(unsigned char *)s); s++;
+	} else
+	    *p++ = ' ';
+    /* skip dot */
+    while (*s && *s != '.')
+	++s;
+    while (*s == '.')
+	++s;
+    for (i = 0; i < 3; ++i)
+	if (*s != '.' && *s) {
+	    *p++ = toupper(*(unsigned char *)s); s++;
+	} else
+	    *p++ = ' ';
+    return 1;
+}
+
+/* Bring the directory snapshot up to date, zero if the machine's
+   directory cannot be read */
+static int dirsnap(z80info *z80)
+{
+    struct bdosinfo *bd = z80->bdos;
+    struct stat st;
+    struct dirent *de;
+    DIR *dp;
+#ifdef HOST_AT
+    int fd;
+
+    if (fstatat(z80->dirfd, ".", &st, 0))
+	return 0;
+#else
+    if (stat(".", &st))
+	return 0;
+#endif
+    if (bd->dir.valid && st.st_mtime == bd->dir.mtime &&
+	st.st_ino == bd->dir.ino && st.st_dev == bd->dir.dev)
+	return 1;
+#ifdef HOST_AT
+    if ((fd = openat(z80->dirfd, ".", O_RDONLY | O_DIRECTORY)) < 0)
+	return 0;
+    if (!(dp = fdopendir(fd))) {
+	close(fd);
+	return 0;
+    }
+#else
+    if (!(dp = opendir(".")))
+	return 0;
+#endif
+    bd->dir.n = 0;
+    bd->dir.dollar = 0;
+    while ((de = readdir(dp))) {
+	if (strchr(de->d_name, '$'))
+	    bd->dir.dollar = 1;
+	if (bd->dir.n == bd->dir.max) {
+	    int max = bd->dir.max ? bd->dir.max * 2 : 64;
+	    unsigned char (*name)[11] =
+		realloc(bd->dir.name, max * sizeof *name);
+	    if (!name)
+		break;
+	    bd->dir.name = name;
+	    bd->dir.max = max;
+	}
+	bd->dir.n += dirname83(de->d_name, bd->dir.name[bd->dir.n]);
+    }
+    closedir(dp);
+    bd->dir.dev = st.st_dev;
+    bd->dir.ino = st.st_ino;
+    bd->dir.mtime = st.st_mtime;
+    bd->dir.valid = time(NULL) > st.st_mtime;
+    return 1;
+}
 
 char *bdos_decode(int n)
 {
@@ -394,18 +792,13 @@ void bdos_fcb_dump(z80info *z80)
 
 /* Get count of records in current extent */
 
-int fixrc(z80info *z80, FILE *fp)
+void fixrc(z80info *z80, cpmfile *cf)
 {
-    struct stat stbuf;
     unsigned long size;
     unsigned long full;
     unsigned long ext;
-    /* Get file size */
-    if (fstat(fileno(fp), &stbuf) || !S_ISREG(stbuf.st_mode)) {
-        return -1;
-    }
 
-    size = (stbuf.st_size + 127) >> 7; /* number of records in file */
+    size = (cfsize(cf) + 127) >> 7; /* number of records in file */
 
     full = size - (size % 128); /* record number of first partially full extent */
     ext = SEQ_EXT * 128; /* record number of current extent */
@@ -420,20 +813,100 @@ int fixrc(z80info *z80, FILE *fp)
         /* We are pointing to a partial extent */
         z80->mem[DE + FCB_RC] = size - full;
 
-    return 0;
+}
+
+/* Write the state of the BDOS emulation to a snapshot: the user code
+   and, for each open file, its FCB address & name, the host file and
+   how far it has been read or written.  Everything written to the
+   host files is flushed first, so that they match the snapshot. */
+
+void bdos_snapsave(z80info *z80, FILE *fp)
+{
+    struct bdosinfo *bd = z80->bdos;
+    int i, n;
+
+    bdos_flush(z80);
+    for (i = n = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU)
+	    ++n;
+    snapput(fp, bd->usercode, 1);
+    snapput(fp, n, 2);
+    for (i = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU) {
+	    snapput(fp, bd->stfps[i].where, 2);
+	    fwrite(bd->stfps[i].name, 1, 11, fp);
+	    snapput(fp, bd->stfps[i].cf->pos, 4);
+	    n = strlen(bd->stfps[i].cf->path);
+	    snapput(fp, n, 1);
+	    fwrite(bd->stfps[i].cf->path, 1, n, fp);
+	}
+}
+
+/* Put back the state written by bdos_snapsave(), opening the files
+   again.  Returns FALSE if the snapshot is bad or a file is missing. */
+
+boolean bdos_snaprestore(z80info *z80, FILE *fp)
+{
+    struct bdosinfo *bd = z80->bdos;
+    int i, n, len;
+    unsigned where;
+    long pos;
+    unsigned char name[11];
+    char path[sizeof ((cpmfile *)0)->path];
+    FILE *hfp;
+    cpmfile *cf;
+
+    for (i = 0; i < bd->maxfps; ++i)
+	if (bd->stfps[i].where != 0xffffU) {
+	    delcf(bd->stfps[i].cf);
+	    delfp(z80, bd->stfps[i].where);
+	}
+    bd->usercode = snapget(fp, 1);
+    n = snapget(fp, 2);
+    for (i = 0; i < n; ++i) {
+	where = snapget(fp, 2);
+	if (fread(name, 1, 11, fp) != 11)
+	    return FALSE;
+	pos = snapget(fp, 4);
+	if ((len = snapget(fp, 1)) >= (int)sizeof path ||
+	    fread(path, 1, len, fp) != (size_t)len)
+	    return FALSE;
+	path[len] = '\0';
+	if (!(hfp = cpmfopen(z80, path, "r+b")) &&
+	    !(hfp = cpmfopen(z80, path, "rb"))) {
+	    fprintf(stderr, "cannot open %s again\n", path);
+	    return FALSE;
+	}
+	if (!(cf = newcf(z80, hfp, path))) {
+	    fclose(hfp);
+	    return FALSE;
+	}
+	cf->pos = pos;
+	storefp(z80, cf, where, name);
+    }
+    bd->dirpos = -1;
+    return !feof(fp) && !ferror(fp);
 }
 
 /* emulation of BDOS calls */
 
+/* A call waiting for a key is started again from here for a snapshot:
+   the JP at 5 gets to BDOS_HOOK, with the caller's return on the stack */
+#define BDOS_ENTRY 0x0005
+
 void check_BDOS_hook(z80info *z80) {
+    struct bdosinfo *bd = z80->bdos;
     int i;
     char name[32];
     char name2[32];
     FILE *fp;
+    cpmfile *cf;
     char *s, *t;
     const char *mode;
+    z80->bdoscalls[C]++;
     if (trace_bdos)
     {
+	vtflush(z80->vt);	/* after what the program wrote */
         printf("\r\nbdos %d %s (AF=%04x BC=%04x DE=%04x HL =%04x SP=%04x STACK=", C, bdos_decode(C), AF, BC, DE, HL, SP);
 	for (i = 0; i < 8; ++i)
 	    printf(" %4x", z80->mem[SP + 2*i]
@@ -453,18 +926,20 @@ void check_BDOS_hook(z80info *z80) {
 #endif
 	break;
     case 1:     /* Console Input */
-	HL = kget(0);
+	keywait(z80, BDOS_ENTRY);
+	HL = kget(z80->vt, 0);
+	keywait(z80, -1);
 	B = H; A = L;
 	if (A < ' ') {
 	    switch(A) {
 	    case '\r':
 	    case '\n':
 	    case '\t':
-		vt52(A);
+		vt52(z80->vt, A);
 		break;
 	    default:
-		vt52('^');
-		vt52((A & 0xff)+'@');
+		vt52(z80->vt, '^');
+		vt52(z80->vt, (A & 0xff)+'@');
 		if (A == 3) {	/* ctrl-C pressed */
 		    /* PC = BIOS+3;
 		       check_BIOS_hook(); */
@@ -473,44 +948,50 @@ void check_BDOS_hook(z80info *z80) {
 		}
 	    }
 	} else {
-	    vt52(A);
+	    vt52(z80->vt, A);
 	}
 	break;
     case 2:     /* Console Output */
-	vt52(0x7F & E);
+	vt52(z80->vt, 0x7F & E);
 	HL = 0;
         B = H; A = L;
 	break;
     case 6:     /* direct I/O */
+	keywait(z80, BDOS_ENTRY);
 	switch (E) {
-	case 0xff:  if (!constat()) {
+	case 0xff:  if (!kstat(z80->vt, z80->insns)) {
 	    HL = 0;
             B = H; A = L;
 	    F = 0;
 	    break;
 	} /* FALLTHRU */
-	case 0xfd:  HL = kget(0);
+	case 0xfd:  HL = kget(z80->vt, 0);
             B = H; A = L;
 	    F = 0;
 	    break;
-	case 0xfe:  HL = constat() ? 0xff : 0;
+	case 0xfe:  HL = kstat(z80->vt, z80->insns) ? 0xff : 0;
             B = H; A = L;
 	    F = 0;
 	    break;
-	default:    vt52(0x7F & E);
+	default:    vt52(z80->vt, 0x7F & E);
             HL = 0;
             B = H; A = L;
 	}
+	keywait(z80, -1);
 	break;
     case 9:	/* Print String */
 	s = (char *)(z80->mem + DE);
-	while (*s != '$')
-	    vt52(0x7F & *s++);
+	if ((t = memchr(s, '$', 0x10000L - DE)))
+	    vtputs(z80->vt, s, t - s);
+	else
+	    vtputs(z80->vt, s, 0x10000L - DE);
         HL = 0;
         B = H; A = L;
 	break;
     case 10:    /* Read Command Line */
+	keywait(z80, BDOS_ENTRY);
 	s = rdcmdline(z80, *(unsigned char *)(t = (char *)(z80->mem + DE)), 1);
+	keywait(z80, -1);
 	if (PC == BIOS+3) { 	/* ctrl-C pressed */
 	    /* check_BIOS_hook(); */		/* execute WBOOT */
 	    warmboot(z80);
@@ -519,6 +1000,7 @@ void check_BDOS_hook(z80info *z80) {
 	++t;
 	for (i = 0; i <= *(unsigned char *)s; ++i)
 	    t[i] = s[i];
+	z80_invalidate(z80, DE + 1, i, FALSE);
         HL = 0;
         B = H; A = L;
 	break;
@@ -534,10 +1016,10 @@ void check_BDOS_hook(z80info *z80) {
 	break;
     case 32:    /* Get/Set User Code */
 	if (E == 0xff) {  /* Get Code */
-	    HL = usercode;
+	    HL = bd->usercode;
             B = H; A = L;
 	} else {
-	    usercode = E;
+	    bd->usercode = E;
             HL = 0; /* Or does it get usercode? */
             B = H; A = L;
         }
@@ -546,29 +1028,21 @@ void check_BDOS_hook(z80info *z80) {
 	/* dunno if these are correct */
 
     case 11:	/* Console Status */
-	HL = (constat() ? 0xff : 0x00);
+	keywait(z80, BDOS_ENTRY);
+	HL = (kstat(z80->vt, z80->insns) ? 0xff : 0x00);
+	keywait(z80, -1);
         B = H; A = L;
 	F = 0;
 	break;
 
     case 13:	/* reset disk system */
-	/* storedfps = 0; */	/* WS crashes then */
+	/* the open files are kept: WS crashes if they are dropped */
+	bdos_flush(z80);
 	HL = 0;
         B = H; A = L;
-	if (dp)
-	    closedir(dp);
-	{   struct dirent *de;
-            if ((dp = opendir("."))) {
-                while ((de = readdir(dp))) {
-                    if (strchr(de->d_name, '$')) {
-                        A = 0xff;
-                        break;
-                    }
-                }
-                closedir(dp);
-            }
-        }
-	dp = NULL;
+	if (dirsnap(z80) && bd->dir.dollar)
+	    A = 0xff;
+	bd->dirpos = -1;
 	z80->dma = 0x80;
 	break;
     case 14:	/* select disk */
@@ -579,19 +1053,21 @@ void check_BDOS_hook(z80info *z80) {
 	mode = "r+b";
     fileio:
         /* check if the file is already open */
-        if (!(fp = lookfp(z80, DE))) {
+        if (!(cf = lookfp(z80, DE))) {
             /* not already open - try lowercase */
             FCB_to_filename(z80->mem+DE, name);
-	if (!(fp = fopen(name, mode))) {
+	if (!(fp = cpmfopen(z80, name, mode))) {
 	    FCB_to_ufilename(z80->mem+DE, name); /* Try all uppercase instead */
-            if (!(fp = fopen(name, mode))) {
+            if (!(fp = cpmfopen(z80, name, mode))) {
 	            FCB_to_filename(z80->mem+DE, name);
 		    if (*mode == 'r') {
 			char ss[50];
 			snprintf(ss, sizeof(ss), "%s/%s", CPMLIBDIR, name);
-			fp = fopen(ss, mode);
+			fp = cpmfopen(z80, ss, mode);
 			if (!fp)
-			  fp = fopen(ss, "rb");
+			  fp = cpmfopen(z80, ss, "rb");
+			if (fp)
+			  strcpy(name, ss);
 		    }
 		    if (!fp) {
 			/* still no success */
@@ -602,8 +1078,15 @@ void check_BDOS_hook(z80info *z80) {
 		    }
             }
             }
+	    if (!(cf = newcf(z80, fp, name))) { /* Not a real file? */
+		HL = 0xFF;
+		B = H; A = L;
+		F = 0;
+		fclose(fp);
+		break;
+	    }
             /* where to store fp? */
-            storefp(z80, fp, DE);
+            storefp(z80, cf, DE, z80->mem+DE+1);
 	}
 	/* success */
 
@@ -621,14 +1104,7 @@ void check_BDOS_hook(z80info *z80) {
 
 	z80->mem[DE + FCB_RC] = 0;	/* rc field of FCB */
 
-	if (fixrc(z80, fp)) { /* Not a real file? */
-	    HL = 0xFF;
-            B = H; A = L;
-	    F = 0;
-	    fclose(fp);
-            delfp(z80, DE);
-	    break;
-	}
+	fixrc(z80, cf);
 	HL = 0;
         B = H; A = L;
 	F = 0;
@@ -638,25 +1114,25 @@ void check_BDOS_hook(z80info *z80) {
         {
             long host_size, host_exts;
 
-	    if (!(fp = lookfp(z80, DE))) {
+	    if (!(cf = lookfp(z80, DE))) {
 		/* if the FBC is unknown, return an error */
 		HL = 0xFF;
 		B = H, A = L;
 		break;
 	    }
-            fseek(fp, 0, SEEK_END);
-            host_size = ftell(fp);
+            cfflush(cf);
+            host_size = cfsize(cf);
             host_exts = SEQ_EXTENT(host_size);
             if (host_exts == SEQ_EXT) {
                 /* this is the last extent of the file so we allow the
                    CP/M program to truncate it by reducing RC */
                 if (z80->mem[DE + FCB_RC] < SEQ_CR(host_size)) {
                     host_size = (16384L * SEQ_EXT + 128L * (long)z80->mem[DE + FCB_RC]);
-                    ftruncate(fileno(fp), host_size);
+                    ftruncate(fileno(cf->fp), host_size);
                 }
             }
 	delfp(z80, DE);
-	fclose(fp);
+	delcf(cf);
             z80->mem[DE + FCB_S2] &= 0x7F; /* Clear high bit: indicates closed */
 	HL = 0;
         B = H; A = L;
@@ -664,88 +1140,71 @@ void check_BDOS_hook(z80info *z80) {
         }
 	break;
     case 17:	/* search for first */
-	if (dp)
-	    closedir(dp);
-	if (!(dp = opendir("."))) {
+	if (!dirsnap(z80)) {
 	    fprintf(stderr, "opendir fails\n");
-            resetterm();
-	    exit(1);
+	    exit_cpm(z80, 1);
 	}
-	sfn = DE;
+	bd->dirpos = 0;
+	bd->sfn = DE;
 	/* fall through */
     case 18:	/* search for next */
-	if (!dp)
-	    goto retbad;
-	{   struct dirent *de;
-	    unsigned char *p;
+	{   unsigned char *p;
 	    const char *sr;
-	nocpmname:
-	    if (!(de = readdir(dp))) {
-		closedir(dp);
-		dp = NULL;
-	    retbad:
-	        HL = 0xff;
-                B = H; A = L;
-		F = 0;
-		break;
+	    const unsigned char *q;
+
+	    if (bd->dirpos < 0 || bd->dirpos >= bd->dir.n) {
+		bd->dirpos = -1;
+		goto retbad;
+	    }
+	    sr = (char *)(z80->mem + bd->sfn);
+	    for (; bd->dirpos < bd->dir.n; ++bd->dirpos) {
+		q = bd->dir.name[bd->dirpos];
+		for (i = 1; i <= 11; ++i)
+		    if (sr[i] != '?' && sr[i] != q[i-1])
+			break;
+		/* the extent byte of a host file is always 0 */
+		if (i > 11 && (sr[12] == '?' || sr[12] == 0))
+		    break;
 	    }
-	    /* printf("\r\nlooking at %s\r\n", de->d_name); */
-	    /* compare data */
+	    /* the DMA buffer is cleared once a name has been looked at */
 	    memset(p = z80->mem+z80->dma, 0, 128);	/* dmaaddr instead of DIRBUF!! */
-	    if (*de->d_name == '.')
-		goto nocpmname;
-	    if (strchr(sr = de->d_name, '.')) {
-		if (strlen(de->d_name) > 12)	/* POSIX: namlen */
-		    goto nocpmname;
-	    } else if (strlen(de->d_name) > 8)
-		    goto nocpmname;
-	    /* seems OK */
-	    for (i = 0; i < 8; ++i)
-		if (*sr != '.' && *sr) {
-		    *++p = toupper(*(unsigned char *)sr); sr++;
-		} else
-		    *++p = ' ';
-	    /* skip dot */
-	    while (*sr && *sr != '.')
-		++sr;
-	    while (*sr == '.')
-		++sr;
-	    for (i = 0; i < 3; ++i)
-		if (*sr != '.' && *sr) {
-		    *++p = toupper(*(unsigned char *)sr); sr++;
-		} else
-		    *++p = ' ';
-	    /* OK, fcb block is filled */
-	    /* match name */
-	    p -= 11;
-	    sr = (char *)(z80->mem + sfn);
-	    for (i = 1; i <= 12; ++i)
-		if (sr[i] != '?' && sr[i] != p[i])
-		    goto nocpmname;
+	    z80_invalidate(z80, z80->dma, 128, FALSE);
+	    if (bd->dirpos >= bd->dir.n) {
+		bd->dirpos = -1;
+		goto retbad;
+	    }
+	    memcpy(p + 1, bd->dir.name[bd->dirpos++], 11);
 	    /* yup, it matches */
 	    HL = 0x00;	/* always at pos 0 */
             B = H; A = L;
 	    F = 0;
 	    p[32] = p[64] = p[96] = 0xe5;
+	    break;
 	}
+    retbad:
+	HL = 0xff;
+        B = H; A = L;
+	F = 0;
 	break;
     case 19:	/* delete file (no wildcards yet) */
 	FCB_to_filename(z80->mem + DE, name);
-	unlink(name);
+	cpmunlink(z80, name);
+	bd->dir.valid = 0;
 	HL = 0;
         B = H; A = L;
 	break;
     case 20:	/* read sequential */
-	fp = getfp(z80, DE);
+	cf = getfp(z80, DE);
     readseq:
-	if (!fseek(fp, SEQ_ADDRESS, SEEK_SET) && ((i = fread(z80->mem+z80->dma, 1, 128, fp)) > 0)) {
-	    long ofst = ftell(fp) + 127;
+	if ((i = cfread(cf, SEQ_ADDRESS, z80->mem+z80->dma)) > 0) {
+	    long ofst = cf->pos + 127;
 	    if (i != 128)
 		memset(z80->mem+z80->dma+i, 0x1a, 128-i);
+	    z80_invalidate(z80, z80->dma, 128, FALSE);	/* may be loading code */
 	    z80->mem[DE + FCB_CR] = SEQ_CR(ofst);
 	    z80->mem[DE + FCB_EX] = SEQ_EX(ofst);
 	    z80->mem[DE + FCB_S2] = (0x80 | SEQ_S2(ofst));
-	    fixrc(z80, fp);
+	    fixrc(z80, cf);
 	    HL = 0x00;
             B = H; A = L;
 	} else {
@@ -754,15 +1213,14 @@ void check_BDOS_hook(z80info *z80) {
 	}    
 	break;
     case 21:	/* write sequential */
-	fp = getfp(z80, DE);
+	cf = getfp(z80, DE);
     writeseq:
-	if (!fseek(fp, SEQ_ADDRESS, SEEK_SET) && fwrite(z80->mem+z80->dma, 1, 128, fp) == 128) {
-	    long ofst = ftell(fp);
+	if (!cfwrite(cf, SEQ_ADDRESS, z80->mem+z80->dma)) {
+	    long ofst = cf->pos;
 	    z80->mem[DE + FCB_CR] = SEQ_CR(ofst);
 	    z80->mem[DE + FCB_EX] = SEQ_EX(ofst);
 	    z80->mem[DE + FCB_S2] = (0x80 | SEQ_S2(ofst));
-            fflush(fp);
-	    fixrc(z80, fp);
+	    fixrc(z80, cf);
 	    HL = 0x00;
             B = H; A = L;
 	} else {
@@ -772,12 +1230,14 @@ void check_BDOS_hook(z80info *z80) {
 	break;
     case 22:	/* make file */
 	mode = "w+b";
+	bd->dir.valid = 0;
 	goto fileio;
     case 23:	/* rename file */
 	FCB_to_filename(z80->mem + DE, name);
 	FCB_to_filename(z80->mem + DE + 16, name2);
 	/* printf("rename %s %s called\n", name, name2); */
-	rename(name, name2);
+	cpmrename(z80, name, name2);
+	bd->dir.valid = 0;
 	HL = 0;
         B = H; A = L;
 	break;
@@ -803,7 +1263,7 @@ void check_BDOS_hook(z80info *z80) {
     case 33:	/* read random record */
         {
         long ofst;
-	fp = getfp(z80, DE);
+	cf = getfp(z80, DE);
 	/* printf("data is %02x %02x %02x\n", z80->mem[z80->regde+33],
 	       z80->mem[z80->regde+34], z80->mem[z80->regde+35]); */
 	ofst = ADDRESS;
@@ -815,7 +1275,7 @@ void check_BDOS_hook(z80info *z80) {
     case 34:	/* write random record */
         {
         long ofst;
-	fp = getfp(z80, DE);
+	cf = getfp(z80, DE);
 	/* printf("data is %02x %02x %02x\n", z80->mem[z80->regde+33],
 	       z80->mem[z80->regde+34], z80->mem[z80->regde+35]); */
 	ofst = ADDRESS;
@@ -825,13 +1285,13 @@ void check_BDOS_hook(z80info *z80) {
 	goto writeseq;
 	}
     case 35:	/* compute file size */
-	fp = getfp(z80, DE);
-	fseek(fp, 0L, SEEK_END);
+	cf = getfp(z80, DE);
+	cf->pos = cfsize(cf);
 	/* fall through */
     case 36:	/* set random record */
-	fp = getfp(z80, DE);
+	cf = getfp(z80, DE);
 	{   
-	    long ofst = ftell(fp) + 127;
+	    long ofst = cf->pos + 127;
 	    long pos = (ofst >> 7);
 	    HL = 0x00;	/* dunno, if necessary */
             B = H; A = L;
@@ -841,13 +1301,14 @@ void check_BDOS_hook(z80info *z80) {
             z80->mem[DE + FCB_CR] = SEQ_CR(ofst);
 	    z80->mem[DE + FCB_EX] = SEQ_EX(ofst);
 	    z80->mem[DE + FCB_S2] = (0x80 | SEQ_S2(ofst));
-	    fixrc(z80, fp);
+	    fixrc(z80, cf);
 	}
 	break;
     case 41:
 	for (s = (char *)(z80->mem + DE); *s; ++s)
 	    *s = tolower(*(unsigned char *)s);
-	HL = (restricted_mode || chdir((char  *)(z80->mem + DE))) ? 0xff : 0x00;
+	HL = (restricted_mode || cpmchdir(z80, (char *)(z80->mem + DE))) ?
+	    0xff : 0x00;
         B = H; A = L;
 	break;
     default:
@@ -858,9 +1319,10 @@ void check_BDOS_hook(z80info *z80) {
 	    printf(" %4x", z80->mem[SP + 2*i]
 		   + 256 * z80->mem[SP + 2*i + 1]);
 	printf("\r\n");
-	resetterm();
-	exit(1);
+	exit_cpm(z80, 1);
     }
-    z80->mem[PC = DIRBUF-1] = 0xc9; /* Return instruction */
+    PC = DIRBUF-1;
+    if (RAWMEM(PC) != 0xc9)	/* it is run, so only write it if need be */
+	SETMEM(PC, 0xc9); /* Return instruction */
     return;
 }
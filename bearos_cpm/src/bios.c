@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include "cpmdisc.h"
 #include "defs.h"
+#include "vt.h"
 
 #ifdef macintosh
 #include <stat.h>
@@ -25,6 +26,16 @@
 #include <sys/stat.h>
 #endif
 
+#include <unistd.h>
+
+#ifdef DISK_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef HOST_AT
+#include <fcntl.h>
+#endif
+
 /* definition of: extern unsigned char	cpm_array[]; */
 #include "cpm.inc"
 
@@ -72,10 +83,6 @@
 #define END_OF_BIOS	(TIMEBUF + TIMEBUFSIZE)
 
 
-/* ST-506 HD sector info (floppy defs are in cpmdisc.h for makedisc.c) */
-#define	HDSECTORSPERTRACK	64
-#define	HDTRACKSPERDISC		610
-
 /* offsets into FCB needed for reading/writing Unix files */
 #define FDOFFSET	12
 #define BLKOFFSET	16
@@ -93,19 +100,328 @@
 #define USERSTART	0x0100
 
 
+/* how many sectors to keep in the cache below - 0 leaves it out */
+#ifndef SECTCACHE
+#ifdef BEAROS
+#define SECTCACHE	32
+#else
+#define SECTCACHE	256
+#endif
+#endif
+
 /* forward declarations: */
 static void seldisc(z80info *z80);
 
 
+#ifdef DISK_MMAP
+/* map the disk images into memory, so that reading or writing a sector
+   is just a memcpy() (--mmap) */
+int mapdisks = 0;
+
+/* map the first "len" bytes of the image for "drive" - on failure the
+   image is just read & written with stdio instead */
+static void
+mapdisk(z80info *z80, int drive, long len)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fileno(z80->drives[drive]), 0);
+
+	z80->drivemap[drive] = p == MAP_FAILED ? NULL : p;
+	z80->drivemaplen[drive] = len;
+}
+
+/* an image that is written past its end is made at least twice as big
+   while it is mapped, so that it is not mapped again for every sector  --
+   the room past "drivelen" is kept full of empty (0xE5) sectors, and is
+   cut off again when the image is unmapped (an image left bigger by
+   quitting some other way just has more empty sectors) */
+static boolean
+growdisk(z80info *z80, int drive, long len)
+{
+	long old = z80->drivemaplen[drive];
+
+	if (len < old * 2)
+		len = old * 2;
+
+	munmap(z80->drivemap[drive], old);
+	z80->drivemap[drive] = NULL;
+
+	if (ftruncate(fileno(z80->drives[drive]), len) != 0)
+		return FALSE;
+
+	mapdisk(z80, drive, len);
+
+	if (z80->drivemap[drive] == NULL)
+		return FALSE;
+
+	memset(z80->drivemap[drive] + old, 0xE5, len - old);
+	return TRUE;
+}
+
+static void
+unmapdisk(z80info *z80, int drive)
+{
+	if (z80->drivemap[drive] != NULL)
+	{
+		msync(z80->drivemap[drive], z80->drivemaplen[drive], MS_SYNC);
+		munmap(z80->drivemap[drive], z80->drivemaplen[drive]);
+		z80->drivemap[drive] = NULL;
+
+		if (z80->drivemaplen[drive] > z80->drivelen[drive])
+			ftruncate(fileno(z80->drives[drive]),
+				z80->drivelen[drive]);
+	}
+}
+#endif
+
+
+#if SECTCACHE > 0
+/* The sectors read & written last are kept in a write-back cache, so
+   that the directory sectors read again for every file opened or looked
+   for do not have to come from the disk image each time  --  on BearOS
+   each of those is a trip to the SD card.  Slots are found by hashing
+   the drive & the offset of the sector in its image (which is just its
+   track & sector), the least recently used slot is the one reused, and
+   a written sector only goes to the image when its slot is reused, or
+   when flushsectors() is called from closeall() or by flush_cpm().
+   Writes past the end of an image still go straight to it, to grow it.
+   Only --nobdos reads the images much, so only then is there a cache. */
+
+#define SECTHASH	(SECTCACHE / 2 + 1)
+#define SECTSLOT(drive, offset)	\
+		(int)(((drive) * 977L + (offset) / SECTORSIZE) % SECTHASH)
+
+struct sectslot
+{
+	int drive;		/* -1 when the slot is free */
+	FILE *fp;		/* the image, while the slot is dirty */
+	long offset;		/* of the sector in the image */
+	unsigned long used;	/* "sectclock" when it was last used */
+	boolean dirty;		/* still to be written to the image */
+	int next;		/* next slot in the same hash chain, or -1 */
+	byte data[SECTORSIZE];
+};
+#endif
+
+/* how many unix files openunix() & createunix() can have open */
+#define CPM_FILES 4
+
+/* everything the BIOS keeps for one machine, in z80->bios */
+struct biosinfo
+{
+#if SECTCACHE > 0
+	struct sectslot *sectcache;	/* NULL without --nobdos */
+	int secthash[SECTHASH];
+	unsigned long sectclock;
+#endif
+	FILE *list;		/* the "list" file, while it is open */
+	FILE *cpm_file[CPM_FILES];
+};
+
+
+#if SECTCACHE > 0
+static int
+findsector(struct biosinfo *bi, int drive, long offset)
+{
+	int i;
+
+	for (i = bi->secthash[SECTSLOT(drive, offset)]; i >= 0;
+			i = bi->sectcache[i].next)
+		if (bi->sectcache[i].drive == drive &&
+				bi->sectcache[i].offset == offset)
+		{
+			bi->sectcache[i].used = ++bi->sectclock;
+			return i;
+		}
+
+	return -1;
+}
+
+/* write a dirty sector back to its image */
+static void
+putsector(struct sectslot *s)
+{
+	if (fseek(s->fp, s->offset, SEEK_SET) != 0 ||
+			fwrite(s->data, 1, SECTORSIZE, s->fp) != SECTORSIZE)
+		fprintf(stderr, "wrsector(): write failure!\r\n");
+
+	s->dirty = FALSE;
+}
+
+/* take a slot off its hash chain & free it */
+static void
+dropslot(struct biosinfo *bi, int i)
+{
+	struct sectslot *s = &bi->sectcache[i];
+	int *p = &bi->secthash[SECTSLOT(s->drive, s->offset)];
+
+	while (*p != i)
+		p = &bi->sectcache[*p].next;
+
+	*p = s->next;
+	s->drive = -1;
+}
+
+/* get a slot for a sector that is not in the cache, by reusing the
+   least recently used one - "findsector" must have been called first */
+static int
+newsector(struct biosinfo *bi, int drive, long offset)
+{
+	struct sectslot *sc = bi->sectcache;
+	int i, lru = 0;
+
+	for (i = 0; i < SECTCACHE; i++)
+		if (sc[i].drive < 0)
+		{
+			lru = i;
+			break;
+		}
+		else if (sc[i].used < sc[lru].used)
+			lru = i;
+
+	if (sc[lru].drive >= 0)
+	{
+		if (sc[lru].dirty)
+			putsector(&sc[lru]);
+
+		dropslot(bi, lru);
+	}
+
+	sc[lru].drive = drive;
+	sc[lru].offset = offset;
+	sc[lru].used = ++bi->sectclock;
+	sc[lru].dirty = FALSE;
+	sc[lru].next = bi->secthash[SECTSLOT(drive, offset)];
+	bi->secthash[SECTSLOT(drive, offset)] = lru;
+	return lru;
+}
+
+/* write all the dirty sectors back to their images */
+static void
+flushsectors(struct biosinfo *bi)
+{
+	int i;
+
+	if (bi->sectcache == NULL)
+		return;
+
+	for (i = 0; i < SECTCACHE; i++)
+		if (bi->sectcache[i].drive >= 0 && bi->sectcache[i].dirty)
+			putsector(&bi->sectcache[i]);
+}
+
+#ifdef DISK_MMAP
+/* forget the sectors of a drive, once its image has been mapped */
+static void
+dropsectors(struct biosinfo *bi, int drive)
+{
+	int i;
+
+	if (bi->sectcache == NULL)
+		return;
+
+	for (i = 0; i < SECTCACHE; i++)
+		if (bi->sectcache[i].drive == drive)
+			dropslot(bi, i);
+}
+#endif
+#endif
+
+
+/* The host files a machine uses are looked for in its own working
+   directory, "z80->dirfd"  --  where there is no openat() & co, or the
+   machine was given no directory of its own, that is the process's. */
+
+FILE *
+cpmfopen(z80info *z80, const char *name, const char *mode)
+{
+#ifdef HOST_AT
+	int flags, fd;
+	FILE *fp;
+
+	flags = strchr(mode, '+') ? O_RDWR :
+			*mode == 'r' ? O_RDONLY : O_WRONLY;
+
+	if (*mode == 'w')
+		flags |= O_CREAT | O_TRUNC;
+	else if (*mode == 'a')
+		flags |= O_CREAT | O_APPEND;
+
+	if ((fd = openat(z80->dirfd, name, flags, 0666)) < 0)
+		return NULL;
+
+	if ((fp = fdopen(fd, mode)) == NULL)
+		close(fd);
+
+	return fp;
+#else
+	(void)z80;
+	return fopen(name, mode);
+#endif
+}
+
+int
+cpmunlink(z80info *z80, const char *name)
+{
+#ifdef HOST_AT
+	return unlinkat(z80->dirfd, name, 0);
+#else
+	(void)z80;
+	return unlink(name);
+#endif
+}
+
+int
+cpmrename(z80info *z80, const char *from, const char *to)
+{
+#ifdef HOST_AT
+	return renameat(z80->dirfd, from, z80->dirfd, to);
+#else
+	(void)z80;
+	return rename(from, to);
+#endif
+}
+
+/* change the machine's working directory  --  the process's own one
+   goes with it unless the machine has a directory of its own */
+int
+cpmchdir(z80info *z80, const char *dir)
+{
+#ifdef HOST_AT
+	int fd;
+
+	if (z80->dirfd == AT_FDCWD)
+		return chdir(dir);
+
+	if ((fd = openat(z80->dirfd, dir, O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+
+	close(z80->dirfd);
+	z80->dirfd = fd;
+	return 0;
+#else
+	(void)z80;
+	return chdir(dir);
+#endif
+}
+
+
 static void
 closeall(z80info *z80)
 {
 	int	i;
 
+#if SECTCACHE > 0
+	flushsectors(z80->bios);
+#endif
+
 	for (i = 0; i < MAXDISCS; i++)
 	{
 		if (z80->drives[i] != NULL)
 		{
+#ifdef DISK_MMAP
+			unmapdisk(z80, i);
+#endif
 			fclose(z80->drives[i]);
 			z80->drives[i] = NULL;
 		}
@@ -118,14 +434,22 @@ warmboot(z80info *z80)
 	unsigned int i;
 
 	closeall(z80);
+	bdos_flush(z80);
 
-	if (silent_exit) {
+	if (z80->silent_exit) {
 		finish(z80);
 	}
 
+#ifdef BLOCK_CACHE
+	/* the next program's writes over its code are counted afresh */
+	memset(z80->smcwrites, 0, sizeof z80->smcwrites);
+#endif
+
 	/* load CCP and BDOS into memory (max 0x1600 in size) */
 	for (i = 0; i < 0x1600 && i < sizeof cpm_array; i++)
-		SETMEM(CCP + i, cpm_array[i]);
+		RAWMEM(CCP + i) = cpm_array[i];
+
+	z80_invalidate(z80, CCP, i, FALSE);
 
 	/* try to load CCP/BDOS from disk, but ignore any errors */
 	loadfile(z80, "bdos.hex");
@@ -168,15 +492,16 @@ warmboot(z80info *z80)
 	/* disc parameter block - a 5Mb ST-506 hard disc */
 	SETMEM(HDPBLOCK, HDSECTORSPERTRACK & 0xFF);/* SPT - sectors per track */
 	SETMEM(HDPBLOCK + 1, HDSECTORSPERTRACK >> 8);
-	SETMEM(HDPBLOCK + 2, 4);	/* BSH - data block shift factor */
-	SETMEM(HDPBLOCK + 3, 15);		/* BLM - data block mask */
+	SETMEM(HDPBLOCK + 2, HDBLOCKSHIFT); /* BSH - data block shift factor */
+	SETMEM(HDPBLOCK + 3, HDSECTORSPERBLOCK - 1); /* BLM - data block mask */
 	SETMEM(HDPBLOCK + 4, 0);		/* EXM - extent mask */
-	SETMEM(HDPBLOCK + 5, 2441 & 0xFF);	/* DSM - total drive capacity */
-	SETMEM(HDPBLOCK + 6, 2441 >> 8);
-	SETMEM(HDPBLOCK + 7, 1023 & 0xFF);	/* DRM - total dir entries */
-	SETMEM(HDPBLOCK + 8, 1023 >> 8);
-	SETMEM(HDPBLOCK + 9, 0xFF);	/* AL0 - blocks for directory entries */
-	SETMEM(HDPBLOCK + 10, 0xFF);	/* AL1 */
+	SETMEM(HDPBLOCK + 5, (HDTOTALBLOCKS - 1) & 0xFF); /* DSM - total drive capacity */
+	SETMEM(HDPBLOCK + 6, (HDTOTALBLOCKS - 1) >> 8);
+	SETMEM(HDPBLOCK + 7, (HDTOTALEXTENTS - 1) & 0xFF); /* DRM - total dir entries */
+	SETMEM(HDPBLOCK + 8, (HDTOTALEXTENTS - 1) >> 8);
+	/* AL0 - blocks for directory entries */
+	SETMEM(HDPBLOCK + 9, DIRALLOC(HDTOTALEXTENTS, HDBLOCKSHIFT) >> 8);
+	SETMEM(HDPBLOCK + 10, DIRALLOC(HDTOTALEXTENTS, HDBLOCKSHIFT) & 0xFF); /* AL1 */
 	SETMEM(HDPBLOCK + 11, 0x00);	/* CKS - directory check vector */
 	SETMEM(HDPBLOCK + 12, 0x00);
 	SETMEM(HDPBLOCK + 13, RESERVEDTRACKS & 0xFF);/* OFF - reserved tracks */
@@ -208,15 +533,16 @@ warmboot(z80info *z80)
 	/* disc parameter block - a single-sided single-density 8" 256k disc */
 	SETMEM(DPBLOCK, SECTORSPERTRACK & 0xFF); /* SPT - sectors per track */
 	SETMEM(DPBLOCK + 1, SECTORSPERTRACK >> 8);
-	SETMEM(DPBLOCK + 2, 3);		/* BSH - data block shift factor */
-	SETMEM(DPBLOCK + 3, 7);			/* BLM - data block mask */
+	SETMEM(DPBLOCK + 2, BLOCKSHIFT);	/* BSH - data block shift factor */
+	SETMEM(DPBLOCK + 3, SECTORSPERBLOCK - 1); /* BLM - data block mask */
 	SETMEM(DPBLOCK + 4, 0);			/* EXM - extent mask */
-	SETMEM(DPBLOCK + 5, 242);	/* DSM - total capacity of drive */
+	SETMEM(DPBLOCK + 5, TOTALBLOCKS - 1);	/* DSM - total capacity of drive */
 	SETMEM(DPBLOCK + 6, 0);
-	SETMEM(DPBLOCK + 7, 63);	/* DRM - total directory entries */
+	SETMEM(DPBLOCK + 7, TOTALEXTENTS - 1);	/* DRM - total directory entries */
 	SETMEM(DPBLOCK + 8, 0);
-	SETMEM(DPBLOCK + 9, 0xC0);	/* AL0 - blocks for directory entries */
-	SETMEM(DPBLOCK + 10, 0x00);	/* AL1 */
+	/* AL0 - blocks for directory entries */
+	SETMEM(DPBLOCK + 9, DIRALLOC(TOTALEXTENTS, BLOCKSHIFT) >> 8);
+	SETMEM(DPBLOCK + 10, DIRALLOC(TOTALEXTENTS, BLOCKSHIFT) & 0xFF); /* AL1 */
 	SETMEM(DPBLOCK + 11, 0x00);	/* CKS - directory check vector */
 	SETMEM(DPBLOCK + 12, 0x00);
 	SETMEM(DPBLOCK + 13, RESERVEDTRACKS & 0xFF); /* OFF - reserved tracks */
@@ -292,16 +618,195 @@ sysreset(z80info *z80)
 	boot(z80);
 }
 
+
+/* A snapshot of the whole machine, so that a program can be started
+   again just where it was  --  the registers, memory, the BIOS state
+   and the open files of the BDOS emulation.  The numbers are written
+   least-significant byte first, so that a snapshot will do on any host. */
+
+#define SNAPMAGIC	"Z80SNAP"
+#define SNAPVERSION	1
+
+/* The counts are written as 8 bytes, but "unsigned long" may only have
+   4, as on the Pico: then the top ones are written as 0 & not read. */
+
+void
+snapput(FILE *fp, unsigned long val, int n)
+{
+	while (n-- > 0)
+	{
+		putc((int)(val & 0xFF), fp);
+		val >>= 8;
+	}
+}
+
+unsigned long
+snapget(FILE *fp, int n)
+{
+	unsigned long val = 0;
+	int i, c;
+
+	for (i = 0; i < n; i++)
+		if ((c = getc(fp)) != EOF && i < (int)sizeof val)
+			val |= (unsigned long)c << (8 * i);
+
+	return val;
+}
+
+/* write a snapshot to "fname"  --  if "pc" is not -1, the PC is saved
+   as that instead, to start a BIOS or BDOS call again */
+boolean
+savesnapshot(z80info *z80, const char *fname, int pc)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(fname, "wb")) == NULL)
+	{
+		perror(fname);
+		return FALSE;
+	}
+
+#if SECTCACHE > 0
+	flushsectors(z80->bios);
+#endif
+
+	fwrite(SNAPMAGIC, 1, sizeof SNAPMAGIC - 1, fp);
+	putc(SNAPVERSION, fp);
+	putc(nobdos, fp);
+
+	snapput(fp, AF, 2);
+	snapput(fp, BC, 2);
+	snapput(fp, DE, 2);
+	snapput(fp, HL, 2);
+	snapput(fp, AF2, 2);
+	snapput(fp, BC2, 2);
+	snapput(fp, DE2, 2);
+	snapput(fp, HL2, 2);
+	snapput(fp, SP, 2);
+	snapput(fp, pc == -1 ? PC : pc, 2);
+	snapput(fp, IX, 2);
+	snapput(fp, IY, 2);
+	putc(I, fp);
+	putc(R, fp);
+	putc(IFF, fp);
+	putc(IFF2, fp);
+	putc(IMODE, fp);
+
+	putc(z80->drive, fp);
+	snapput(fp, z80->dma, 2);
+	snapput(fp, z80->track, 2);
+	snapput(fp, z80->sector, 2);
+
+	snapput(fp, z80->cycles, 8);
+	snapput(fp, z80->insns, 8);
+
+	fwrite(z80->mem, 1, sizeof z80->mem, fp);
+
+	if (!nobdos)
+		bdos_snapsave(z80, fp);
+
+	i = ferror(fp);
+
+	if (fclose(fp) || i)
+	{
+		fprintf(stderr, "error writing snapshot %s\r\n", fname);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* put the machine back as it was when "fname" was written */
+boolean
+loadsnapshot(z80info *z80, const char *fname)
+{
+	FILE *fp;
+	char magic[sizeof SNAPMAGIC];
+	boolean ok;
+
+	if ((fp = fopen(fname, "rb")) == NULL)
+	{
+		perror(fname);
+		return FALSE;
+	}
+
+	if (fread(magic, 1, sizeof magic, fp) != sizeof magic ||
+			memcmp(magic, SNAPMAGIC, sizeof magic - 1) ||
+			magic[sizeof magic - 1] != SNAPVERSION)
+	{
+		fprintf(stderr, "%s is not a snapshot\r\n", fname);
+		fclose(fp);
+		return FALSE;
+	}
+
+	if (getc(fp) != nobdos)
+	{
+		fprintf(stderr, "%s was %s with --nobdos\r\n", fname,
+			nobdos ? "not written" : "written");
+		fclose(fp);
+		return FALSE;
+	}
+
+	AF = snapget(fp, 2);
+	BC = snapget(fp, 2);
+	DE = snapget(fp, 2);
+	HL = snapget(fp, 2);
+	AF2 = snapget(fp, 2);
+	BC2 = snapget(fp, 2);
+	DE2 = snapget(fp, 2);
+	HL2 = snapget(fp, 2);
+	SP = snapget(fp, 2);
+	PC = snapget(fp, 2);
+	IX = snapget(fp, 2);
+	IY = snapget(fp, 2);
+	I = getc(fp);
+	R = getc(fp);
+	IFF = getc(fp);
+	IFF2 = getc(fp);
+	IMODE = getc(fp);
+
+	z80->drive = getc(fp);
+	z80->dma = snapget(fp, 2);
+	z80->track = snapget(fp, 2);
+	z80->sector = snapget(fp, 2);
+
+	z80->cycles = snapget(fp, 8);
+	z80->insns = snapget(fp, 8);
+
+	ok = fread(z80->mem, 1, sizeof z80->mem, fp) == sizeof z80->mem;
+	z80_invalidate(z80, 0, 0x10000L, FALSE);
+
+	if (ok && !nobdos)
+		ok = bdos_snaprestore(z80, fp);
+
+	if (ok && ferror(fp))
+		ok = FALSE;
+
+	fclose(fp);
+
+	if (!ok)
+		fprintf(stderr, "snapshot %s is damaged\r\n", fname);
+
+	return ok;
+}
+
+/* the console calls start 4 bytes back, with LD A,fn & OUT (0FFH),A */
+
 static void
 consstat(z80info *z80)
 {
+	keywait(z80, PC - 4);
 	input(z80, 0x01, 0x01, &A);
+	keywait(z80, -1);
 }
 
 static void
 consin(z80info *z80)
 {
+	keywait(z80, PC - 4);
 	input(z80, 0x00, 0x00, &A);
+	keywait(z80, -1);
 
 /* What is this for? It messing up Ctrl-S...
 	if (A == CNTL('S'))
@@ -319,25 +824,25 @@ consout(z80info *z80)
 static void
 list(z80info *z80)
 {
-	static FILE *fp = NULL;
+	struct biosinfo *bi = z80->bios;
 
-	if (fp == NULL)
+	if (bi->list == NULL)
 	{
-		fp = fopen("list", "w");
+		bi->list = cpmfopen(z80, "list", "w");
 
-		if (fp == NULL)
+		if (bi->list == NULL)
 			return;
 	}
 
 	/* close up on EOF */
 	if (C == CNTL('D') || C == '\0')
 	{
-		fclose(fp);
-		fp = NULL;
+		fclose(bi->list);
+		bi->list = NULL;
 		return;
 	}
 
-	putc(C, fp);
+	putc(C, bi->list);
 }
 
 /* punch character in C */
@@ -379,10 +884,10 @@ realizedisk(z80info *z80)
 		long secs;
 		FILE *fp;
 
-		fp = fopen(drivestr, "rb+");
+		fp = cpmfopen(z80, drivestr, "rb+");
 
 		if (fp == NULL)
-			fp = fopen(drivestr, "wb+");
+			fp = cpmfopen(z80, drivestr, "wb+");
 
 		if (fp == NULL)
 		{
@@ -391,7 +896,7 @@ realizedisk(z80info *z80)
 			return;
 		}
 
-		if (stat(drivestr, &statbuf) < 0)
+		if (fstat(fileno(fp), &statbuf) < 0)
 		{
 			fprintf(stderr, "seldisc(): Cannot stat file '%s'!\r\n",
 					drivestr);
@@ -422,6 +927,18 @@ realizedisk(z80info *z80)
 
 		z80->drives[drive] = fp;
 		z80->drivelen[drive] = secs * SECTORSIZE;
+
+#ifdef DISK_MMAP
+		if (mapdisks)
+		{
+			fflush(fp);
+			mapdisk(z80, drive, z80->drivelen[drive]);
+#if SECTCACHE > 0
+			if (z80->drivemap[drive] != NULL)
+				dropsectors(z80->bios, drive);
+#endif
+		}
+#endif
 	}
 }
 
@@ -509,6 +1026,9 @@ rdsector(z80info *z80)
 		return;
 	}
 
+	/* the sector may well be code, so drop anything decoded from there */
+	z80_invalidate(z80, z80->dma, SECTORSIZE, FALSE);
+
 	if (len && offset >= len)
 	{
 	    memset(&(z80->mem[z80->dma]), 0xE5, SECTORSIZE);
@@ -516,6 +1036,27 @@ rdsector(z80info *z80)
 	    return;
 	}
 
+#ifdef DISK_MMAP
+	if (z80->drivemap[drive] != NULL)
+	{
+		memcpy(&(z80->mem[z80->dma]), z80->drivemap[drive] + offset,
+			SECTORSIZE);
+		A = 0;
+		return;
+	}
+#endif
+
+#if SECTCACHE > 0
+	if (z80->bios->sectcache != NULL &&
+			(n = findsector(z80->bios, drive, offset)) >= 0)
+	{
+		memcpy(&(z80->mem[z80->dma]), z80->bios->sectcache[n].data,
+			SECTORSIZE);
+		A = 0;
+		return;
+	}
+#endif
+
 	if (fseek(fp, offset, SEEK_SET) != 0)
 	{
 		fprintf(stderr, "rdsector(): fseek failure offset=0x%lX!\r\n",
@@ -532,7 +1073,17 @@ rdsector(z80info *z80)
 		A = 1;
 	}
 	else
+	{
 		A = 0;
+#if SECTCACHE > 0
+		if (z80->bios->sectcache != NULL)
+		{
+			n = newsector(z80->bios, drive, offset);
+			memcpy(z80->bios->sectcache[n].data,
+				&(z80->mem[z80->dma]), SECTORSIZE);
+		}
+#endif
+	}
 }
 
 
@@ -557,6 +1108,47 @@ wrsector(z80info *z80)
 		return;
 	}
 
+#ifdef DISK_MMAP
+	if (z80->drivemap[drive] != NULL)
+	{
+		/* any sectors skipped over are already empty */
+		if (offset + SECTORSIZE > z80->drivemaplen[drive] &&
+				!growdisk(z80, drive, offset + SECTORSIZE))
+		{
+			fprintf(stderr, "wrsector(): cannot grow the image!\r\n");
+			A = 1;
+			return;
+		}
+
+		memcpy(z80->drivemap[drive] + offset,
+			&(z80->mem[z80->dma]), SECTORSIZE);
+
+		if (offset + SECTORSIZE > len)
+			z80->drivelen[drive] = offset + SECTORSIZE;
+
+		A = 0;
+		return;
+	}
+#endif
+
+#if SECTCACHE > 0
+	if (z80->bios->sectcache != NULL && offset + SECTORSIZE <= len)
+	{
+		struct sectslot *sc;
+		int i;
+
+		if ((i = findsector(z80->bios, drive, offset)) < 0)
+			i = newsector(z80->bios, drive, offset);
+
+		sc = &z80->bios->sectcache[i];
+		memcpy(sc->data, &(z80->mem[z80->dma]), SECTORSIZE);
+		sc->fp = fp;
+		sc->dirty = TRUE;
+		A = 0;
+		return;
+	}
+#endif
+
 	if (len && offset > len)
 	{
 		char buf[SECTORSIZE];
@@ -662,12 +1254,9 @@ int2addr(unsigned char *addr, int val)
 
 /* Allocate file pointers - index is stored in DE */
 
-#define CPM_FILES 4
-
-FILE *cpm_file[CPM_FILES];
-
-int cpm_file_alloc(FILE *f)
+static int cpm_file_alloc(z80info *z80, FILE *f)
 {
+	FILE **cpm_file = z80->bios->cpm_file;
 	int x;
 	for (x = 0; x != CPM_FILES; ++x)
 		if (!cpm_file[x]) {
@@ -677,16 +1266,17 @@ int cpm_file_alloc(FILE *f)
 	return -1;
 }
 
-FILE *cpm_file_get(int idx)
+static FILE *cpm_file_get(z80info *z80, int idx)
 {
-	if (idx < 0 || idx > CPM_FILES)
+	if (idx < 0 || idx >= CPM_FILES)
 		return 0;
 	else
-		return cpm_file[idx];
+		return z80->bios->cpm_file[idx];
 }
 
-int cpm_file_free(int x)
+static int cpm_file_free(z80info *z80, int x)
 {
+	FILE **cpm_file = z80->bios->cpm_file;
 	if (x >= 0 && x < CPM_FILES && cpm_file[x]) {
 		int rtn = fclose(cpm_file[x]);
 		cpm_file[x] = 0;
@@ -729,11 +1319,11 @@ openunix(z80info *z80)
 	A = 0xFF;
 
 	/* if file is not readable, try opening it read-only */
-	if ((fd = fopen(filename, "rb+")) == NULL)
-		if ((fd = fopen(filename, "rb")) == NULL)
+	if ((fd = cpmfopen(z80, filename, "rb+")) == NULL)
+		if ((fd = cpmfopen(z80, filename, "rb")) == NULL)
 			return;
 
-	fd_no = cpm_file_alloc(fd);
+	fd_no = cpm_file_alloc(z80, fd);
 	if (fd_no != -1)
 		A = 0;
 
@@ -775,10 +1365,10 @@ createunix(z80info *z80)
 	*fp = 0;
 	A = 0xFF;
 
-	if ((fd = fopen(filename, "wb+")) == NULL)
+	if ((fd = cpmfopen(z80, filename, "wb+")) == NULL)
 		return;
 
-	fd_no = cpm_file_alloc(fd);
+	fd_no = cpm_file_alloc(z80, fd);
 	if (fd_no != -1)
 		A = 0;
 
@@ -801,7 +1391,7 @@ rdunix(z80info *z80)
 	int fd_no;
   
 	cp = &(z80->mem[z80->dma]);
-	fd = cpm_file_get((fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
+	fd = cpm_file_get(z80, (fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
 	blk = addr2int(&z80->mem[DE + BLKOFFSET]);
 	size = addr2int(&z80->mem[DE + SZOFFSET]);
 
@@ -813,6 +1403,7 @@ rdunix(z80info *z80)
 	if (fseek(fd, (long)blk << 7, SEEK_SET) != 0)
 		return;
 
+	z80_invalidate(z80, z80->dma, SECTORSIZE, FALSE);
 	i = fread(cp, 1, SECTORSIZE, fd);
 	size = i;
 
@@ -844,7 +1435,7 @@ wrunix(z80info *z80)
 	int fd_no;
 
 	cp = &(z80->mem[z80->dma]);
-	fd = cpm_file_get((fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
+	fd = cpm_file_get(z80, (fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
 	blk = addr2int(&z80->mem[DE + BLKOFFSET]);
 	size = addr2int(&z80->mem[DE + SZOFFSET]);
 
@@ -878,7 +1469,7 @@ closeunix(z80info *z80)
 	fd_no = addr2int(&z80->mem[DE + FDOFFSET]);
 	A = 0xFF;
 
-	if (cpm_file_free(fd_no))
+	if (cpm_file_free(z80, fd_no))
 		return;
 
 	A = 0;
@@ -888,9 +1479,155 @@ closeunix(z80info *z80)
 void
 finish(z80info *z80)
 {
-	(void)z80;
+	exit_cpm(z80, 0);
+}
+
+/* Set up the CP/M machine around "z80", with "in" & "out" as the
+   keyboard & screen of its console and "dir" as its working directory
+   (NULL for the process's)  --  FALSE if there is no such directory or
+   no memory.  Run it with sysreset() & z80_emulator(). */
+boolean
+init_cpm(z80info *z80, const char *dir, int in, int out)
+{
+	int i;
+
+#ifdef HOST_AT
+	z80->dirfd = AT_FDCWD;
+
+	if (dir != NULL &&
+			(z80->dirfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		perror(dir);
+		return FALSE;
+	}
+#else
+	/* there is only the one working directory to have */
+	if (dir != NULL && chdir(dir) != 0)
+	{
+		perror(dir);
+		return FALSE;
+	}
+#endif
+
+	z80->waitpc = -1;
+	z80->vt = vtnew(in, out);
+	z80->bios = calloc(1, sizeof *z80->bios);
+
+	if (z80->vt == NULL || z80->bios == NULL || !bdos_init(z80))
+	{
+		fprintf(stderr, "Cannot allocate memory for a CP/M machine\n");
+		destroy_cpm(z80);
+		return FALSE;
+	}
+
+#if SECTCACHE > 0
+	if (nobdos)
+	{
+		z80->bios->sectcache = malloc(SECTCACHE *
+				sizeof *z80->bios->sectcache);
+
+		if (z80->bios->sectcache == NULL)
+		{
+			fprintf(stderr, "Cannot allocate memory for a CP/M "
+					"machine\n");
+			destroy_cpm(z80);
+			return FALSE;
+		}
+
+		for (i = 0; i < SECTCACHE; i++)
+			z80->bios->sectcache[i].drive = -1;
+	}
+
+	for (i = 0; i < SECTHASH; i++)
+		z80->bios->secthash[i] = -1;
+
+	z80->bios->sectclock = 0;
+#endif
+
+	z80->bios->list = NULL;
+
+	for (i = 0; i < CPM_FILES; i++)
+		z80->bios->cpm_file[i] = NULL;
+
+	return TRUE;
+}
+
+/* write out everything the machine has not written yet */
+void
+flush_cpm(z80info *z80)
+{
+#if SECTCACHE > 0
+	if (z80->bios != NULL)
+		flushsectors(z80->bios);
+#endif
+
+	if (z80->bdos != NULL)
+		bdos_flush(z80);
+
+	if (z80->vt != NULL)
+		vtflush(z80->vt);
+
+	if (z80->logfile != NULL)
+		logflush(z80->logfile);
+}
+
+/* close all the files of the machine, & free what init_cpm() set up  --
+   the console's file descriptors are left open */
+void
+destroy_cpm(z80info *z80)
+{
+	int i;
+
+	if (z80->bios != NULL)
+	{
+		closeall(z80);
+
+		if (z80->bios->list != NULL)
+			fclose(z80->bios->list);
+
+		for (i = 0; i < CPM_FILES; i++)
+			cpm_file_free(z80, i);
+
+#if SECTCACHE > 0
+		free(z80->bios->sectcache);
+#endif
+		free(z80->bios);
+		z80->bios = NULL;
+	}
+
+	bdos_destroy(z80);
+
+	if (z80->logfile != NULL)
+	{
+		logclose(z80->logfile);
+		z80->logfile = NULL;
+	}
+
+	vtdelete(z80->vt);
+	z80->vt = NULL;
+
+#ifdef HOST_AT
+	if (z80->dirfd != AT_FDCWD)
+		close(z80->dirfd);
+
+	z80->dirfd = AT_FDCWD;
+#endif
+}
+
+/* the machine is done, & "status" says how it went  --  it goes back to
+   whoever set "z80->exitjmp", or if nobody did, the process exits */
+void
+exit_cpm(z80info *z80, int status)
+{
+	if (z80->exitjmp != NULL)
+	{
+		z80->exitstatus = status;
+		longjmp(*z80->exitjmp, 1);
+	}
+
+	closeall(z80);
 	resetterm();
-	exit(0);
+	exit(status);
 }
 
 /*  Get/set the time - although only the get-time part is implemented.
@@ -932,6 +1669,26 @@ dotime(z80info *z80)
     SETMEM(HL + 4, ((t->tm_sec / 10) << 4) + (t->tm_sec % 10));
 }
 
+/* the name of BIOS function "n" */
+char *
+bios_decode(int n)
+{
+	static char *names[] =
+	{
+		"boot", "warm boot", "console status", "console input",
+		"console output", "list output", "punch output", "reader input",
+		"home", "select disk", "set track", "set sector", "set DMA",
+		"read sector", "write sector", "list status", "sector translate",
+		"open unix file", "create unix file", "read unix file",
+		"write unix file", "close unix file", "finish", "get time"
+	};
+
+	if (n < 0 || n >= (int)(sizeof names / sizeof *names))
+		return "unknown";
+
+	return names[n];
+}
+
 void
 bios(z80info *z80, unsigned int fn)
 {
@@ -969,6 +1726,11 @@ bios(z80info *z80, unsigned int fn)
 		return;
 	}
 
-	bioscall[fn](z80);
+	z80->bioscalls[fn]++;
+
+	if (z80->prof != NULL)
+		profbios(z80, fn, bioscall[fn]);
+	else
+		bioscall[fn](z80);
 	/* let z80 handle return */
 }
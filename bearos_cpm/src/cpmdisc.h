@@ -13,13 +13,31 @@
 #define TRACKOFFSET	0
 #define RESERVEDTRACKS	2
 #define SECTORSPERBLOCK	8
+#define BLOCKSHIFT	3	/* log2(SECTORSPERBLOCK) */
+#define TOTALBLOCKS	243
 #define SECTORSPEREXTENT 128
 #define EXTENTSIZE	32
 #define TOTALEXTENTS	64
 
+/* the 5Mb ST-506 hard discs (A-Hdrive, B-Hdrive), with the same
+   SECTORSIZE, RESERVEDTRACKS & extents, but no sector interleave */
+#define HDSECTORSPERTRACK 64
+#define HDTRACKSPERDISC	610
+#define HDSECTORSPERBLOCK 16
+#define HDBLOCKSHIFT	4	/* log2(HDSECTORSPERBLOCK) */
+#define HDTOTALBLOCKS	2442
+#define HDTOTALEXTENTS	1024
+
 #define EXTENTSPERSECTOR (SECTORSIZE / EXTENTSIZE)
 #define TRACKSIZE	(long)(SECTORSIZE * SECTORSPERTRACK)
 #define DISCSIZE	(long)(TRACKSIZE * TRACKSPERDISC)
+#define HDDISCSIZE	((long)SECTORSIZE * HDSECTORSPERTRACK * HDTRACKSPERDISC)
+
+/* the AL0 & AL1 of a disc parameter block, as one word: a bit for each
+   of the blocks that "extents" directory entries take, from the top */
+#define DIRALLOC(extents, shift) \
+	((0xFFFF0000L >> ((extents) * EXTENTSIZE / (SECTORSIZE << (shift)))) \
+		& 0xFFFF)
 
 unsigned char	sectorxlat[] = {
 			1, 7, 13, 19,
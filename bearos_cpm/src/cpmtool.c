@@ -0,0 +1,1087 @@
+/*-----------------------------------------------------------------------*\
+ |  cpmtool.c  --  list, copy out & copy in the files on the CP/M disc   |
+ |  images of the emulator, from the host, without running CP/M          |
+ |                                                                       |
+ |  After the cpmtool of Joe Allen (see the README).                     |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "cpmdisc.h"
+
+
+/* The whole image is read in at once, and the directory is gone through
+   just once to index the files in it and the blocks they have.  All the
+   commands are then done in memory, so that any number of files can be
+   copied in or out in one run, and at the end the sectors that were
+   changed are written back, as few writes as there are runs of them.
+
+   The layout of the discs is the one bios.c gives CP/M (see cpmdisc.h):
+   the reserved tracks, then the blocks, the first of which hold the
+   directory.  A block is made of consecutive logical sectors, and on a
+   floppy these are interleaved by "sectorxlat", as the BIOS does. */
+
+typedef unsigned char byte;
+
+#define MAXNAME		13	/* "name.typ" & its '\0' */
+#define FILEHASH	2048	/* a power of 2, over the most extents */
+#define DELETED		0xE5	/* user byte of a free directory entry */
+#define MAXUSER		0x1F	/* above are labels, time stamps & such */
+#define EOFBYTE		0x1A	/* ^Z, to fill the last record */
+
+/* the geometry & the disc parameter block of a kind of disc */
+typedef struct disc
+{
+	const char *kind;
+	int spt;		/* logical sectors per track */
+	int tracks;
+	int off;		/* reserved tracks */
+	int bsh;		/* block shift */
+	int exm;		/* extent mask */
+	int dsm;		/* blocks - 1 */
+	int drm;		/* directory entries - 1 */
+	long size;		/* bytes in a full image */
+	const byte *xlat;	/* physical sector (from 1) of each, or NULL */
+} disc;
+
+static const disc hdisc =
+{
+	"5Mb ST-506 hard disc", HDSECTORSPERTRACK, HDTRACKSPERDISC,
+	RESERVEDTRACKS, HDBLOCKSHIFT, 0, HDTOTALBLOCKS - 1,
+	HDTOTALEXTENTS - 1, HDDISCSIZE, NULL
+};
+
+static const disc fdisc =
+{
+	"8\" single density floppy", SECTORSPERTRACK, TRACKSPERDISC,
+	RESERVEDTRACKS, BLOCKSHIFT, 0, TOTALBLOCKS - 1, TOTALEXTENTS - 1,
+	DISCSIZE, sectorxlat
+};
+
+/* a directory entry */
+typedef struct dirent
+{
+	byte uu;		/* user number, or DELETED */
+	byte f[8];		/* name, bit 7 of each an attribute */
+	byte t[3];		/* type, t[0] bit 7 read only, t[1] system */
+	byte ex;		/* extent, low 5 bits */
+	byte s1;
+	byte s2;		/* extent, high bits */
+	byte rc;		/* records in the last logical extent */
+	byte al[16];		/* blocks, as 16 bytes or 8 words */
+} dirent;
+
+/* a file, with its directory entries in the order of their extents */
+typedef struct cpmfile
+{
+	int user;
+	char name[MAXNAME];	/* in lower case */
+	int *ents;
+	int nents;
+	long recs;
+} cpmfile;
+
+static const disc *dp;		/* the kind of the image */
+static const char *imgname;
+static byte *img;		/* all of the image */
+static long imglen;		/* as much of it as the file had */
+static long nsects;		/* sectors in "img" */
+static byte *dirty;		/* a byte for each physical sector */
+static byte *used;		/* a byte for each block */
+static long nextfree;		/* where to start looking for a free block */
+
+static cpmfile *files;		/* the index, by hash of the name */
+static int nfiles;
+
+#define BIGDISC		(dp->dsm > 255)
+#define BLOCKRECS	(1L << dp->bsh)
+#define ENTBLOCKS	(BIGDISC ? 8 : 16)
+#define ENTRECS		(ENTBLOCKS * BLOCKRECS)
+#define DIRENTS		(dp->drm + 1)
+#define DIRRECS		(DIRENTS * EXTENTSIZE / SECTORSIZE)
+#define DIRBLOCKS	((DIRRECS + BLOCKRECS - 1) / BLOCKRECS)
+
+/* extent number & records of an entry, as the BDOS works them out */
+#define EXTENTNO(d)	((((d)->ex & 0x1F) + 32 * (d)->s2) / (dp->exm + 1))
+#define ENTRC(d)	(128L * ((d)->ex & dp->exm) + (d)->rc)
+
+
+/*-----------------------------------------------------------------------*\
+ |  the image in memory
+\*-----------------------------------------------------------------------*/
+
+/* the physical sector of logical record "rec" of the data area */
+static long
+physsect(long rec)
+{
+	long track = dp->off + rec / dp->spt;
+	int s = (int)(rec % dp->spt);
+
+	return track * dp->spt + (dp->xlat != NULL ? dp->xlat[s] - 1 : s);
+}
+
+static byte *
+record(long rec)
+{
+	return img + physsect(rec) * SECTORSIZE;
+}
+
+static void
+putrecord(long rec, const byte *data)
+{
+	long s = physsect(rec);
+
+	memcpy(img + s * SECTORSIZE, data, SECTORSIZE);
+	dirty[s] = 1;
+}
+
+static dirent *
+entry(int n)
+{
+	return (dirent *)(record(n / (SECTORSIZE / EXTENTSIZE)) +
+			n % (SECTORSIZE / EXTENTSIZE) * EXTENTSIZE);
+}
+
+static void
+putentry(int n, const dirent *d)
+{
+	memcpy(entry(n), d, EXTENTSIZE);
+	dirty[physsect(n / (SECTORSIZE / EXTENTSIZE))] = 1;
+}
+
+static long
+blockof(const dirent *d, int i)
+{
+	return BIGDISC ? d->al[2 * i] | d->al[2 * i + 1] << 8 : d->al[i];
+}
+
+/* the kind of disc "fname" is an image of: the hard discs are named
+   "?-Hdrive" & the floppies "?-drive" by bios.c, and a floppy image is
+   never longer than DISCSIZE */
+static const disc *
+disckind(const char *fname, long len)
+{
+	const char *base = strrchr(fname, '/') != NULL ?
+			strrchr(fname, '/') + 1 : fname;
+
+	if (len > DISCSIZE || strstr(base, "Hdrive") != NULL)
+		return &hdisc;
+
+	if (len == DISCSIZE || strstr(base, "-drive") != NULL)
+		return &fdisc;
+
+	return &hdisc;
+}
+
+/* read all of the image "fname" in  --  what is past the end of it, which
+   the emulator has not written to yet, is empty */
+static int
+readimage(const char *fname)
+{
+	FILE *fp;
+	long size;
+
+	imgname = fname;
+
+	if ((fp = fopen(fname, "rb")) == NULL)
+	{
+		perror(fname);
+		return 0;
+	}
+
+	fseek(fp, 0L, SEEK_END);
+	imglen = ftell(fp);
+	rewind(fp);
+
+	dp = disckind(fname, imglen);
+
+	/* the blocks the DPB gives may reach past the nominal size of the
+	   image, so there is room for all of them, & for all the file has */
+	nsects = dp->off * dp->spt + ((dp->dsm + 1L) << dp->bsh);
+
+	if (nsects < dp->size / SECTORSIZE)
+		nsects = dp->size / SECTORSIZE;
+
+	if (nsects < (imglen + SECTORSIZE - 1) / SECTORSIZE)
+		nsects = (imglen + SECTORSIZE - 1) / SECTORSIZE;
+
+	size = nsects * SECTORSIZE;
+
+	if ((img = malloc(size)) == NULL ||
+			(dirty = calloc(nsects, 1)) == NULL)
+	{
+		fprintf(stderr, "No memory for %s\n", fname);
+		fclose(fp);
+		return 0;
+	}
+
+	if (fread(img, 1, imglen, fp) != (size_t)imglen)
+	{
+		fprintf(stderr, "Cannot read %s\n", fname);
+		fclose(fp);
+		return 0;
+	}
+
+	memset(img + imglen, DELETED, size - imglen);
+	fclose(fp);
+	return 1;
+}
+
+/* write the sectors that were changed back to the image, a run of them
+   at a time */
+static int
+writeimage(void)
+{
+	long nsect = nsects, s, e;
+	FILE *fp;
+	int err;
+
+	/* an image that grows is filled with empty sectors up to the last
+	   one written, as the emulator does, not left with a hole of 0s */
+	for (e = nsect; e > 0 && !dirty[e - 1]; e--)
+		;
+
+	for (s = imglen / SECTORSIZE; s < e; s++)
+		dirty[s] = 1;
+
+	for (s = 0; s < nsect && !dirty[s]; s++)
+		;
+
+	if (s == nsect)
+		return 1;
+
+	if ((fp = fopen(imgname, "r+b")) == NULL)
+	{
+		perror(imgname);
+		return 0;
+	}
+
+	for (; s < nsect; s = e)
+	{
+		if (!dirty[s])
+		{
+			e = s + 1;
+			continue;
+		}
+
+		for (e = s; e < nsect && dirty[e]; e++)
+			;
+
+		if (fseek(fp, s * SECTORSIZE, SEEK_SET) != 0 ||
+				fwrite(img + s * SECTORSIZE, SECTORSIZE, e - s,
+				fp) != (size_t)(e - s))
+			break;
+	}
+
+	err = ferror(fp) || s < nsect;
+
+	if (fclose(fp) != 0 || err)
+	{
+		fprintf(stderr, "Error writing %s\n", imgname);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*-----------------------------------------------------------------------*\
+ |  the index of the files & of the blocks in use
+\*-----------------------------------------------------------------------*/
+
+/* the name in entry "d", as "name.typ" in lower case */
+static void
+entname(const dirent *d, char *s)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 8 && (d->f[i] & 0x7F) != ' '; i++)
+		s[n++] = tolower(d->f[i] & 0x7F);
+
+	if ((d->t[0] & 0x7F) != ' ')
+	{
+		s[n++] = '.';
+
+		for (i = 0; i < 3 && (d->t[i] & 0x7F) != ' '; i++)
+			s[n++] = tolower(d->t[i] & 0x7F);
+	}
+
+	s[n] = '\0';
+}
+
+/* the name "s" (a host file name, without its directory) in an entry */
+static void
+setname(dirent *d, const char *s)
+{
+	int i;
+
+	memset(d->f, ' ', sizeof d->f + sizeof d->t);
+
+	for (i = 0; *s != '\0' && *s != '.'; s++)
+		if (i < 8)
+			d->f[i++] = toupper(*(const byte *)s);
+
+	if (*s == '.')
+		for (i = 0, s++; *s != '\0' && i < 3; s++)
+			d->t[i++] = toupper(*(const byte *)s);
+}
+
+static unsigned int
+namehash(int user, const char *name)
+{
+	unsigned int h = user;
+
+	while (*name != '\0')
+		h = h * 31 + *(const byte *)name++;
+
+	return h & (FILEHASH - 1);
+}
+
+/* the file "name" of "user" in the index, a new one if "make" and there is
+   none  --  a "user" of -1 finds the name in any user area */
+static cpmfile *
+findfile(int user, const char *name, int make)
+{
+	cpmfile *f;
+	unsigned int h;
+	int u;
+
+	if (user < 0)
+	{
+		for (u = 0; u <= MAXUSER; u++)
+			if ((f = findfile(u, name, 0)) != NULL)
+				return f;
+
+		return NULL;
+	}
+
+	/* a file that has been removed keeps its place, with no entries */
+	for (h = namehash(user, name); files[h].name[0] != '\0';
+			h = (h + 1) & (FILEHASH - 1))
+		if (files[h].user == user && !strcmp(files[h].name, name))
+			break;
+
+	f = &files[h];
+
+	if (f->nents > 0)
+		return f;
+
+	if (!make)
+		return NULL;
+
+	f->user = user;
+	strcpy(f->name, name);
+	nfiles++;
+	return f;
+}
+
+/* add entry "n" to file "f", in order of its extent */
+static int
+addentry(cpmfile *f, int n)
+{
+	int *ents = realloc(f->ents, (f->nents + 1) * sizeof *ents);
+	int i, ext = EXTENTNO(entry(n));
+	long recs;
+
+	if (ents == NULL)
+		return 0;
+
+	for (i = f->nents; i > 0 && EXTENTNO(entry(ents[i - 1])) > ext; i--)
+		ents[i] = ents[i - 1];
+
+	ents[i] = n;
+	f->ents = ents;
+	f->nents++;
+
+	recs = (long)ext * ENTRECS + ENTRC(entry(n));
+
+	if (recs > f->recs)
+		f->recs = recs;
+
+	return 1;
+}
+
+/* go through the directory once, for the files & the blocks in use */
+static int
+buildindex(void)
+{
+	char name[MAXNAME];
+	dirent *d;
+	long b;
+	int n, i;
+
+	files = calloc(FILEHASH, sizeof *files);
+	used = calloc(dp->dsm + 1, 1);
+
+	if (files == NULL || used == NULL)
+	{
+		fprintf(stderr, "No memory for the directory\n");
+		return 0;
+	}
+
+	for (b = 0; b < DIRBLOCKS; b++)
+		used[b] = 1;
+
+	for (n = 0; n < DIRENTS; n++)
+	{
+		d = entry(n);
+
+		if (d->uu > MAXUSER)
+			continue;
+
+		entname(d, name);
+
+		if (!addentry(findfile(d->uu, name, 1), n))
+		{
+			fprintf(stderr, "No memory for the directory\n");
+			return 0;
+		}
+
+		for (i = 0; i < ENTBLOCKS; i++)
+			if ((b = blockof(d, i)) == 0)
+				continue;
+			else if (b > dp->dsm)
+				fprintf(stderr, "%s: entry %d of %s has block %ld, "
+					"past the end of the disc\n", imgname,
+					n, name, b);
+			else if (used[b])
+				fprintf(stderr, "%s: entry %d of %s has block %ld, "
+					"which is in use already\n", imgname,
+					n, name, b);
+			else
+				used[b] = 1;
+	}
+
+	return 1;
+}
+
+static long
+freeblocks(void)
+{
+	long b, n = 0;
+
+	for (b = 0; b <= dp->dsm; b++)
+		n += !used[b];
+
+	return n;
+}
+
+/* the blocks file "f" has */
+static long
+fileblocks(const cpmfile *f)
+{
+	long n = 0;
+	int i, j;
+
+	for (i = 0; i < f->nents; i++)
+		for (j = 0; j < ENTBLOCKS; j++)
+			n += blockof(entry(f->ents[i]), j) != 0;
+
+	return n;
+}
+
+static int
+freeentries(void)
+{
+	int n, m = 0;
+
+	for (n = 0; n < DIRENTS; n++)
+		m += entry(n)->uu == DELETED;
+
+	return m;
+}
+
+/* take file "f" off the disc, giving back its blocks & entries */
+static void
+removefile(cpmfile *f)
+{
+	dirent *d;
+	long b;
+	int i, j;
+
+	for (i = 0; i < f->nents; i++)
+	{
+		d = entry(f->ents[i]);
+
+		for (j = 0; j < ENTBLOCKS; j++)
+			if ((b = blockof(d, j)) != 0 && b <= dp->dsm)
+			{
+				used[b] = 0;
+
+				if (b < nextfree)
+					nextfree = b;
+			}
+
+		d->uu = DELETED;
+		dirty[physsect(f->ents[i] / (SECTORSIZE / EXTENTSIZE))] = 1;
+	}
+
+	f->nents = 0;
+	f->recs = 0;
+	nfiles--;
+}
+
+
+/*-----------------------------------------------------------------------*\
+ |  copying files out & in
+\*-----------------------------------------------------------------------*/
+
+/* write the records of "f" to "fp" */
+static int
+readfile(cpmfile *f, FILE *fp)
+{
+	dirent *d;
+	long r, recs, b;
+	int i;
+
+	for (i = 0; i < f->nents; i++)
+	{
+		d = entry(f->ents[i]);
+		recs = ENTRC(d) < ENTRECS ? ENTRC(d) : ENTRECS;
+
+		for (r = 0; r < recs; r++)
+		{
+			if ((b = blockof(d, r >> dp->bsh)) == 0 || b > dp->dsm)
+			{
+				fprintf(stderr, "%s: %s stops short of its "
+					"records\n", imgname, f->name);
+				return 0;
+			}
+
+			fwrite(record((b << dp->bsh) + (r & (BLOCKRECS - 1))),
+					SECTORSIZE, 1, fp);
+		}
+	}
+
+	return !ferror(fp);
+}
+
+/* put the "len" bytes at "data" on the disc as "name", for user 0, in
+   place of any file of that name there already */
+static int
+writefile(const char *name, byte *data, long len)
+{
+	char cname[MAXNAME];
+	dirent d;
+	cpmfile *f;
+	long recs = (len + SECTORSIZE - 1) / SECTORSIZE;
+	long blocks = (recs + BLOCKRECS - 1) / BLOCKRECS;
+	int nents = recs > 0 ? (int)((recs + ENTRECS - 1) / ENTRECS) : 1;
+	long r, b = 0, ext;
+	int e = 0, i, n;
+
+	memset(&d, 0, sizeof d);
+	setname(&d, name);
+	entname(&d, cname);
+
+	if (cname[0] == '\0' || cname[0] == '.')
+	{
+		fprintf(stderr, "%s is no name for a CP/M file\n", name);
+		return 0;
+	}
+
+	/* what is there now is given back first, if there is room for it */
+	f = findfile(0, cname, 0);
+
+	if (blocks > freeblocks() + (f != NULL ? fileblocks(f) : 0) ||
+			nents > freeentries() + (f != NULL ? f->nents : 0))
+	{
+		fprintf(stderr, "%s: no room for %s\n", imgname, cname);
+		return 0;
+	}
+
+	if (f != NULL)
+		removefile(f);
+
+	f = findfile(0, cname, 1);
+	f->recs = recs;
+
+	for (i = 0; i < nents; i++)
+	{
+		/* the next free directory entry */
+		while (entry(e)->uu != DELETED)
+			e++;
+
+		memset(d.al, 0, sizeof d.al);
+		n = (int)(recs - (long)i * ENTRECS < ENTRECS ?
+				recs - (long)i * ENTRECS : ENTRECS);
+
+		for (r = 0; r < n; r++)
+		{
+			if ((r & (BLOCKRECS - 1)) == 0)
+			{
+				for (b = nextfree; used[b]; b++)
+					;
+
+				used[b] = 1;
+				nextfree = b + 1;
+
+				if (BIGDISC)
+				{
+					d.al[2 * (r >> dp->bsh)] = b & 0xFF;
+					d.al[2 * (r >> dp->bsh) + 1] = b >> 8;
+				}
+				else
+					d.al[r >> dp->bsh] = (byte)b;
+			}
+
+			putrecord((b << dp->bsh) + (r & (BLOCKRECS - 1)),
+					data + ((long)i * ENTRECS + r) * SECTORSIZE);
+		}
+
+		/* a logical extent for each 128 records */
+		ext = (long)i * (dp->exm + 1) + (n > 0 ? (n - 1) / 128 : 0);
+		d.uu = 0;
+		d.ex = ext & 0x1F;
+		d.s1 = 0;
+		d.s2 = (byte)(ext >> 5);
+		d.rc = n > 0 ? n - (n - 1) / 128 * 128 : 0;
+		putentry(e, &d);
+
+		if (!addentry(f, e))
+		{
+			fprintf(stderr, "No memory for the directory\n");
+			return 0;
+		}
+
+		e++;
+	}
+
+	return 1;
+}
+
+/* read all of the host file "fname" into memory, filled up to a whole
+   record with ^Zs */
+static byte *
+slurp(const char *fname, long *len)
+{
+	FILE *fp;
+	byte *buf;
+
+	if ((fp = fopen(fname, "rb")) == NULL)
+	{
+		perror(fname);
+		return NULL;
+	}
+
+	fseek(fp, 0L, SEEK_END);
+	*len = ftell(fp);
+	rewind(fp);
+
+	if (*len < 0 || (buf = malloc(*len + SECTORSIZE)) == NULL)
+	{
+		fprintf(stderr, "Cannot read %s\n", fname);
+		fclose(fp);
+		return NULL;
+	}
+
+	if (fread(buf, 1, *len, fp) != (size_t)*len)
+	{
+		fprintf(stderr, "Cannot read %s\n", fname);
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+
+	fclose(fp);
+	memset(buf + *len, EOFBYTE, SECTORSIZE);
+	return buf;
+}
+
+/* does "name" match the pattern "pat", with its '*' & '?'? */
+static int
+match(const char *pat, const char *name)
+{
+	for (; *pat != '\0'; pat++, name++)
+		if (*pat == '*')
+		{
+			for (; ; name++)
+				if (match(pat + 1, name))
+					return 1;
+				else if (*name == '\0')
+					return 0;
+		}
+		else if (*name == '\0' || (*pat != '?' &&
+				tolower(*(const byte *)pat) != *name))
+			return 0;
+
+	return *name == '\0';
+}
+
+static const char *
+basename_of(const char *path)
+{
+	return strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+}
+
+
+/*-----------------------------------------------------------------------*\
+ |  the commands
+\*-----------------------------------------------------------------------*/
+
+static int
+cmpfiles(const void *a, const void *b)
+{
+	const cpmfile *fa = *(cpmfile * const *)a;
+	const cpmfile *fb = *(cpmfile * const *)b;
+	int c = strcmp(fa->name, fb->name);
+
+	return c != 0 ? c : fa->user - fb->user;
+}
+
+/* the files, sorted by name  --  NULL if out of memory */
+static cpmfile **
+sortedfiles(void)
+{
+	cpmfile **list = malloc((nfiles + 1) * sizeof *list);
+	int h, n = 0;
+
+	if (list == NULL)
+	{
+		fprintf(stderr, "No memory for the listing\n");
+		return NULL;
+	}
+
+	for (h = 0; h < FILEHASH; h++)
+		if (files[h].nents > 0)
+			list[n++] = &files[h];
+
+	qsort(list, n, sizeof *list, cmpfiles);
+	list[n] = NULL;
+	return list;
+}
+
+static void
+showfree(void)
+{
+	long recs = freeblocks() * BLOCKRECS;
+
+	printf("%ld free sectors, %ld free bytes, %d free directory "
+			"entries\n", recs, recs * SECTORSIZE, freeentries());
+}
+
+/* ls: "all" shows the system files too, "full" a line for each with its
+   size, & "single" just the names, one to a line */
+static int
+dols(int all, int full, int single)
+{
+	cpmfile **list = sortedfiles();
+	const dirent *d;
+	long recs = 0;
+	int n, m = 0, rows, cols = 80 / 14, x, y;
+
+	if (list == NULL)
+		return 0;
+
+	for (n = 0; list[n] != NULL; n++)
+		if (all || !(entry(list[n]->ents[0])->t[1] & 0x80))
+			list[m++] = list[n];
+
+	if (full)
+		printf("\n");
+
+	for (n = 0; full && n < m; n++)
+	{
+		d = entry(list[n]->ents[0]);
+		printf("-r%c%c %2d %8ld (%5ld) %s\n",
+				d->t[0] & 0x80 ? '-' : 'w',
+				d->t[1] & 0x80 ? 's' : '-', list[n]->user,
+				list[n]->recs * SECTORSIZE, list[n]->recs,
+				list[n]->name);
+		recs += list[n]->recs;
+	}
+
+	if (full)
+	{
+		printf("\n%d entries\n\n%ld sectors, %ld bytes\n\n", m, recs,
+				recs * SECTORSIZE);
+		showfree();
+		printf("\n");
+	}
+	else if (single)
+	{
+		for (n = 0; n < m; n++)
+			printf("%s\n", list[n]->name);
+	}
+	else
+	{
+		/* in columns, down then across, like ls */
+		rows = (m + cols - 1) / cols;
+
+		for (y = 0; y < rows; y++)
+		{
+			for (x = 0; x < cols && y + x * rows < m; x++)
+				printf("%-14s", list[y + x * rows]->name);
+
+			printf("\n");
+		}
+	}
+
+	free(list);
+	return 1;
+}
+
+/* copy "name" out to the host file "local" ("-" for stdout) */
+static int
+doget(const char *name, const char *local)
+{
+	cpmfile *f = findfile(-1, name, 0);
+	FILE *fp;
+	int ok;
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "File '%s' not found\n", name);
+		return 0;
+	}
+
+	if (!strcmp(local, "-"))
+		return readfile(f, stdout);
+
+	if ((fp = fopen(local, "wb")) == NULL)
+	{
+		perror(local);
+		return 0;
+	}
+
+	ok = readfile(f, fp);
+
+	if (fclose(fp) != 0 || !ok)
+	{
+		fprintf(stderr, "Error writing %s\n", local);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* copy the files matching any of the "n" patterns at "pats" (all of
+   them if none) out to the host directory "dir" */
+static int
+domget(const char *dir, const char **pats, int n)
+{
+	cpmfile **list = sortedfiles();
+	char *path;
+	int i, j, ok = 1;
+
+	if (list == NULL ||
+			(path = malloc(strlen(dir) + MAXNAME + 2)) == NULL)
+		return 0;
+
+	for (i = 0; list[i] != NULL; i++)
+	{
+		for (j = 0; j < n && !match(pats[j], list[i]->name); j++)
+			;
+
+		if (n > 0 && j == n)
+			continue;
+
+		if (list[i]->name[0] == '\0')
+		{
+			fprintf(stderr, "%s: leaving out the file with no name\n",
+					imgname);
+			continue;
+		}
+
+		sprintf(path, "%s/%s", dir, list[i]->name);
+
+		if (!doget(list[i]->name, path))
+			ok = 0;
+	}
+
+	free(path);
+	free(list);
+	return ok;
+}
+
+/* copy the host file "local" in as "name" */
+static int
+doput(const char *local, const char *name)
+{
+	byte *data;
+	long len;
+	int ok;
+
+	if ((data = slurp(local, &len)) == NULL)
+		return 0;
+
+	ok = writefile(name, data, len);
+	free(data);
+	return ok;
+}
+
+static int
+dorm(const char *name)
+{
+	cpmfile *f = findfile(-1, name, 0);
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "File '%s' not found\n", name);
+		return 0;
+	}
+
+	removefile(f);
+	return 1;
+}
+
+/* make an empty image of the kind given, or that its name says */
+static int
+domkfs(const char *fname, const char *kind)
+{
+	const disc *d = kind == NULL ? disckind(fname, 0L) :
+			!strcmp(kind, "hd") ? &hdisc : &fdisc;
+	byte buf[SECTORSIZE];
+	FILE *fp;
+	long s;
+	int err;
+
+	if ((fp = fopen(fname, "wb")) == NULL)
+	{
+		perror(fname);
+		return 0;
+	}
+
+	memset(buf, DELETED, sizeof buf);
+
+	for (s = 0; s < d->size / SECTORSIZE; s++)
+		fwrite(buf, sizeof buf, 1, fp);
+
+	err = ferror(fp);
+
+	if (fclose(fp) != 0 || err)
+	{
+		fprintf(stderr, "Error writing %s\n", fname);
+		return 0;
+	}
+
+	printf("%s: %s, %d tracks, %ld bytes\n", fname, d->kind, d->tracks,
+			d->size);
+	return 1;
+}
+
+static void
+usage(void)
+{
+	printf("\n");
+	printf("CP/M disk image tool\n\n");
+	printf("Syntax: cpmtool path-to-disk-image [command] [args]\n\n");
+	printf("  Commands: (default is ls)\n\n");
+	printf("      ls [-la1]                     Directory listing\n");
+	printf("                  -l for long\n");
+	printf("                  -a to show system files\n");
+	printf("                  -1 to show a single name per line\n\n");
+	printf("      cat cpm-name                  Type file to console\n\n");
+	printf("      get cpm-name [local-name]     Copy file from diskette to local-name\n\n");
+	printf("      put local-name [cpm-name]     Copy file from local-name to diskette\n\n");
+	printf("      mget [-d dir] [pattern...]    Copy the files matching the patterns\n");
+	printf("                                    (all of them if none) into dir\n\n");
+	printf("      mput local-name...            Copy all the files to diskette\n\n");
+	printf("      free                          Print amount of free space\n\n");
+	printf("      rm cpm-name...                Delete files\n\n");
+	printf("      mkfs [hd|fd]                  Format disk\n\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int all = 0, full = 0, single = 0, ok = 1, x = 2, i;
+	const char *cmd, *dir = ".";
+
+	if (argc < 2 || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
+	{
+		usage();
+		return 1;
+	}
+
+	cmd = argc > 2 ? argv[x++] : "ls";
+
+	if (!strcmp(cmd, "mkfs"))
+		return domkfs(argv[1], x < argc ? argv[x] : NULL) ? 0 : 1;
+
+	if (!readimage(argv[1]) || !buildindex())
+		return 1;
+
+	if (cmd[0] == '-' || !strcmp(cmd, "ls"))
+	{
+		for (x = cmd[0] == '-' ? x - 1 : x; x < argc &&
+				argv[x][0] == '-'; x++)
+			for (i = 1; argv[x][i] != '\0'; i++)
+				switch (argv[x][i])
+				{
+				case 'l':	full = 1;	break;
+				case 'a':	all = 1;	break;
+				case '1':	single = 1;	break;
+				default:
+					printf("Unknown option '%c'\n",
+							argv[x][i]);
+					return 1;
+				}
+
+		return dols(all, full, single) ? 0 : 1;
+	}
+	else if (!strcmp(cmd, "free"))
+	{
+		showfree();
+		return 0;
+	}
+	else if (!strcmp(cmd, "cat") || !strcmp(cmd, "get"))
+	{
+		if (x == argc)
+		{
+			printf("Missing file name to %s\n", cmd);
+			return 1;
+		}
+
+		return doget(argv[x], !strcmp(cmd, "cat") ? "-" :
+				x + 1 < argc ? argv[x + 1] : argv[x]) ? 0 : 1;
+	}
+	else if (!strcmp(cmd, "mget"))
+	{
+		if (x + 1 < argc && !strcmp(argv[x], "-d"))
+		{
+			dir = argv[x + 1];
+			x += 2;
+		}
+
+		return domget(dir, (const char **)argv + x, argc - x) ? 0 : 1;
+	}
+	else if (!strcmp(cmd, "put"))
+	{
+		if (x == argc)
+		{
+			printf("Missing file name to put\n");
+			return 1;
+		}
+
+		ok = doput(argv[x], x + 1 < argc ? basename_of(argv[x + 1]) :
+				basename_of(argv[x]));
+	}
+	else if (!strcmp(cmd, "mput"))
+	{
+		for (; x < argc; x++)
+			if (!doput(argv[x], basename_of(argv[x])))
+				ok = 0;
+	}
+	else if (!strcmp(cmd, "rm"))
+	{
+		if (x == argc)
+		{
+			printf("Missing name to delete\n");
+			return 1;
+		}
+
+		for (; x < argc; x++)
+			if (!dorm(argv[x]))
+				ok = 0;
+	}
+	else
+	{
+		printf("Unknown command '%s'\n", cmd);
+		return 1;
+	}
+
+	return writeimage() && ok ? 0 : 1;
+}
@@ -9,6 +9,7 @@
 #define __DEFS_H_
 
 #include <stdio.h>
+#include <setjmp.h>
 
 /* the current version of the z80 emulator */
 #define VERSION "3.1"
@@ -126,6 +127,74 @@ typedef unsigned long longword;
 #define MAXDISCS	16
 
 
+/* the opcode groups that "ophist" in the z80info is divided into */
+#define OPS_MAIN	0	/* unprefixed opcodes */
+#define OPS_CB		1	/* CB-prefixed */
+#define OPS_XY		2	/* DD- and FD-prefixed */
+#define OPS_ED		3	/* ED-prefixed */
+#define OPS_XYCB	4	/* DD CB & FD CB, by their last byte */
+#define OPS_GROUPS	5
+
+/* how many BIOS functions "bioscalls" has room for */
+#define MAXBIOSFN	32
+
+/* an instruction in the trace ring (see trace.c): where it was, its first
+   four bytes, however long it is, and the registers before it ran */
+struct tracerec
+{
+    word pc;
+    byte op[4];
+    word af, bc, de, hl, ix, iy, sp;
+};
+
+
+/* the pre-decoded basic-block cache needs GCC's computed "goto"s (which
+   -ansi -pedantic would warn of wherever they are used) and a couple of
+   megabytes of memory, so it is left out of the BearOS build  --  with
+   MEM_BREAK, it is only used while no breakpoints or watchpoints are
+   set, since decoding a block ahead of time would trip them (see
+   z80core.inc) */
+#if defined __GNUC__ && !defined __STRICT_ANSI__ && \
+	!defined NO_COMPUTED_GOTO && !defined BEAROS && !defined NO_BLOCK_CACHE
+#	define BLOCK_CACHE
+#endif
+
+
+/* with --mmap, the disk images used by --nobdos are mapped into memory
+   where there is mmap() */
+#if defined UNIX && !defined _WIN32 && !defined BEAROS && !defined NO_MMAP
+#	define DISK_MMAP
+#endif
+
+
+/* each CP/M machine can have a working directory of its own, for the
+   host files that its BDOS, BIOS & disk images use, where there are
+   openat() & co  --  elsewhere they all share the process's */
+#if defined UNIX && !defined _WIN32 && !defined BEAROS
+#	define HOST_AT
+#endif
+
+/* --batch runs its jobs on a thread each, which it needs pthreads and
+   HOST_AT for */
+#if defined HOST_AT && !defined NO_BATCH
+#	define BATCH
+#endif
+
+/* with the same pthreads, the log of the monitor's O(utput) is written
+   out by a thread of its own, so that the Z80 does not wait on it */
+#ifdef BATCH
+#	define LOG_THREAD
+#endif
+
+/* how a machine ended, given to exit_cpm()  --  a --batch job has the
+   one its machine ended with */
+#define JOB_OK		0	/* the command came back to the prompt */
+#define JOB_FAILED	1	/* the BDOS emulation gave up on it, or the
+				   Z80 stopped where the monitor would run */
+#define JOB_NOINPUT	2	/* it was waiting for a key after the script */
+#define JOB_NOSTART	3	/* no directory, script or memory for it */
+
+
 typedef struct z80info
 {
     boolean event;
@@ -149,6 +218,7 @@ typedef struct z80info
     boolean trace;		/* trace mode off/on */
     boolean step;		/* step-trace mode off/on */
     int sig;		/* caught a signal */
+    int quitsig;	/* caught a signal that ends the run */
     int syscall;	/* CP/M syscall to be done */
     int biosfn;		/* BIOS function be done */
 
@@ -159,15 +229,67 @@ typedef struct z80info
     word sector;
     FILE *drives[MAXDISCS];
     long drivelen[MAXDISCS];
+#ifdef DISK_MMAP
+    byte *drivemap[MAXDISCS];	/* where the image is mapped, if it is */
+    long drivemaplen[MAXDISCS];	/* how much of it, past "drivelen" too */
+#endif
+
+    /* counts of what has been run so far - "ophist" is indexed by
+       (OPS_* group << 8) | opcode, and is only kept with "countops" */
+    unsigned long cycles;	/* T-states */
+    unsigned long insns;
+    boolean countops;
+    unsigned long ophist[OPS_GROUPS << 8];
+    unsigned long bdoscalls[0x100];
+    unsigned long bioscalls[MAXBIOSFN];
+
+    /* the last "tracesize" instructions run (a power of 2) are kept in
+       "tracering", when it is not NULL  --  "traced" counts them all */
+    struct tracerec *tracering;
+    unsigned long tracesize;
+    unsigned long traced;
+
+    /* the counts of a profile (see profile.c), when it is not NULL */
+    struct profinfo *prof;
 
     /* 64k bytes - may be allocated separately if desired */
     byte mem[0x10000L];
 
+    /* the rest of the CP/M machine (see init_cpm() in bios.c)  --  kept
+       here rather than in globals so that several machines can run at
+       once, each on a thread of its own */
+    struct vtinfo *vt;		/* the console */
+    struct bdosinfo *bdos;	/* BDOS emulation: the FCB files & such */
+    struct biosinfo *bios;	/* sector cache, list device & unix files */
+    int dirfd;			/* working directory, with HOST_AT */
+    char *stuff_cmd;		/* typed at the first command prompt */
+    boolean exec;		/* quit at the prompt after that */
+    boolean silent_exit;	/* quit on the warm boot after that */
+    struct loginfo *logfile;	/* where the monitor's "O" logs to */
+    const char *snapfile;	/* snapshot to write when a key is awaited */
+    int waitpc;			/* where the call waiting for a key starts */
+    int bdosret;		/* SP the call traced by --strace returns to */
+    jmp_buf *exitjmp;		/* finish() goes here if set, not exit() */
+    int exitstatus;		/* what it was given */
+
 #ifdef MEM_BREAK
-    /* one for each byte of memory for breaks, memory-mapped I/O, etc */
+    /* one for each byte of memory for breaks, memory-mapped I/O, etc  --
+       "brkpage" has how many bytes in each 256-byte page have any, and
+       "numbrks" how many there are in all (see z80_setbrk()) */
     byte membrk[0x10000L];
+    word brkpage[0x100];
     long numbrks;
 #endif
+
+#ifdef BLOCK_CACHE
+    /* decoded basic blocks (see z80.c) - each byte of "mem" that an
+       opcode was decoded from has its bit set in "codemap", and writing
+       to such a byte drops the blocks in its 256-byte page */
+    struct z80block *blocks;
+    byte codemap[0x10000L / 8];
+    byte smcwrites[0x100];	/* writes over code in each page */
+    unsigned long blkhits, blkmisses, blkinvals;
+#endif
 } z80info;
 
 
@@ -184,25 +306,46 @@ typedef struct z80info
    write_mem().
 */
 
+/* writes to memory that blocks were decoded from must drop those blocks */
+#ifdef BLOCK_CACHE
+#    define CODEBYTE(addr)	\
+		(z80->codemap[(word)(addr) >> 3] & (1 << ((addr) & MASK3)))
+#    define CODEWRITE(addr)	\
+		(CODEBYTE(addr) ? z80_invalidate(z80, addr, 1, FALSE) : (void)0)
+#else
+#    define CODEWRITE(addr)	((void)0)
+#endif
+
+#define RAWMEM(addr) z80->mem[(word)(addr)]
+#define RAWSETMEM(addr, val)	\
+		(CODEWRITE(addr), z80->mem[(word)(addr)] = (byte)(val))
+
 #ifdef MEM_BREAK
-#    define MEM(addr)	\
-		(z80->membrk[(word)(addr)] ?	\
+	/* the page is looked at first, as most of them have no breaks */
+#    define BRKBYTE(addr)	\
+		(z80->brkpage[(word)(addr) >> 8] && z80->membrk[(word)(addr)])
+#    define BRKMEM(addr)	\
+		(BRKBYTE(addr) ?	\
 		read_mem(z80, addr) :	\
 		z80->mem[(word)(addr)])
-#    define SETMEM(addr, val)	\
-		(z80->membrk[(word)(addr)] ?	\
+#    define BRKSETMEM(addr, val)	\
+		(BRKBYTE(addr) ?	\
 		write_mem(z80, addr, val) :	\
-		(z80->mem[(word)(addr)] = (byte)(val)))
+		RAWSETMEM(addr, val))
+#    define MEM(addr)		BRKMEM(addr)
+#    define SETMEM(addr, val)	BRKSETMEM(addr, val)
 
 	/* various flags for "membrk" - others may be added */
 #	define M_BREAKPOINT	0x01		/* breakpoint */
 #	define M_READ_PROTECT	0x02		/* read-protected memory */
 #	define M_WRITE_PROTECT	0x04		/* write-protected memory */
 #	define M_MEM_MAPPED_IO	0x08		/* memory-mapped I/O addr */
+#	define M_WATCH_READ	0x10		/* read watchpoint */
+#	define M_WATCH_WRITE	0x20		/* write watchpoint */
 
 #else
-#    define MEM(addr) z80->mem[(word)(addr)]
-#    define SETMEM(addr, val) (z80->mem[(word)(addr)] = (byte)(val))
+#    define MEM(addr)		RAWMEM(addr)
+#    define SETMEM(addr, val)	RAWSETMEM(addr, val)
 #endif
 
 
@@ -262,6 +405,16 @@ extern z80info *destroy_z80info(z80info *z80);
 extern void delete_z80info(z80info *z80);
 
 extern boolean z80_emulator(z80info *z80, int count);
+#ifdef MEM_BREAK
+extern void z80_setbrk(z80info *z80, word addr, byte flags, boolean on);
+#endif
+
+#ifdef BLOCK_CACHE
+extern void z80_invalidate(z80info *z80, word addr, unsigned int len,
+		boolean smc);
+#else
+#	define z80_invalidate(z80, addr, len, smc)	((void)0)
+#endif
 
 extern int nobdos;
 
@@ -275,28 +428,79 @@ extern word read_mem(z80info *z80, word addr);
 extern word write_mem(z80info *z80, word addr, byte val);
 extern void undefinstr(z80info *z80, byte instr);
 extern boolean loadfile(z80info *z80, const char *fname);
+extern void keywait(z80info *z80, int pc);
 
 /* bios.c */
 extern void bios(z80info *z80, unsigned int fn);
+extern char *bios_decode(int n);
 extern void sysreset(z80info *z80);
 extern void warmboot(z80info *z80);
 extern void finish(z80info *z80);
+extern void exit_cpm(z80info *z80, int status);
+extern boolean init_cpm(z80info *z80, const char *dir, int in, int out);
+extern void destroy_cpm(z80info *z80);
+extern void flush_cpm(z80info *z80);
+extern FILE *cpmfopen(z80info *z80, const char *name, const char *mode);
+extern int cpmunlink(z80info *z80, const char *name);
+extern int cpmrename(z80info *z80, const char *from, const char *to);
+extern int cpmchdir(z80info *z80, const char *dir);
 extern void command(z80info *z80);
+extern void snapput(FILE *fp, unsigned long val, int n);
+extern unsigned long snapget(FILE *fp, int n);
+extern boolean savesnapshot(z80info *z80, const char *fname, int pc);
+extern boolean loadsnapshot(z80info *z80, const char *fname);
+#ifdef DISK_MMAP
+extern int mapdisks;
+#endif
+
+/* batch.c */
+#ifdef BATCH
+extern int runbatch(const char *fname);
+#endif
+
+/* trace.c */
+extern boolean tracering(z80info *z80, unsigned long n);
+extern void showtrace(z80info *z80, unsigned long n, FILE *fp);
+extern boolean savetrace(z80info *z80, const char *fname);
+extern boolean decodetrace(const char *fname, FILE *fp);
+
+/* profile.c */
+extern boolean profiling(z80info *z80, boolean on);
+extern void profop(z80info *z80, byte t);
+extern void profbdos(z80info *z80);
+extern void profbios(z80info *z80, int fn, void (*call)(z80info *z80));
+extern void showprofile(z80info *z80, FILE *fp, int max);
+
+/* log.c */
+extern struct loginfo *logopen(const char *fname);
+extern void logclose(struct loginfo *log);
+extern void logputc(struct loginfo *log, int c);
+extern void logputs(struct loginfo *log, const char *s);
+extern void logsync(struct loginfo *log);
+extern void logflush(struct loginfo *log);
 
 /* disassem.c */
-extern int disassemlen(void);
+#define DISASSEMSIZE	32	/* room for the text of an instruction */
+#define DISLINESIZE	64	/* & for a line of a listing */
+extern int disassemble(const byte *code, word pc, char *buf);
+extern int disassemstr(z80info *z80, word start, char *buf);
 extern int disassem(z80info *z80, word start, FILE *fp);
+extern int disassemline(const byte *mem, word addr, char *buf);
+extern boolean disassemfile(const char *fname, word org, word from, word to,
+		FILE *fp);
 
 /* bdos */
 #define BDOS_HOOK 0xDC06
 void check_BDOS_hook(z80info *z80);
-extern int silent_exit;
-extern char *stuff_cmd;
-extern int exec;
 extern int trace_bdos;
 extern int strace;
 char *bdos_decode(int n);
 int bdos_fcb(int n);
 void bdos_fcb_dump(z80info *z80);
+boolean bdos_init(z80info *z80);
+void bdos_destroy(z80info *z80);
+void bdos_flush(z80info *z80);
+void bdos_snapsave(z80info *z80, FILE *fp);
+boolean bdos_snaprestore(z80info *z80, FILE *fp);
 
 #endif /* __DEFS_H_ */
@@ -10,844 +10,418 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "defs.h"
 
 
-#define bits(l,r) (((z80->mem[loc]) >> (r)) & mask[(l) - (r)])
-#define put_cc(cc) put_str(cc_names[cc])
-
-#define OPC_LD "LD    "
-#define OPC_INC "INC   "
-#define OPC_DEC "DEC   "
-#define OPC_ADD "ADD   "
-#define OPC_RET "RET   "
-#define OPC_POP "POP   "
-#define OPC_EXX "EXX   "
-#define OPC_JP "JP    "
-#define OPC_OUT "OUT   "
-#define OPC_IN "IN    "
-#define OPC_EX "EX    "
-#define OPC_DI "DI    "
-#define OPC_EI "EI    "
-#define OPC_CALL "CALL  "
-#define OPC_PUSH "PUSH  "
-#define OPC_ILLEGAL "***"
-#define OPC_RST "RST   "
+/* Each opcode has a template in the tables below, for the unprefixed,
+   CB & ED groups, with the operands marked in lower case:
 
-static int
-mask[] =
-{
-	0x001,
-	0x003,
-	0x007,
-	0x00F,
-	0x01F,
-	0x03F,
-	0x07F,
-	0x0FF
-};
+	n	the byte after the opcode
+	w	the word after it
+	e	a JR or DJNZ target: the byte after it, from the next PC
+	h	HL, or IX or IY after a DD or FD
+	u, l	H & L, or the halves of IX or IY
+	m	(HL), or (IX+d) or (IY+d), with the "d" after the opcode
 
-static char *
-rr_names[] =
-{
-	"B",
-	"C",
-	"D",
-	"E",
-	"H",
-	"L",
-	"(HL)",
-	"A"
-};
+   A DD or FD prefix changes the operands of the unprefixed instruction
+   after it, and DD CB d op is the CB instruction on (IX+d).  The ones
+   that have none to change, and the ones with no template, are "***",
+   and so is a DD or FD that is not followed by an opcode that it
+   changes, as the Z80 ignores it. */
 
-static char *
-dd_names[] =
-{
-	"BC",
-	"DE",
-	"HL",
-	"SP"
-};
+#define OPC_ILLEGAL "***"
 
-static char *
-qq_names[] =
-{
-	"BC",
-	"DE",
-	"HL",
-	"AF"
-};
+/* the 8 registers of the bottom 3 bits of an opcode */
+#define R8(op)	op "B", op "C", op "D", op "E", op "u", op "l", op "m", op "A"
 
-static char *
-cc_names[] =
-{
-	"NZ",
-	"Z",
-	"NC",
-	"C",
-	"PO",
-	"PE",
-	"P",
-	"M"
-};
+/* BIT, RES & SET, for each bit */
+#define BITS(op) \
+	R8(op "0,"), R8(op "1,"), R8(op "2,"), R8(op "3,"), \
+	R8(op "4,"), R8(op "5,"), R8(op "6,"), R8(op "7,")
 
-static char *
-op_names[] =
+static const char *const
+maintab[0x100] =
 {
-	"ADD   A,",
-	"ADC   A,",
-	"SUB   ",
-	"SBC   A,",
-	"AND   ",
-	"XOR   ",
-	"OR    ",
-	"CP    ",
+	/* 00 */
+	"NOP",		"LD    BC,w",	"LD    (BC),A",	"INC   BC",
+	"INC   B",	"DEC   B",	"LD    B,n",	"RLCA",
+	"EX    AF,AF'",	"ADD   h,BC",	"LD    A,(BC)",	"DEC   BC",
+	"INC   C",	"DEC   C",	"LD    C,n",	"RRCA",
+
+	/* 10 */
+	"DJNZ  e",	"LD    DE,w",	"LD    (DE),A",	"INC   DE",
+	"INC   D",	"DEC   D",	"LD    D,n",	"RLA",
+	"JR    e",	"ADD   h,DE",	"LD    A,(DE)",	"DEC   DE",
+	"INC   E",	"DEC   E",	"LD    E,n",	"RRA",
+
+	/* 20 */
+	"JR    NZ,e",	"LD    h,w",	"LD    (w),h",	"INC   h",
+	"INC   u",	"DEC   u",	"LD    u,n",	"DAA",
+	"JR    Z,e",	"ADD   h,h",	"LD    h,(w)",	"DEC   h",
+	"INC   l",	"DEC   l",	"LD    l,n",	"CPL",
+
+	/* 30 */
+	"JR    NC,e",	"LD    SP,w",	"LD    (w),A",	"INC   SP",
+	"INC   m",	"DEC   m",	"LD    m,n",	"SCF",
+	"JR    C,e",	"ADD   h,SP",	"LD    A,(w)",	"DEC   SP",
+	"INC   A",	"DEC   A",	"LD    A,n",	"CCF",
+
+	/* 40 - with (HL), the H & L stay themselves after a DD or FD */
+	R8("LD    B,"),
+	R8("LD    C,"),
+	R8("LD    D,"),
+	R8("LD    E,"),
+	"LD    u,B",	"LD    u,C",	"LD    u,D",	"LD    u,E",
+	"LD    u,u",	"LD    u,l",	"LD    H,m",	"LD    u,A",
+	"LD    l,B",	"LD    l,C",	"LD    l,D",	"LD    l,E",
+	"LD    l,u",	"LD    l,l",	"LD    L,m",	"LD    l,A",
+	"LD    m,B",	"LD    m,C",	"LD    m,D",	"LD    m,E",
+	"LD    m,H",	"LD    m,L",	"HALT",		"LD    m,A",
+	R8("LD    A,"),
+
+	/* 80 */
+	R8("ADD   A,"),
+	R8("ADC   A,"),
+	R8("SUB   "),
+	R8("SBC   A,"),
+	R8("AND   "),
+	R8("XOR   "),
+	R8("OR    "),
+	R8("CP    "),
+
+	/* C0 - CB, DD, ED & FD are prefixes */
+	"RET   NZ",	"POP   BC",	"JP    NZ,w",	"JP    w",
+	"CALL  NZ,w",	"PUSH  BC",	"ADD   A,n",	"RST   00",
+	"RET   Z",	"RET",		"JP    Z,w",	NULL,
+	"CALL  Z,w",	"CALL  w",	"ADC   A,n",	"RST   08",
+
+	/* D0 */
+	"RET   NC",	"POP   DE",	"JP    NC,w",	"OUT   (n),A",
+	"CALL  NC,w",	"PUSH  DE",	"SUB   n",	"RST   10",
+	"RET   C",	"EXX",		"JP    C,w",	"IN    A,(n)",
+	"CALL  C,w",	NULL,		"SBC   A,n",	"RST   18",
+
+	/* E0 */
+	"RET   PO",	"POP   h",	"JP    PO,w",	"EX    (SP),h",
+	"CALL  PO,w",	"PUSH  h",	"AND   n",	"RST   20",
+	"RET   PE",	"JP    (h)",	"JP    PE,w",	"EX    DE,HL",
+	"CALL  PE,w",	NULL,		"XOR   n",	"RST   28",
+
+	/* F0 */
+	"RET   P",	"POP   AF",	"JP    P,w",	"DI",
+	"CALL  P,w",	"PUSH  AF",	"OR    n",	"RST   30",
+	"RET   M",	"LD    SP,h",	"JP    M,w",	"EI",
+	"CALL  M,w",	NULL,		"CP    n",	"RST   38"
 };
 
-static char *
-jr_op_names[] =
+static const char *const
+cbtab[0x100] =
 {
-	0,
-	0,
-	"DJNZ  ",
-	"JR    ",
-	"JR    NZ,",
-	"JR    Z,",
-	"JR    NC,",
-	"JR    C,"
+	R8("RLC   "),
+	R8("RRC   "),
+	R8("RL    "),
+	R8("RR    "),
+	R8("SLA   "),
+	R8("SRA   "),
+	R8("SLL   "),
+	R8("SRL   "),
+	BITS("BIT   "),
+	BITS("RES   "),
+	BITS("SET   ")
 };
 
-static char *
-log_op_names[] =
+/* ED 40 to ED 7F  --  the rest of the ED group is ED A0 to ED BF, and
+   the undocumented repeats of NEG, RETN & IM are left out */
+static const char *const
+edtab[0x40] =
 {
-	"RLCA",
-	"RRCA",
-	"RLA",
-	"RRA",
-	"DAA",
-	"CPL",
-	"SCF",
-	"CCF"
+	/* 40 */
+	"IN    B,(C)",	"OUT   (C),B",	"SBC   HL,BC",	"LD    (w),BC",
+	"NEG",		"RETN",		"IM    0",	"LD    I,A",
+	"IN    C,(C)",	"OUT   (C),C",	"ADC   HL,BC",	"LD    BC,(w)",
+	NULL,		"RETI",		NULL,		"LD    R,A",
+
+	/* 50 */
+	"IN    D,(C)",	"OUT   (C),D",	"SBC   HL,DE",	"LD    (w),DE",
+	NULL,		NULL,		"IM    1",	"LD    A,I",
+	"IN    E,(C)",	"OUT   (C),E",	"ADC   HL,DE",	"LD    DE,(w)",
+	NULL,		NULL,		"IM    2",	"LD    A,R",
+
+	/* 60 */
+	"IN    H,(C)",	"OUT   (C),H",	"SBC   HL,HL",	"LD    (w),HL",
+	NULL,		NULL,		NULL,		"RRD",
+	"IN    L,(C)",	"OUT   (C),L",	"ADC   HL,HL",	"LD    HL,(w)",
+	NULL,		NULL,		NULL,		"RLD",
+
+	/* 70 */
+	"IN    F,(C)",	NULL,		"SBC   HL,SP",	"LD    (w),SP",
+	NULL,		NULL,		NULL,		NULL,
+	"IN    A,(C)",	"OUT   (C),A",	"ADC   HL,SP",	"LD    SP,(w)",
+	NULL,		NULL,		NULL,		NULL
 };
 
-static char *
-shf_op_names[] =
+/* ED A0 to ED BF, the block instructions */
+static const char *const
+edblocktab[0x20] =
 {
-	"RLC   ",
-	"RRC   ",
-	"RL    ",
-	"RR    ",
-	"SLA   ",
-	"SRA   ",
-	"SLL?  ",
-	"SRL   "
+	"LDI",		"CPI",		"INI",		"OUTI",
+	NULL,		NULL,		NULL,		NULL,
+	"LDD",		"CPD",		"IND",		"OUTD",
+	NULL,		NULL,		NULL,		NULL,
+	"LDIR",		"CPIR",		"INIR",		"OTIR",
+	NULL,		NULL,		NULL,		NULL,
+	"LDDR",		"CPDR",		"INDR",		"OTDR",
+	NULL,		NULL,		NULL,		NULL
 };
 
-static char *
-bit_op_names[] =
-{
-	0,
-	"BIT   ",
-	"RES   ",
-	"SET   ",
-};
+
+static const char hexdigits[] = "0123456789ABCDEF";
 
 static char *
-rep_op_names[] =
+puthex(char *s, unsigned n, int digits)
 {
-	"LDI",
-	"CPI",
-	"INI",
-	"OUTI",
-	"LDD",
-	"CPD",
-	"IND",
-	"OUTD",
-	"LDIR",
-	"CPIR",
-	"INIR",
-	"OTIR",
-	"LDDR",
-	"CPDR",
-	"INDR",
-	"OTDR"
-};
-
-static char *index_reg;
-static int str_length;
-static FILE *fp;
+	while (digits-- > 0)
+		*s++ = hexdigits[(n >> (digits * 4)) & 0xF];
 
-static void
-put_byte(byte b)
-{
-	fprintf(fp, "%02X", b & 0x0FF);
-	str_length += 2;
+	return s;
 }
 
-static void
-put_addr(z80info *z80, int loc)
+static char *
+putstr(char *s, const char *str)
 {
-	put_byte(z80->mem[loc]);
-	put_byte(z80->mem[(loc - 1) & 0x0FFFF]);
-}
+	while (*str != '\0')
+		*s++ = *str++;
 
-static void
-put_word(word w)
-{
-	fprintf(fp, "%04X", w & 0x0FFFF);
-	str_length += 4;
+	return s;
 }
 
-static void
-put_digit(byte digit)
+/* disassemble the instruction in "code", which is at "pc", into "buf",
+   which must have room for DISASSEMSIZE characters  --  "code" must have
+   the 4 bytes from "pc", however long the instruction is, and the
+   return is how long it is */
+int
+disassemble(const byte *code, word pc, char *buf)
 {
-	fprintf(fp, "%01X", digit & 0x00F);
-	str_length += 1;
-}
+	const char *t, *ix = NULL;
+	const byte *arg;
+	int len, d = 0;
+	char *s = buf;
 
-static void
-put_char(char ch)
-{
-	putc(ch, fp);
-	str_length += 1;
-}
+	switch (code[0])
+	{
+	case 0xCB:
+		t = cbtab[code[1]];
+		len = 2;
+		break;
 
-static void
-put_str(char *str)
-{
-	fprintf(fp, "%s", str);
-	str_length += strlen(str);
-}
+	case 0xED:
+		t = code[1] >= 0x40 && code[1] < 0x80 ? edtab[code[1] - 0x40] :
+			code[1] >= 0xA0 && code[1] < 0xC0 ?
+				edblocktab[code[1] - 0xA0] : NULL;
+		len = 2;
+		break;
 
-static void
-put_reg(z80info *z80, int reg_num, int loc)
-{
-	int d;
-	
-	if (index_reg && (reg_num == 6))
-	{
-		put_str("(");
-		put_str(index_reg);
-		d = (signed char)z80->mem[loc + 1];
+	case 0xDD:
+	case 0xFD:
+		ix = code[0] == 0xDD ? "IX" : "IY";
+		len = 2;
 
-		if (d < 0)
+		if (code[1] == 0xCB)
 		{
-			put_str("-");
-			put_byte(-d);
+			t = (code[3] & 7) == 6 ? cbtab[code[3]] : NULL;
+			d = (signed char)code[2];
+			len = 4;
 		}
-		else
+		else if ((t = maintab[code[1]]) != NULL &&
+				strpbrk(t, "hulm") == NULL)
+			t = NULL;
+
+		/* the Z80 runs the prefix alone, as a NOP */
+		if (t == NULL && code[1] != 0xCB)
+			len = 1;
+		else if (t != NULL && len == 2 && strchr(t, 'm') != NULL)
 		{
-			put_str("+");
-			put_byte(d);
+			d = (signed char)code[2];
+			len = 3;
 		}
 
-		put_str(")");
-	}
-	else
-	{
-		put_str(rr_names[reg_num]);
-	}
-}
+		break;
 
-static void 
-put_dd_reg(int reg_num)
-{
-	if (index_reg)
-	{
-		if (reg_num == 2)
-			put_str(index_reg);
-		else if (reg_num == 3)
-			put_str("SP");
-		else
-			put_str(OPC_ILLEGAL);
+	default:
+		t = maintab[code[0]];
+		len = 1;
+		break;
 	}
-	else
-		put_str(dd_names[reg_num]);
-}
 
-static void
-put_qq_reg(int reg_num)
-{
-	if (index_reg)
+	if (t == NULL)
 	{
-		if (reg_num == 2)
-			put_str(index_reg);
-		else
-			put_str(OPC_ILLEGAL);
+		strcpy(buf, OPC_ILLEGAL);
+		return len;
 	}
-	else
-		put_str(qq_names[reg_num]);
-}
-
-int
-disassemlen(void)
-{
-	return str_length;
-}
 
-int
-disassem(z80info *z80, word start, FILE *file)
-{
-	word loc;
-	int byte_count;
-	byte last_byte;
+	/* the operand, if any, is last (DD CB d op has none) */
+	arg = code + len;
 
-	loc = start;
-	byte_count = 0;
-	str_length = 0;
+	if (strpbrk(t, "ne") != NULL)
+		len++;
+	else if (strchr(t, 'w') != NULL)
+		len += 2;
 
-	if (file != NULL)
-	{
-		fp = file;
-		index_reg = NULL;
-	}
-
-	switch (bits(7,6))
-	{
-	case 0:
-		switch (bits(3,0))
+	for (; *t != '\0'; t++)
+		switch (*t)
 		{
-		case 0:
-		case 8:
-			if (bits(5,3) == 0)
-			{
-				put_str("NOP");
-				break;
-			}
-
-			if (bits(5,3) == 1)
-			{
-				put_str("EX    AF,AF'");
-				break;
-			}
-
-			put_str(jr_op_names[bits(5,3)]);
-			loc++;
-			byte_count++;
-			put_word((signed char)z80->mem[loc] + (int)loc + 1);
-			break;
-
-		case 1:
-			put_str(OPC_LD);
-			put_dd_reg(bits(5,4));
-			put_char(',');
-			byte_count += 2;
-			loc += 2;
-			put_addr(z80, loc);
-			break;
-
-		case 2:
-			last_byte = z80->mem[loc];
-			put_str(OPC_LD);
-
-			switch (bits(5,4))
-			{
-			case 0:
-				put_str("(BC)");
-				break;
-
-			case 1:
-				put_str("(DE)");
-				break;
-
-			case 2:
-			case 3:
-				put_char('(');
-				byte_count += 2;
-				loc += 2;
-				put_addr(z80, loc);
-				put_char(')');
-				break;
-			}
-
-			if ((last_byte & 0x030) == 0x020)
-			{
-				put_char(',');
-
-				if (index_reg)
-					put_str(index_reg);
-				else
-					put_str("HL");
-			}
-			else
-			{
-				put_str(",A");
-			}
-
+		case 'n':
+			s = puthex(s, arg[0], 2);
 			break;
 
-		case 3:
-			put_str(OPC_INC);
-			put_dd_reg(bits(5,4));
+		case 'w':
+			s = puthex(s, arg[0] | arg[1] << 8, 4);
 			break;
 
-		case 4:
-		case 0x0C:
-			put_str(OPC_INC);
-			put_reg(z80, bits(5,3), loc);
+		case 'e':
+			s = puthex(s, (word)(pc + len + (signed char)arg[0]), 4);
 			break;
 
-		case 5:
-		case 0x0D:
-			put_str(OPC_DEC);
-			put_reg(z80, bits(5,3), loc);
+		case 'h':
+			s = putstr(s, ix != NULL ? ix : "HL");
 			break;
 
-		case 6:
-		case 0x0E:
-			put_str(OPC_LD);
-			put_reg(z80, bits(5,3), loc);
-			put_char(',');
-
-			if (index_reg && (bits(5,3) == 6))
-			{
-				loc++;
-				byte_count++;
-			}
+		case 'u':
+		case 'l':
+			if (ix != NULL)
+				s = putstr(s, ix);
 
-			loc++;
-			byte_count++;
-			put_byte(z80->mem[loc]);
+			*s++ = *t == 'u' ? 'H' : 'L';
 			break;
 
-		case 7:
-		case 0x0F:
-			put_str(log_op_names[bits(5,3)]);
-			break;
-
-		case 9:
-			put_str(OPC_ADD);
-			put_str("HL,");
-			put_dd_reg(bits(5,4));
-			break;
-
-		case 0x0A:
-			put_str(OPC_LD);
-
-			if (bits(5,4) == 2)
-			{
-				if (index_reg)
-				{
-					put_str(index_reg);
-					put_str(",");
-				}
-				else
-					put_str("HL,");
-			}
+		case 'm':
+			if (ix == NULL)
+				s = putstr(s, "(HL)");
 			else
 			{
-				put_str("A,");
+				*s++ = '(';
+				s = putstr(s, ix);
+				*s++ = d < 0 ? '-' : '+';
+				s = puthex(s, d < 0 ? -d : d, 2);
+				*s++ = ')';
 			}
 
-			switch (bits(5,4))
-			{
-			case 0:
-				put_str("(BC)");
-				break;
-
-			case 1:
-				put_str("(DE)");
-				break;
-
-			case 2:
-			case 3:
-				put_char('(');
-				byte_count += 2;
-				loc += 2;
-				put_addr(z80, loc);
-				put_char(')');
-				break;
-			}
-
-			break;
-
-		case 0x0B:
-			put_str(OPC_DEC);
-			put_dd_reg(bits(5,4));
 			break;
-		}
-
-		break;
-
-	case 1:
-		/* if ((bits(5,3) != 6) && (bits(2,0) != 6)) */
-		if (z80->mem[loc] == 0x76)
-		{
-			put_str("HALT");
-		}
-		else
-		{
-			put_str(OPC_LD);
-			put_reg(z80, bits(5,3), loc);
-			put_char(',');
-			put_reg(z80, bits(2,0), loc);
-		}
-
-		break;
 
-	case 2:
-		put_str(op_names[bits(5,3)]);
-		put_reg(z80, bits(2,0), loc);
-		break;
-
-	case 3:
-		if (z80->mem[loc] == 0xCB)
-		{
-			loc++;
-			byte_count++;
-
-			if (bits(7,6) == 0)
-			{
-				put_str(shf_op_names[bits(5,3)]);
-			}
-			else
-			{
-				put_str(bit_op_names[bits(7,6)]);
-				put_digit(bits(5,3));
-				put_char(',');
-			}
-
-			put_reg(z80, bits(2,0), loc);
+		default:
+			*s++ = *t;
 			break;
 		}
 
-		/*if ((z80->mem[loc] & 0x0DD) == 0x0DD)*/
-		if (z80->mem[loc] == 0xDD)
-		{
-			if (bits(5,5))
-				index_reg = "IY";
-			else
-				index_reg = "IX";
-
-			byte_count = disassem(z80, loc + 1, NULL);
-			loc += byte_count;
+	*s = '\0';
+	return len;
+}
 
-			break;
-		}
+/* disassemble the instruction at "start" in the Z80's memory into "buf",
+   which must have room for DISASSEMSIZE characters, & return its length */
+int
+disassemstr(z80info *z80, word start, char *buf)
+{
+	byte code[4];
+	int i;
 
-		if (z80->mem[loc] == 0xED)
-		{
-			loc++;
-			byte_count++;
+	for (i = 0; i < 4; i++)
+		code[i] = z80->mem[(word)(start + i)];
 
-			switch (bits(7,6))
-			{
-			case 0:
-				put_str(OPC_ILLEGAL);
-				break;
-
-			case 1:
-				switch (bits(3,0))
-				{
-				case 0:
-				case 8:
-					put_str("IN    ");
-					put_reg(z80, bits(5,3), loc);
-					put_str(",[C]");
-					break;
-
-				case 1:
-				case 9:
-					put_str("OUT   [C],");
-					put_reg(z80, bits(5,3), loc);
-					break;
-
-				case 2:
-					put_str("SBC   HL,");
-					put_dd_reg(bits(5,4));
-					break;
-
-				case 0xA:
-					put_str("ADC   HL,");
-					put_dd_reg(bits(5,4));
-					break;
-
-				case 3:
-					put_str(OPC_LD);
-					put_char('(');
-					put_addr(z80, loc + 2);
-					put_str("),");
-					put_dd_reg(bits(5,4));
-					byte_count += 2;
-					loc += 2;
-					break;
-
-				case 0xB:
-					put_str(OPC_LD);
-					put_dd_reg(bits(5,4));
-					put_str(",(");
-					byte_count += 2;
-					loc += 2;
-					put_addr(z80, loc);
-					put_char(')');
-					break;
-
-				case 4:
-					if (bits(5,4) == 0)
-						put_str("NEG");
-					else
-						put_str(OPC_ILLEGAL);
-
-					break;
-
-				case 0xC:
-					put_str(OPC_ILLEGAL);
-					break;
-
-				case 5:
-					if (bits(5,4) == 0)
-						put_str("RETN");
-					else
-						put_str(OPC_ILLEGAL);
-
-					break;
-
-				case 0xD:
-					if (bits(5,4) == 0)
-						put_str("RETI");
-					else
-						put_str(OPC_ILLEGAL);
-
-					break;
-
-				case 6:
-					if (bits(5,4) == 0)
-						put_str("IM    0");
-					else if (bits(5,4) == 1)
-						put_str("IM    1");
-					else
-						put_str(OPC_ILLEGAL);
-
-					break;
-
-				case 0xE:
-					if (bits(5,4) == 1)
-						put_str("IM    2");
-					else
-						put_str(OPC_ILLEGAL);
-					break;
-
-				case 7:
-					if (bits(5,4) == 0)
-						put_str("LD    I,A");
-					else if (bits(5,4) == 1)
-						put_str("LD    A,I");
-					else if (bits(5,4) == 2)
-						put_str("RRD");
-					else
-						put_str(OPC_ILLEGAL);
-
-					break;
-
-				case 0xF:
-					if (bits(5,4) == 0)
-						put_str("LD    R,A");
-					else if (bits(5,4) == 1)
-						put_str("LD    A,R");
-					else if (bits(5,4) == 2)
-						put_str("RLD");
-					else
-						put_str(OPC_ILLEGAL);
-
-					break;
-				}
-
-			    break;
-
-			case 2:
-			    if (bits(5,5) == 0)
-			    {
-				    put_str(OPC_ILLEGAL);
-				    break;
-			    }
-
-			    if (bits(2,2) == 1)
-			    {
-				    put_str(OPC_ILLEGAL);
-				    break;
-			    }
-
-			    put_str(rep_op_names[
-				    ((z80->mem[loc] >> 1) & 0xC)
-				    | (z80->mem[loc] & 3)
-				    ]);
-			    break;
-
-			case 3:
-			    put_str(OPC_ILLEGAL);
-			    break;
-			}
+	return disassemble(code, start, buf);
+}
 
-			break;
-		}
+/* the same, on "fp" */
+int
+disassem(z80info *z80, word start, FILE *fp)
+{
+	char buf[DISASSEMSIZE];
+	int len = disassemstr(z80, start, buf);
 
-		if ((z80->mem[loc] & 0x06) == 0x06)
-		{
-			put_str(op_names[bits(5,3)]);
-			loc++;
-			byte_count++;
-			put_byte(z80->mem[loc]);
-			break;
-		}
+	fputs(buf, fp);
+	return len;
+}
 
-		switch (bits(2,0))
-		{
-		case 0:
-			put_str(OPC_RET);
-			put_cc(bits(5,3));
-			break;
+/* a line of a listing, for the monitor's Z & --disassemble: the address,
+   the instruction & its bytes, from the 64k of "mem", into "buf", which
+   must have room for DISLINESIZE characters  --  the return is how long
+   the instruction is */
+int
+disassemline(const byte *mem, word addr, char *buf)
+{
+	byte code[4];
+	char *s = buf;
+	int i, len, n;
 
-		case 1:
-			switch (bits(5,3))
-			{
-			case 0:
-			case 2:
-			case 4:
-			case 6:
-				put_str(OPC_POP);
-				put_qq_reg(bits(5,4));
-				break;
-
-			case 1:
-				put_str(OPC_RET);
-				break;
-
-			case 3:
-				put_str(OPC_EXX);
-				break;
-
-			case 5:
-				put_str(OPC_JP);
-
-				if (index_reg)
-				{
-					put_str("(");
-					put_str( index_reg);
-					put_str(")");
-				}
-				else
-					put_str("(HL)");
-
-				break;
-
-			case 7:
-				put_str(OPC_LD);
-				put_str("SP,");
-
-				if (index_reg)
-					put_str(index_reg);
-				else
-					put_str("HL");
-
-				break;
-			}
+	for (i = 0; i < 4; i++)
+		code[i] = mem[(word)(addr + i)];
 
-			break;
+	s = putstr(s, "  ");
+	s = puthex(s, addr, 4);
+	s = putstr(s, ":    ");
+	len = disassemble(code, addr, s);
 
-		case 2:
-			put_str(OPC_JP);
-			put_cc(bits(5,3));
-			put_char(',');
-			byte_count += 2;
-			loc += 2;
-			put_addr(z80, loc);
-			break;
+	for (n = strlen(s), s += n; n < 15; n++)
+		*s++ = ' ';
 
-		case 3:
-			switch (bits(5,3))
-			{
-			case 0:
-				put_str(OPC_JP);
-				byte_count += 2;
-				loc += 2;
-				put_addr(z80, loc);
-				break;
-
-			case 2:
-				loc++;
-				byte_count++;
-				put_str(OPC_OUT);
-				put_char('(');
-				put_byte(z80->mem[loc]);
-				put_str("),A");
-				break;
-
-			case 3:
-				loc++;
-				byte_count++;
-				put_str(OPC_IN);
-				put_str("A,(");
-				put_byte(z80->mem[loc]);
-				put_char(')');
-				break;
-
-			case 4:
-				put_str(OPC_EX);
-				put_str("(SP),");
-
-				if (index_reg)
-					put_str(index_reg);
-				else
-					put_str("HL");
-
-				break;
-
-			case 5:
-				put_str(OPC_EX);
-				put_str("HL,DE");
-				break;
-
-			case 6:
-				put_str(OPC_DI);
-				break;
-
-			case 7:
-				put_str(OPC_EI);
-				break;
-			}
+	for (i = 0; i < len; i++)
+	{
+		s = putstr(s, "  ");
+		s = puthex(s, code[i], 2);
+	}
 
-			break;
+	*s = '\0';
+	return len;
+}
 
-		case 4:
-			put_str(OPC_CALL);
-			put_cc(bits(5,3));
-			put_char(',');
-			byte_count += 2;
-			loc += 2;
-			put_addr(z80, loc);
-			break;
+/* list the instructions in the file "fname", loaded at "org", from "from"
+   up to "to" (inclusive) on "fp" (--disassemble)  --  they are the whole
+   file if "from" is more than "to" */
+boolean
+disassemfile(const char *fname, word org, word from, word to, FILE *fp)
+{
+	char line[DISLINESIZE];
+	byte *mem;
+	size_t n;
+	long addr, end;
+	FILE *in;
 
-		case 5:
-			if (bits(3,3))
-			{
-				put_str(OPC_CALL);
-				byte_count += 2;
-				loc += 2;
-				put_addr(z80, loc);
-			}
-			else
-			{
-				put_str(OPC_PUSH);
-				put_qq_reg(bits(5,4));
-			}
+	if ((in = fopen(fname, "rb")) == NULL)
+	{
+		perror(fname);
+		return FALSE;
+	}
 
-			break;
+	if ((mem = calloc(0x10000L, 1)) == NULL)
+	{
+		fprintf(stderr, "No memory to disassemble in\n");
+		fclose(in);
+		return FALSE;
+	}
 
-		case 6:
-			put_str(OPC_ILLEGAL);
-			break;
+	n = fread(mem + org, 1, 0x10000L - org, in);
+	fclose(in);
 
-		case 7:
-			put_str(OPC_RST);
-			put_byte(z80->mem[loc] & 0x038);
-			break;
-		}
+	if (from <= to)
+	{
+		addr = from;
+		end = (long)to + 1;
+	}
+	else
+	{
+		addr = org;
+		end = (long)org + n;
+	}
 
-		break;
+	while (addr < end)
+	{
+		addr += disassemline(mem, (word)addr, line);
+		fputs(line, fp);
+		putc('\n', fp);
 	}
 
-	loc++;
-	byte_count++;
-	return byte_count;
+	free(mem);
+	return TRUE;
 }
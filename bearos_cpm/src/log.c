@@ -0,0 +1,242 @@
+/*-----------------------------------------------------------------------*\
+ |  log.c  --  the log of the monitor's O(utput) command: the console    |
+ |  output & the trace, put into a buffer in memory as the Z80 runs and  |
+ |  written to the file by a thread of its own, or a chunk at a time     |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+#ifdef LOG_THREAD
+#include <pthread.h>
+#endif
+
+
+/* The emulator puts the bytes of the log into a ring, with no locking,
+   and hands what it has put in to the writer once there is a chunk of
+   it, when the program waits for a key or the monitor is entered, and
+   on the way out  --  see logflush().  The ring is only ever LOGSIZE
+   bytes, so if the file cannot keep up, the emulator waits for room.
+   Without threads, handing a chunk over writes it out there & then. */
+
+#ifdef LOG_THREAD
+#define LOGSIZE		(1L << 20)	/* the ring, a power of 2 */
+#define LOGCHUNK	(1L << 16)	/* handed to the writer at once */
+#else
+#define LOGSIZE		(1L << 14)
+#define LOGCHUNK	LOGSIZE
+#endif
+
+struct loginfo
+{
+	FILE *fp;
+	char *name;
+	boolean error;		/* a write to "fp" failed */
+
+	/* bytes put in by the emulator, handed to the writer & written
+	   (counted from the start  --  the ring has them modulo LOGSIZE)
+	   & what the emulator last saw of "done", so that it knows how
+	   much room there is without the lock */
+	unsigned long in, given, done, room;
+	char buf[LOGSIZE];
+
+#ifdef LOG_THREAD
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t more;	/* for the writer: something was handed over */
+	pthread_cond_t written;	/* for the emulator: "done" went up */
+	boolean stop;		/* for the writer: nothing more will come */
+#endif
+};
+
+
+/* write out what is in the ring from "from" up to "to" */
+static void
+logdrain(struct loginfo *log, unsigned long from, unsigned long to)
+{
+	unsigned long n;
+
+	while (from != to)
+	{
+		n = LOGSIZE - (from & (LOGSIZE - 1));
+
+		if (n > to - from)
+			n = to - from;
+
+		if (fwrite(log->buf + (from & (LOGSIZE - 1)), 1, n, log->fp) != n)
+			log->error = TRUE;
+
+		from += n;
+	}
+
+	if (fflush(log->fp) != 0)
+		log->error = TRUE;
+}
+
+#ifdef LOG_THREAD
+/* the writer thread: writes what is handed over until told to stop */
+static void *
+logwriter(void *arg)
+{
+	struct loginfo *log = arg;
+	unsigned long from, to;
+
+	pthread_mutex_lock(&log->lock);
+
+	while (1)
+	{
+		while (log->given == log->done && !log->stop)
+			pthread_cond_wait(&log->more, &log->lock);
+
+		if (log->given == log->done)
+			break;
+
+		from = log->done;
+		to = log->given;
+		pthread_mutex_unlock(&log->lock);
+
+		logdrain(log, from, to);
+
+		pthread_mutex_lock(&log->lock);
+		log->done = to;
+		pthread_cond_broadcast(&log->written);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+#endif
+
+/* hand what has been put in to the writer, & wait for all of it to be
+   written if "wait"  --  or, with no room left, for some of it to be */
+static void
+loghand(struct loginfo *log, boolean wait)
+{
+#ifdef LOG_THREAD
+	pthread_mutex_lock(&log->lock);
+
+	if (log->given != log->in)
+	{
+		log->given = log->in;
+		pthread_cond_signal(&log->more);
+	}
+
+	while (wait ? log->done != log->in : log->in - log->done == LOGSIZE)
+		pthread_cond_wait(&log->written, &log->lock);
+
+	log->room = log->done;
+	pthread_mutex_unlock(&log->lock);
+#else
+	(void)wait;
+	logdrain(log, log->done, log->in);
+	log->room = log->done = log->given = log->in;
+#endif
+}
+
+
+/* start logging to "fname"  --  NULL if it cannot be opened, or there
+   is no memory or thread for it */
+struct loginfo *
+logopen(const char *fname)
+{
+	struct loginfo *log;
+
+	if ((log = calloc(1, sizeof *log)) == NULL)
+		return NULL;
+
+	if ((log->name = malloc(strlen(fname) + 1)) == NULL)
+	{
+		free(log);
+		return NULL;
+	}
+
+	strcpy(log->name, fname);
+
+	if ((log->fp = fopen(fname, "w")) == NULL)
+	{
+		free(log->name);
+		free(log);
+		return NULL;
+	}
+
+#ifdef LOG_THREAD
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->more, NULL);
+	pthread_cond_init(&log->written, NULL);
+
+	if (pthread_create(&log->writer, NULL, logwriter, log) != 0)
+	{
+		pthread_cond_destroy(&log->written);
+		pthread_cond_destroy(&log->more);
+		pthread_mutex_destroy(&log->lock);
+		fclose(log->fp);
+		free(log->name);
+		free(log);
+		return NULL;
+	}
+#endif
+
+	return log;
+}
+
+/* write out all that is in the log & stop logging */
+void
+logclose(struct loginfo *log)
+{
+	loghand(log, TRUE);
+
+#ifdef LOG_THREAD
+	pthread_mutex_lock(&log->lock);
+	log->stop = TRUE;
+	pthread_cond_signal(&log->more);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->writer, NULL);
+
+	pthread_cond_destroy(&log->written);
+	pthread_cond_destroy(&log->more);
+	pthread_mutex_destroy(&log->lock);
+#endif
+
+	if (fclose(log->fp) != 0 || log->error)
+		fprintf(stderr, "error writing log %s\r\n", log->name);
+
+	free(log->name);
+	free(log);
+}
+
+/* put "c" into the log */
+void
+logputc(struct loginfo *log, int c)
+{
+	if (log->in - log->room == LOGSIZE)
+		loghand(log, FALSE);
+
+	log->buf[log->in++ & (LOGSIZE - 1)] = c;
+
+	if (log->in - log->given >= LOGCHUNK)
+		loghand(log, FALSE);
+}
+
+void
+logputs(struct loginfo *log, const char *s)
+{
+	while (*s != '\0')
+		logputc(log, *s++);
+}
+
+/* hand the log to the writer, for it to be written soon */
+void
+logsync(struct loginfo *log)
+{
+	if (log->in != log->given)
+		loghand(log, FALSE);
+}
+
+/* write out all that is in the log, & wait until it is */
+void
+logflush(struct loginfo *log)
+{
+	loghand(log, TRUE);
+}
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #ifdef BEAROS
 #include <bearos/compat.h>
@@ -38,6 +39,7 @@
 #ifdef BEAROS
 #else
 #	include <sys/ioctl.h>
+#	include <sys/time.h>
 #endif
 #	if defined POSIX_TTY
 #		include <sys/termios.h>
@@ -59,8 +61,27 @@
 extern int errno;
 
 
+/* how many instructions the trace ring keeps, unless told otherwise */
+#ifdef BEAROS
+#define TRACESIZE	4096L
+#else
+#define TRACESIZE	(1L << 20)
+#endif
+
+
 /* globally visible vars */
-static FILE *logfile = NULL;
+static z80info *z80 = NULL;	/* the machine run from the command line */
+static clock_t started;		/* host CPU time when we started */
+static int stats = 0;		/* show the counts on exit (--stats) */
+static int profile = 0;		/* show the profile on exit (--profile) */
+static const char *tracefile = NULL;	/* for the trace ring (--trace-ring) */
+static unsigned long tracesize = TRACESIZE;	/* instructions it keeps */
+#ifndef BEAROS
+static const char *bench = NULL;	/* keystroke script for --bench */
+static const char *benchout = NULL;	/* where its output goes, if kept */
+static struct timeval benchstart;
+static double mhz = 0;			/* clock rate for --mhz, 0 for flat out */
+#endif
 
 
 #ifndef _WIN32
@@ -102,6 +123,8 @@ char *jgets(char *s, int len, FILE *f)
 void
 resetterm(void)
 {
+	if (z80 != NULL && z80->vt != NULL)
+		vtflush(z80->vt);
 #ifndef _WIN32
     if (have_term)
 #ifdef BEAROS
@@ -191,6 +214,135 @@ initterm(void)
 
 
 
+/*-----------------------------------------------------------------------*\
+ |  showstats  --  show the T-states, instructions and BDOS/BIOS calls
+ |  counted so far, with at most "maxops" of the opcodes run most (or
+ |  all of them if "maxops" is zero)
+\*-----------------------------------------------------------------------*/
+
+static const unsigned long *histcounts;
+
+static int
+cmphist(const void *a, const void *b)
+{
+	unsigned long ca = histcounts[*(const int *)a];
+	unsigned long cb = histcounts[*(const int *)b];
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void
+showstats(z80info *z80, FILE *fp, int maxops)
+{
+	static int order[OPS_GROUPS << 8];
+	static const char *const group[OPS_GROUPS] =
+	{
+		"", "CB ", "DD/FD ", "ED ", "DD/FD CB .. "
+	};
+	unsigned long ms, khz = 0, ips = 0, pm;
+	int i, n = 0;
+
+	ms = (unsigned long)((double)(clock() - started) * 1000 /
+			CLOCKS_PER_SEC);
+
+	if (ms > 0)
+	{
+		khz = z80->cycles / ms;
+		ips = (unsigned long)((double)z80->insns * 1000 / ms);
+	}
+
+	fprintf(fp, "    %lu T-states, %lu instructions in %lu.%03lu s host CPU\n",
+			z80->cycles, z80->insns, ms / 1000, ms % 1000);
+	fprintf(fp, "    %lu.%02lu MHz emulated, %lu instructions/s\n",
+			khz / 1000, khz % 1000 / 10, ips);
+
+	/* the prefixes are counted as they are dispatched too, but
+	   their groups already have the count for each opcode */
+	for (i = 0; i < OPS_GROUPS << 8; i++)
+		if (z80->ophist[i] > 0 && i != 0xCB && i != 0xDD &&
+				i != 0xED && i != 0xFD && i != ((OPS_XY << 8) | 0xCB))
+			order[n++] = i;
+
+	if (!z80->countops)
+		fprintf(fp, "    Opcodes are only counted with --stats\n");
+	else if (n > 0)
+	{
+		histcounts = z80->ophist;
+		qsort(order, n, sizeof *order, cmphist);
+
+		if (maxops > 0 && n > maxops)
+			n = maxops;
+
+		fprintf(fp, "    Opcodes run most:\n");
+
+		for (i = 0; i < n; i++)
+		{
+			/* in tenths of a percent */
+			pm = (unsigned long)((double)z80->ophist[order[i]] *
+					1000 / z80->insns);
+			fprintf(fp, "      %s%.2X%*s%12lu  %3lu.%lu%%\n",
+					group[order[i] >> 8], order[i] & MASK8,
+					(int)(14 - strlen(group[order[i] >> 8])), "",
+					z80->ophist[order[i]], pm / 10, pm % 10);
+		}
+	}
+
+	for (i = n = 0; i < 0x100; i++)
+		if (z80->bdoscalls[i] > 0)
+		{
+			if (n++ == 0)
+				fprintf(fp, "    BDOS calls:\n");
+
+			fprintf(fp, "      %3d %-32s%10lu\n", i, bdos_decode(i),
+					z80->bdoscalls[i]);
+		}
+
+	for (i = n = 0; i < MAXBIOSFN; i++)
+		if (z80->bioscalls[i] > 0)
+		{
+			if (n++ == 0)
+				fprintf(fp, "    BIOS calls:\n");
+
+			fprintf(fp, "      %3d %-32s%10lu\n", i, bios_decode(i),
+					z80->bioscalls[i]);
+		}
+}
+
+#ifdef MEM_BREAK
+/* what the X & Y commands want set or cleared at "str": "loc" for a
+   breakpoint, "R loc" for a read watchpoint or "W loc" for a write one
+   --  the M_* flag, with the address in "*addr", or 0 if it is no good */
+static int
+brkspec(const char *str, unsigned int *addr)
+{
+	int flag = M_BREAKPOINT;
+
+	while (isspace(*(unsigned char *)str))
+		str++;
+
+	if (tolower(*(unsigned char *)str) == 'r' ||
+			tolower(*(unsigned char *)str) == 'w')
+	{
+		flag = tolower(*(unsigned char *)str) == 'r' ?
+				M_WATCH_READ : M_WATCH_WRITE;
+		str++;
+	}
+
+	if (sscanf(str, "%x", addr) != 1 || *addr >= 0x10000)
+		return 0;
+
+	return flag;
+}
+
+static const char *
+brkname(int flag)
+{
+	return flag == M_WATCH_READ ? "Read watchpoint" :
+			flag == M_WATCH_WRITE ? "Write watchpoint" : "Breakpoint";
+}
+#endif /* MEM_BREAK */
+
+
 /*-----------------------------------------------------------------------*\
  |  command  --  called when user-level commands are needed by the z80
  |  for some reason or another
@@ -205,16 +357,32 @@ command(z80info *z80)
 	static word pe = 0;
 	static word po = 0;
 
+	/* a --batch job has no monitor: the others are still running on
+	   the same terminal, so the job ends, with whatever was shown */
+	if (z80->exitjmp != NULL)
+	{
+		fflush(stdout);
+		exit_cpm(z80, JOB_FAILED);
+	}
+
 	resetterm();
 	printf("\n");
 
+	/* all that was logged is in the file while in the monitor */
+	if (z80->logfile != NULL)
+		logflush(z80->logfile);
+
 loop:	/* "infinite" loop */
 
 	/* prompt for a command from the user & then do it */
 	printf("Cmd: ");
 	fflush(stdout);
 	*str = '\0';
-	fgets(str, sizeof str - 1, stdin);
+
+	/* with no more input  --  the end of a --bench script, say  --  there
+	   is nothing to do but quit */
+	if (fgets(str, sizeof str - 1, stdin) == NULL)
+		strcpy(str, "q");
 
 	for (s = str; *s == ' ' || *s == '\t'; s++)
 		;
@@ -226,16 +394,19 @@ loop:	/* "infinite" loop */
 		printf("   E(xamine memory)  P(oke memory)  R(egister modify)\n");
 		printf("   L(oad binary)  C(ontinue running - <CR> if Step)\n");
 		printf("   G(o) B(oot CP/M)  Z(80 disassembled dump)\n");
-		printf("   W(write memory to file)  X,Y(-set/clear breakpoint)\n");
-		printf("   O(output to \"logfile\")\n\n");
+		printf("   W(write memory to file)  X,Y(-set/clear break/watchpoint)\n");
+		printf("   O(output to \"logfile\")  H(its/misses of block cache)\n");
+		printf("   I(nstruction & cycle counts)  N(snapshot to file)\n");
+		printf("   K(trace ring on/off)  J(show the last in it)  U(write it to file)\n");
+		printf("   F(profile on/off)  M(ost run code, from the profile)\n\n");
 		printf("   !(fork shell)  ?(command list)  V(ersion)\n\n");
 		break;
 
 	case 'o':
-		if (logfile != NULL)
+		if (z80->logfile != NULL)
 		{
-			fclose(logfile);
-			logfile = NULL;
+			logclose(z80->logfile);
+			z80->logfile = NULL;
 			printf("    Logging off.\n");
 		}
 		else
@@ -249,9 +420,9 @@ loop:	/* "infinite" loop */
 			if (*s == '\0')
 				break;
 
-			logfile = fopen(s, "w");
+			z80->logfile = logopen(s);
 
-			if (logfile == NULL)
+			if (z80->logfile == NULL)
 				printf("Cannot open logfile!\n");
 			else
 				printf("    Logging on.\n");
@@ -266,8 +437,10 @@ loop:	/* "infinite" loop */
 		break;
 
 	case 'q':				/* quit */
-		if (logfile != NULL)
-			fclose(logfile);
+		if (z80->logfile != NULL)
+			logclose(z80->logfile);
+
+		z80->logfile = NULL;
 
 		exit(0);
 		break;
@@ -297,6 +470,63 @@ loop:	/* "infinite" loop */
 		dumptrace(z80);
 		break;
 
+	case 'k':				/* toggle the trace ring */
+		if (z80->tracering != NULL)
+			tracering(z80, 0);
+		else
+			tracering(z80, tracesize);
+
+		if (z80->tracering != NULL)
+			printf("    Trace ring on, for the last %lu instructions\n",
+					z80->tracesize);
+		else
+			printf("    Trace ring off\n");
+
+		break;
+
+	case 'f':				/* toggle profiling */
+		profiling(z80, z80->prof == NULL);
+		printf("    Profile %s\n", z80->prof != NULL ? "on" : "off");
+		break;
+
+	case 'm':				/* show the profile */
+		showprofile(z80, stdout, 10);
+		break;
+
+	case 'j':				/* show the end of the trace ring */
+		if (z80->tracering == NULL)
+		{
+			printf("    The trace ring is off\n");
+			break;
+		}
+
+		printf("    How many? (20) : ");
+		jgets(str, sizeof(str), stdin);
+		t = 20;
+		sscanf(str, "%u", &t);
+		showtrace(z80, t, stdout);
+		break;
+
+	case 'u':				/* write the trace ring to a file */
+		if (z80->tracering == NULL)
+		{
+			printf("    The trace ring is off\n");
+			break;
+		}
+
+		printf("    File-name? ");
+		jgets(str, sizeof(str), stdin);
+
+		for (s = str; isspace(*(unsigned char *)s); s++)
+			;
+
+		if (*s != '\0' && savetrace(z80, s))
+			printf("    %lu instructions written.\n",
+				z80->traced < z80->tracesize ?
+				z80->traced : z80->tracesize);
+
+		break;
+
 	case 'e':					/* examine memory */
 		printf("    Starting at loc? (%.4X) : ", pe);
 		jgets(str, sizeof(str), stdin);
@@ -348,67 +578,82 @@ loop:	/* "infinite" loop */
 
 		break;
 
-	case 'x':			/* set breakpoint */
+	case 'x':			/* set breakpoint or watchpoint */
 #ifdef MEM_BREAK
-		printf("    Set breakpoint at loc? (A for abort): ");
+		printf("    Set breakpoint at loc, R loc/W loc to watch reads/"
+				"writes? (A for abort): ");
 		jgets(str, sizeof(str), stdin);
 
 		if (tolower(*(unsigned char *)str) == 'a' || *str == '\0')
 			break;
 
-		sscanf(str, "%x", &t);
-
-		if (t >= sizeof z80->mem)
+		if ((e = brkspec(str, &t)) == 0)
 		{
-			printf("Cannot set breakpoint at addr 0x%X\n", t);
+			printf("Cannot set breakpoint at %s\n", str);
 			break;
 		}
 
-		if (!(z80->membrk[t] & M_BREAKPOINT))
+		if (!(z80->membrk[t] & e))
 		{
-			printf("    Breakpoint set at addr 0x%X\n", t);
-			z80->membrk[t] |= M_BREAKPOINT;
-			z80->numbrks++;
+			printf("    %s set at addr 0x%X\n", brkname(e), t);
+			z80_setbrk(z80, t, e, TRUE);
 		}
 #else
 		printf("Sorry, Z80 has not been compiled with MEM_BREAK.\n");
 #endif /* MEM_BREAK */
 		break;
 
-	case 'y':			/* clear breakpoints */
+	case 'y':			/* clear breakpoints or watchpoints */
 #ifdef MEM_BREAK
-		printf("    Clear breakpoint at loc? (A for all) : ");
+		printf("    Clear breakpoint at loc, R loc/W loc for a "
+				"watchpoint? (A for all) : ");
 		jgets(str, sizeof(str), stdin);
 
 		if (tolower(*(unsigned char *)str) == 'a')
 		{
 			for (i = 0; i < sizeof z80->membrk; i++)
-				z80->membrk[i] &= ~M_BREAKPOINT;
+				z80_setbrk(z80, i, M_BREAKPOINT | M_WATCH_READ |
+						M_WATCH_WRITE, FALSE);
 
-			z80->numbrks = 0;
-			printf("    All breakpoints cleared\n");
+			printf("    All breakpoints & watchpoints cleared\n");
 			break;
 		}
 
-		sscanf(str, "%x", &t);
-
-		if (t >= sizeof z80->mem)
+		if ((e = brkspec(str, &t)) == 0)
 		{
-			printf("    Cannot clear breakpoint at addr 0x%X\n", t);
+			printf("    Cannot clear breakpoint at %s\n", str);
 			break;
 		}
 
-		if (z80->membrk[t] & M_BREAKPOINT)
+		if (z80->membrk[t] & e)
 		{
-			printf("Breakpoint cleared at addr 0x%X\n", t);
-			z80->membrk[t] &= ~M_BREAKPOINT;
-			z80->numbrks--;
+			printf("%s cleared at addr 0x%X\n", brkname(e), t);
+			z80_setbrk(z80, t, e, FALSE);
 		}
 #else
 		printf("Sorry, Z80 has not been compiled with MEM_BREAK.\n");
 #endif /* MEM_BREAK */
 		break;
 
+	case 'h':			/* block cache statistics */
+#ifdef BLOCK_CACHE
+		printf("    Block cache: %lu hits, %lu misses, %lu invalidations",
+				z80->blkhits, z80->blkmisses, z80->blkinvals);
+
+		if (z80->blkhits + z80->blkmisses > 0)
+			printf(" (%.1f%% hits)", 100.0 * z80->blkhits /
+					(z80->blkhits + z80->blkmisses));
+
+		printf("\n");
+#else
+		printf("Sorry, Z80 has not been compiled with BLOCK_CACHE.\n");
+#endif /* BLOCK_CACHE */
+		break;
+
+	case 'i':			/* instruction & cycle counts */
+		showstats(z80, stdout, 20);
+		break;
+
 	case 'z':			/* z80 disassembled memory dump */
 		printf("    Starting at loc? (%.4X) : ", pe);
 		jgets(str, sizeof(str), stdin);
@@ -418,18 +663,8 @@ loop:	/* "infinite" loop */
 
 		for (i = 0; i < 0x10; i++)
 		{
-			printf("  %.4X:    ", pe);
-			j = pe;
-			pe += disassem(z80, pe, stdout);
-			t = disassemlen();
-
-			while (t++ < 15)
-				putchar(' ');
-
-			while (j < pe)
-				printf("  %.2X", z80->mem[j++]);
-
-			printf("\n");
+			pe += disassemline(z80->mem, pe, str);
+			printf("%s\n", str);
 		}
 
 		break;
@@ -460,6 +695,7 @@ loop:	/* "infinite" loop */
 			j = 0;
 			sscanf(str, "%x", &j);
 			z80->mem[po] = j;
+			z80_invalidate(z80, po, 1, FALSE);
 			po++;
 		}
 		break;
@@ -505,6 +741,18 @@ loop:	/* "infinite" loop */
 
 		break;
 
+	case 'n':			/* snapshot the machine */
+		printf("    Snapshot file? ");
+		jgets(str, sizeof(str), stdin);
+
+		for (s = str; isspace(*(unsigned char *)s); s++)
+			;
+
+		if (*s != '\0' && savesnapshot(z80, s, z80->waitpc))
+			printf("    Snapshot written.\n");
+
+		break;
+
 	case 'l':			/* load a file into z80 memory */
 		printf("    File-name: ");
 		jgets(str, sizeof(str), stdin);
@@ -556,22 +804,20 @@ loop:	/* "infinite" loop */
 static void
 dumptrace(z80info *z80)
 {
-	printf("a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
+	char buf[80 + DISASSEMSIZE];
+	int n;
+
+	n = sprintf(buf, "a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
 			A, F, BC, DE, HL);
-	printf("ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
+	n += sprintf(buf + n, "ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
 			IX, IY, SP, PC, z80->mem[PC]);
-	disassem(z80, PC, stdout);
-	printf("\r\n");
+	disassemstr(z80, PC, buf + n);
+	strcat(buf, "\r\n");
+	vtflush(z80->vt);	/* after what the program wrote */
+	printf("%s", buf);
 
-	if (logfile)
-	{
-		fprintf(logfile, "a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
-				A, F, BC, DE, HL);
-		fprintf(logfile, "ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
-				IX, IY, SP, PC, z80->mem[PC]);
-		disassem(z80, PC, logfile);
-		fprintf(logfile, "\r\n");
-	}
+	if (z80->logfile)
+		logputs(z80->logfile, buf);
 }
 
 
@@ -609,6 +855,9 @@ loadhex(z80info *z80, FILE *fp)
 	int len, line, i;
 	word addr, check, t;
 
+	/* whatever was run from memory before is about to be overwritten */
+	z80_invalidate(z80, 0, 0x10000L, FALSE);
+
 	for (line = 1; getc(fp) >= 0; line++)		/* should be a ':' */
 	{
 		if ((len = gethex(fp)) <= 0)
@@ -696,6 +945,8 @@ loadpisces(z80info *z80, FILE *file)
 	int numbytes, i;
 	unsigned short loadaddr;
 
+	z80_invalidate(z80, 0, 0x10000L, FALSE);
+
 	/* ignore the 1st 12 words in the file - the 13th word is the starting
 	   PC value - the 14th is also ignored */
 	for (i = 0; i < 12; i++)
@@ -743,7 +994,7 @@ loadfile(z80info *z80, const char *fname)
 	FILE *fp;
 	int ret;
 
-	if ((fp = fopen(fname, "r")) != NULL)
+	if ((fp = cpmfopen(z80, fname, "r")) != NULL)
 	{
 		ret = loadhex(z80, fp);
 		fclose(fp);
@@ -753,7 +1004,7 @@ loadfile(z80info *z80, const char *fname)
 	strcpy(buf, fname);
 	suffix(buf, ".hex");
 
-	if ((fp = fopen(buf, "r")) != NULL)
+	if ((fp = cpmfopen(z80, buf, "r")) != NULL)
 	{
 		ret = loadhex(z80, fp);
 		fclose(fp);
@@ -763,7 +1014,7 @@ loadfile(z80info *z80, const char *fname)
 	strcpy(buf, fname);
 	suffix(buf, ".X");
 
-	if ((fp = fopen(buf, "r")) != NULL)
+	if ((fp = cpmfopen(z80, buf, "r")) != NULL)
 	{
 		ret = loadpisces(z80, fp);
 		fclose(fp);
@@ -827,14 +1078,14 @@ input(z80info *z80, byte haddr, byte laddr, byte *val)
 			}
 #else	/* TCGETA */
 			fflush(stdout);
-			data = kget(0);
+			data = kget(z80->vt, 0);
 			/* data = getchar(); */
 
 			while ((data > 0x7f && errno == EINTR) ||
 					data == INTR_CHAR)
 			{
 				command(z80);
-				data = kget(0);
+				data = kget(z80->vt, 0);
 				/* data = getchar(); */
 			}
 #endif
@@ -855,9 +1106,10 @@ input(z80info *z80, byte haddr, byte laddr, byte *val)
 #elif defined DJGPP
 		*val = (kbhit()) ? 0xFF : 0;
 #else	/* UNIX or BeBox */
-		fflush(stdout);
-
-		if (constat())
+		/* kstat() sees to the output once it has waited long
+		   enough - flushing it here is far too often for the
+		   programs that poll the keyboard */
+		if (kstat(z80->vt, z80->insns))
 			*val = 0xFF;
 		else
 			*val = 0x00;
@@ -898,19 +1150,24 @@ output(z80info *z80, byte haddr, byte laddr, byte data)
 
 		if (z80->trace)
 		{
+			vtflush(z80->vt);
 			printf("BIOS call %d\r\n", z80->biosfn);
 
-			if (logfile)
-				fprintf(logfile, "BIOS call %d\r\n",
-					z80->biosfn);
+			if (z80->logfile)
+			{
+				char buf[32];
+
+				sprintf(buf, "BIOS call %d\r\n", z80->biosfn);
+				logputs(z80->logfile, buf);
+			}
 		}
 	} else if (laddr == 0) {
 		/* output a character to the screen */
 		/* putchar(data); */
-		vt52(data);
+		vt52(z80->vt, data);
 
-		if (logfile != NULL)
-			putc(data, logfile);
+		if (z80->logfile != NULL)
+			logputc(z80->logfile, data);
 	} else {
 		/* dump the data for our user */
 		printf("OUTPUT: addr = %X%X  DATA = %X\r\n", haddr, laddr,data);
@@ -919,6 +1176,21 @@ output(z80info *z80, byte haddr, byte laddr, byte data)
 
 
 
+/* end the run if quit() caught a signal for it  --  out here, and not in
+   the handler, exitflush() can take the locks it needs */
+static void
+quitting(z80info *z80)
+{
+	if (z80->quitsig)
+	{
+		vtflush(z80->vt);
+		printf("\r\nCaught signal %d.\r\n", z80->quitsig);
+		resetterm();
+		exit(2);
+	}
+}
+
+
 /*-----------------------------------------------------------------------*\
  |  haltcpu  --  this is called after the z80 halts  --  it is used for
  |  tracing & such
@@ -929,6 +1201,9 @@ haltcpu(z80info *z80)
 {
 	z80->halt = FALSE;
 
+	/* a Unix signal that ends the run */
+	quitting(z80);
+
 	/* we were interrupted by a Unix signal */
 	if (z80->sig)
 	{
@@ -981,9 +1256,18 @@ read_mem(z80info *z80, word addr)
 			addr);
 		/* fake some sort of I/O here and return its value */
 	}
+	else if (z80->membrk[addr] & M_WATCH_READ)
+	{
+		fprintf(stderr, "\r\nRead of 0x%.2X at 0x%X\r\n",
+			z80->mem[addr], addr);
+	}
 
-	dumptrace(z80);
-	command(z80);
+	if (z80->membrk[addr] & (M_BREAKPOINT | M_READ_PROTECT |
+			M_MEM_MAPPED_IO | M_WATCH_READ))
+	{
+		dumptrace(z80);
+		command(z80);
+	}
 #endif	/* MEM_BREAK */
 
 	return z80->mem[addr];
@@ -1011,11 +1295,21 @@ write_mem(z80info *z80, word addr, byte val)
 		/* fake some sort of I/O here and set mem to its value, */
 		/* then return */
 	}
+	else if (z80->membrk[addr] & M_WATCH_WRITE)
+	{
+		fprintf(stderr, "\r\nWrite of 0x%.2X over 0x%.2X at 0x%X\r\n",
+			val, z80->mem[addr], addr);
+	}
 
-	dumptrace(z80);
-	command(z80);
+	if (z80->membrk[addr] & (M_BREAKPOINT | M_WRITE_PROTECT |
+			M_MEM_MAPPED_IO | M_WATCH_WRITE))
+	{
+		dumptrace(z80);
+		command(z80);
+	}
 #endif	/* MEM_BREAK */
 
+	z80_invalidate(z80, addr, 1, TRUE);
 	return z80->mem[addr] = val;
 }
 
@@ -1037,14 +1331,68 @@ undefinstr(z80info *z80, byte instr)
 static void
 quit(int sig)
 {
-	printf("\r\nCaught signal %d.\r\n", sig);
-	resetterm();
-	exit(2);
+	/* the log and the disks may be half written, with their locks held,
+	   so we just tell the z80 to stop, and quitting() does the rest */
+	if (z80 != NULL)
+	{
+	    z80->event = TRUE;
+	    z80->halt = TRUE;
+	    z80->quitsig = sig;
+	}
+}
+
+/* catch "sig" with "fn"  --  a read that waits for a key is not
+   restarted after it, so the z80 gets to stop */
+static void
+catchsig(int sig, void (*fn)(int))
+{
+#ifdef SA_RESTART
+	struct sigaction sa;
+
+	sa.sa_handler = fn;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(sig, &sa, NULL);
+#else
+	signal(sig, fn);
+#endif
+}
+
+
+/*-----------------------------------------------------------------------*\
+ |  keywait  --  called by the BIOS & BDOS calls that read the keyboard
+ |  or ask if it has a key with the address the call starts at, and with
+ |  -1 when they are done  --  a snapshot taken in between starts the
+ |  call again, so that the program is back waiting for its key
+\*-----------------------------------------------------------------------*/
+
+void
+keywait(z80info *z80, int pc)
+{
+	z80->waitpc = pc;
 }
 
+/* called from vt.c when the program has to wait for a key, or keeps on
+   polling for one  --  this is where --save-snapshot writes the snapshot,
+   and the log is handed to its writer, so that it is up to date while
+   the program waits */
+static void
+keywaiting(void *arg)
+{
+	z80info *z80 = arg;
+
+	/* a signal stops the read, and the program then waits again */
+	quitting(z80);
+
+	if (z80->snapfile != NULL && z80->waitpc != -1)
+	{
+		savesnapshot(z80, z80->snapfile, z80->waitpc);
+		z80->snapfile = NULL;
+	}
 
-/* this is needed by both interrupt() and main() */
-static z80info *z80 = NULL;
+	if (z80->logfile != NULL)
+		logsync(z80->logfile);
+}
 
 
 /*-----------------------------------------------------------------------*\
@@ -1065,6 +1413,137 @@ interrupt(int s)
 	signal(s, interrupt);
 }
 
+/*-----------------------------------------------------------------------*\
+ |  exitflush  --  write out what the machine has not written yet, on the
+ |  way out  --  exitstats  --  show the counts on the way out for --stats
+\*-----------------------------------------------------------------------*/
+
+static void
+exitflush(void)
+{
+	if (z80 != NULL)
+		flush_cpm(z80);
+}
+
+/* what the trace ring has when the emulator stops goes to --trace-ring */
+static void
+exittrace(void)
+{
+	if (z80 != NULL && tracefile != NULL)
+		savetrace(z80, tracefile);
+}
+
+static void
+exitprofile(void)
+{
+	if (z80 != NULL)
+	{
+		fprintf(stderr, "\n");
+		showprofile(z80, stderr, 20);
+	}
+}
+
+static void
+exitstats(void)
+{
+	if (z80 != NULL)
+	{
+		fprintf(stderr, "\n");
+		showstats(z80, stderr, 0);
+	}
+}
+
+#ifndef BEAROS
+/*-----------------------------------------------------------------------*\
+ |  benchreport  --  show how long a --bench run took, & how fast it went
+\*-----------------------------------------------------------------------*/
+
+static void
+benchreport(void)
+{
+	struct timeval now;
+	unsigned long ms, ips = 0;
+
+	if (z80 == NULL)
+		return;
+
+	gettimeofday(&now, NULL);
+	ms = (unsigned long)(now.tv_sec - benchstart.tv_sec) * 1000 +
+			(now.tv_usec - benchstart.tv_usec) / 1000;
+
+	if (ms > 0)
+		ips = (unsigned long)((double)z80->insns * 1000 / ms);
+
+	fprintf(stderr, "bench %s: %lu.%03lu s, %lu instructions, "
+			"%lu instructions/s\n", bench, ms / 1000, ms % 1000,
+			z80->insns, ips);
+}
+
+/*-----------------------------------------------------------------------*\
+ |  runpaced  --  run the z80 at "mhz" (--mhz), for the programs that
+ |  count on the speed of a real one
+\*-----------------------------------------------------------------------*/
+
+/* Each slice of instructions is due to end when its T-states would have
+   taken at "mhz", counted from the start, not from the slice before, so
+   that the error never adds up.  The emulator sleeps until then if it is
+   early, and the slices are sized to have about PACEMS of Z80 time in
+   them, so that it seldom has to.  When it is PACESLACK behind, as after
+   waiting for a key or at the command prompt, it starts counting again
+   rather than rush to catch up. */
+
+#define PACEMS		10
+#define PACESLACK	100
+
+static void
+runpaced(z80info *z80)
+{
+	struct timespec start, due, now;
+	unsigned long first, ran, want = (unsigned long)(mhz * 1000 * PACEMS);
+	double ns;
+	int count = 1000;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	first = z80->cycles;
+
+	while (1)
+	{
+		ran = z80->cycles;
+		z80_emulator(z80, count);
+		ran = z80->cycles - ran;
+
+		/* aim the next slice at PACEMS, whatever this one ran */
+		if (ran > 0)
+			count = (double)count * want / ran > 1000000 ? 1000000 :
+					(int)((double)count * want / ran) + 1;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ns = (double)(z80->cycles - first) * 1000 / mhz;
+		due.tv_sec = start.tv_sec + (time_t)(ns / 1e9);
+		due.tv_nsec = start.tv_nsec + (long)(ns - (double)
+				(due.tv_sec - start.tv_sec) * 1e9);
+
+		if (due.tv_nsec >= 1000000000L)
+		{
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000L;
+		}
+
+		/* behind by more than the slack, or the machine was reset */
+		if (z80->cycles < first || (double)(now.tv_sec - due.tv_sec) *
+				1000 + (now.tv_nsec - due.tv_nsec) / 1e6 > PACESLACK)
+		{
+			start = now;
+			first = z80->cycles;
+		}
+		else
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&due, NULL) == EINTR)
+				;
+	}
+}
+#endif
+
 /*-----------------------------------------------------------------------*\
  |  main  --  set up the global vars & run the z80
 \*-----------------------------------------------------------------------*/
@@ -1092,6 +1571,17 @@ return 0;
 	int x;
 	char cmd[256];
 	int help = 0;
+	int exec = 0;
+	const char *snapfile = NULL;	/* snapshot to write */
+	const char *restore = NULL;	/* snapshot to start from */
+	const char *decode = NULL;	/* trace file to show */
+	const char *dislist = NULL;	/* file to disassemble */
+	unsigned long org = 0x100;	/* where it is loaded */
+	unsigned long from = 1, to = 0;	/* what of it to list, if not all */
+	char *end;
+#ifdef BATCH
+	const char *batch = NULL;	/* job file for --batch */
+#endif
 
 	cmd[0] = 0;
 
@@ -1103,10 +1593,66 @@ return 0;
 				exec = 1;
 			} else if (!strcmp(argv[x], "--nobdos")) {
 				nobdos = 1;
+#ifdef DISK_MMAP
+			} else if (!strcmp(argv[x], "--mmap")) {
+				mapdisks = 1;
+#endif
 			} else if (!strcmp(argv[x], "--trace_bdos")) {
 				trace_bdos = 1;
 			} else if (!strcmp(argv[x], "--strace")) {
 				strace = 1;
+			} else if (!strcmp(argv[x], "--stats")) {
+				stats = 1;
+			} else if (!strcmp(argv[x], "--profile")) {
+				profile = 1;
+			} else if (!strcmp(argv[x], "--save-snapshot") && x + 1 < argc) {
+				snapfile = argv[++x];
+			} else if (!strcmp(argv[x], "--restore-snapshot") && x + 1 < argc) {
+				restore = argv[++x];
+			} else if (!strcmp(argv[x], "--trace-ring") && x + 1 < argc) {
+				tracefile = argv[++x];
+			} else if (!strcmp(argv[x], "--trace-size") && x + 1 < argc) {
+				tracesize = strtoul(argv[++x], NULL, 0);
+			} else if (!strcmp(argv[x], "--decode-trace") && x + 1 < argc) {
+				decode = argv[++x];
+			} else if (!strcmp(argv[x], "--disassemble") && x + 1 < argc) {
+				dislist = argv[++x];
+			} else if (!strcmp(argv[x], "--org") && x + 1 < argc) {
+				org = strtoul(argv[++x], &end, 16);
+
+				if (*end != '\0' || org > 0xFFFF) {
+					fprintf(stderr, "--org wants an address in hex\n");
+					exit(1);
+				}
+			} else if (!strcmp(argv[x], "--range") && x + 1 < argc) {
+				from = strtoul(argv[++x], &end, 16);
+
+				if (*end == '-')
+					to = strtoul(end + 1, &end, 16);
+
+				if (*end != '\0' || from > to || to > 0xFFFF) {
+					fprintf(stderr, "--range wants two addresses in "
+							"hex, such as 0100-01FF\n");
+					exit(1);
+				}
+#ifndef BEAROS
+			} else if (!strcmp(argv[x], "--bench") && x + 1 < argc) {
+				bench = argv[++x];
+			} else if (!strcmp(argv[x], "--output") && x + 1 < argc) {
+				benchout = argv[++x];
+			} else if (!strcmp(argv[x], "--mhz") && x + 1 < argc) {
+				mhz = strtod(argv[++x], NULL);
+
+				if (!(mhz > 0 && mhz <= 1000)) {
+					fprintf(stderr, "--mhz wants a clock rate "
+						"up to 1000 MHz\n");
+					exit(1);
+				}
+#endif
+#ifdef BATCH
+			} else if (!strcmp(argv[x], "--batch") && x + 1 < argc) {
+				batch = argv[++x];
+#endif
 			} else {
 				fprintf(stderr, "Unknown option %s\n", argv[x]);
 				exit(1);
@@ -1128,31 +1674,146 @@ return 0;
 		fprintf(stderr, "    --exec         Execute the command and exit\n");
 		fprintf(stderr, "    --nobdos       Do not emulate BDOS: only emulate BIOS\n");
 		fprintf(stderr, "                   Real disk images will be used.        \n");
+#ifdef DISK_MMAP
+		fprintf(stderr, "    --mmap         Map the disk images into memory\n");
+#endif
 		fprintf(stderr, "    --trace_bdos   Trace BDOS calls\n");
+		fprintf(stderr, "    --stats        Show instruction & cycle counts on exit\n");
+		fprintf(stderr, "    --profile      Show where the time went on exit\n");
+		fprintf(stderr, "    --save-snapshot file\n");
+		fprintf(stderr, "                   Snapshot the machine in the file when the\n");
+		fprintf(stderr, "                   program first waits for a key\n");
+		fprintf(stderr, "    --restore-snapshot file\n");
+		fprintf(stderr, "                   Start from the snapshot in the file\n");
+		fprintf(stderr, "    --trace-ring file\n");
+		fprintf(stderr, "                   Keep the last instructions run, and write\n");
+		fprintf(stderr, "                   them to the file on exit\n");
+		fprintf(stderr, "    --trace-size n Keep n of them (%ld by default)\n", TRACESIZE);
+		fprintf(stderr, "    --decode-trace file\n");
+		fprintf(stderr, "                   Show the instructions in a trace file\n");
+		fprintf(stderr, "    --disassemble file\n");
+		fprintf(stderr, "                   List the code in a .COM file, or in the\n");
+		fprintf(stderr, "                   memory image in the file with --org\n");
+		fprintf(stderr, "    --org addr     Where it goes, in hex (0100 by default)\n");
+		fprintf(stderr, "    --range from-to\n");
+		fprintf(stderr, "                   Only list the code from \"from\" to \"to\"\n");
+#ifndef BEAROS
+		fprintf(stderr, "    --bench file   Type the keystrokes in the file, as fast as\n");
+		fprintf(stderr, "                   they are read, and show the time taken\n");
+		fprintf(stderr, "    --output file  Send the console output for --bench to the\n");
+		fprintf(stderr, "                   file instead of throwing it away\n");
+		fprintf(stderr, "    --mhz n        Run no faster than a Z80 at n MHz (such as\n");
+		fprintf(stderr, "                   4 or 2.5), instead of flat out\n");
+#endif
+#ifdef BATCH
+		fprintf(stderr, "    --batch file   Run the jobs in the file, all at once, and\n");
+		fprintf(stderr, "                   show how each of them went\n");
+#endif
 		fprintf(stderr, "\n");
 		exit(0);
 	}
 
-	if (cmd[0]) {
-		stuff_cmd = cmd;
-	}
+	if (decode != NULL)
+		exit(decodetrace(decode, stdout) ? 0 : 1);
+
+	if (dislist != NULL)
+		exit(disassemfile(dislist, org, from, to, stdout) ? 0 : 1);
+
+#ifdef BATCH
+	/* the jobs have machines of their own, without the terminal */
+	if (batch != NULL)
+		exit(runbatch(batch));
+#endif
 
 	z80 = new_z80info();
 
 	if (z80 == NULL)
 		return -1;
 
+	started = clock();
+
+	if (stats)
+	{
+		z80->countops = TRUE;
+		atexit(exitstats);
+	}
+
+	if (profile)
+	{
+		if (!profiling(z80, TRUE))
+			exit(1);
+
+		atexit(exitprofile);
+	}
+
+	if (tracefile != NULL)
+	{
+		if (tracesize == 0)
+		{
+			fprintf(stderr, "--trace-size must be at least 1\n");
+			exit(1);
+		}
+
+		if (!tracering(z80, tracesize))
+			exit(1);
+
+		atexit(exittrace);
+	}
+
+#ifndef BEAROS
+	/* a benchmark reads its keystrokes from the script, and has no
+	   use for the terminal */
+	if (bench != NULL)
+	{
+		if (freopen(bench, "rb", stdin) == NULL)
+		{
+			perror(bench);
+			exit(1);
+		}
+
+		if (freopen(benchout != NULL ? benchout : "/dev/null", "wb",
+				stdout) == NULL)
+		{
+			perror(benchout);
+			exit(1);
+		}
+
+		have_term = 0;
+		gettimeofday(&benchstart, NULL);
+		atexit(benchreport);
+	}
+	else
+#endif
 	initterm();
 
+	if (!init_cpm(z80, NULL, fileno(stdin), fileno(stdout)))
+	{
+		resetterm();
+		exit(1);
+	}
+
+	atexit(exitflush);
+
+	if (cmd[0])
+		z80->stuff_cmd = cmd;
+
+	z80->exec = exec;
+	z80->snapfile = snapfile;
+	z80->vt->waiting = keywaiting;
+	z80->vt->arg = z80;
+#ifndef BEAROS
+	z80->vt->script = bench != NULL;
+#endif
+
 	/* set up the signals */
 #ifdef SIGQUIT
-	signal(SIGQUIT, quit);
+	catchsig(SIGQUIT, quit);
 #endif
 #ifdef SIGHUP
-	signal(SIGHUP, quit);
+	catchsig(SIGHUP, quit);
 #endif
 #ifdef SIGTERM
-	signal(SIGTERM, quit);
+	catchsig(SIGTERM, quit);
 #endif
 #ifdef SIGINT
 	signal(SIGINT, interrupt);
@@ -1162,6 +1823,17 @@ return 0;
 
 	sysreset(z80);
 
+	if (restore != NULL && !loadsnapshot(z80, restore))
+	{
+		resetterm();
+		exit(1);
+	}
+
+#ifndef BEAROS
+	if (mhz > 0)
+		runpaced(z80);
+#endif
+
 	while (1)
 	{
 #ifdef macintosh
@@ -0,0 +1,405 @@
+/*-----------------------------------------------------------------------*\
+ |  profile.c  --  where the Z80 spends its time: a count of the         |
+ |  instructions run at each address, the calls made from where to       |
+ |  where, & the host time taken by each BDOS & BIOS function            |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+
+
+/* The core hands each instruction to profop() (see COUNTOP() in z80.c)
+   as it starts, with the registers as the one before left them.  If that
+   was a call, and it was taken, the stack is 2 bytes lower  --  the call
+   is pushed on a stack of our own, with the SP that its return address
+   is at, and it is over once the SP is above that again, however the
+   routine got back (a RET, a POP and a JP, or the BDOS hook).  All the
+   instructions run in between are put down to the routine called. */
+
+#define PROFDEPTH	256	/* calls followed at once */
+#define PROFEDGES	4096	/* callers & callees, a power of 2 */
+
+#define PROFHASH(from, to) \
+	((((unsigned long)(from) << 16 | (to)) * 2654435761UL >> 12) & \
+		(PROFEDGES - 1))
+
+/* the CALL opcodes (conditional or not) & the RSTs */
+#define ISCALL(t)	((t) == 0xCD || ((t) & 0xC7) == 0xC4 || \
+			 ((t) & 0xC7) == 0xC7)
+
+struct profinfo
+{
+	unsigned long count;		/* instructions profiled */
+	unsigned long hits[0x10000];	/* run at each address */
+	unsigned long calls[0x10000];	/* times each address was called */
+	unsigned long incl[0x10000];	/* run inside the calls to it */
+
+	/* the last instruction */
+	word lastpc, lastsp;
+	byte lastop;
+
+	/* the calls that have not returned yet */
+	struct
+	{
+		word sp;		/* where the return address is */
+		word to;
+		int fn;			/* BDOS function, for a call to 5 */
+		unsigned long start;	/* "count" when it was made */
+	} stack[PROFDEPTH];
+	int depth;
+
+	/* how many times "from" called "to" */
+	struct
+	{
+		word from, to;
+		unsigned long n;
+	} edges[PROFEDGES];
+	unsigned long lostedges;	/* calls with no room left for them */
+
+	/* calls to the BDOS & BIOS functions & the host CPU time they took,
+	   & the instructions run by a BDOS of Z80 code (--nobdos) */
+	unsigned long bdoscalls[0x100];
+	clock_t bdostime[0x100];
+	unsigned long bdosins[0x100];
+	unsigned long bioscalls[MAXBIOSFN];
+	clock_t biostime[MAXBIOSFN];
+};
+
+
+/* turn profiling on or off  --  FALSE if there is no memory for it */
+boolean
+profiling(z80info *z80, boolean on)
+{
+	free(z80->prof);
+	z80->prof = NULL;
+
+	if (!on)
+		return TRUE;
+
+	if ((z80->prof = calloc(1, sizeof *z80->prof)) == NULL)
+	{
+		fprintf(stderr, "No memory to profile in\r\n");
+		return FALSE;
+	}
+
+	z80->prof->lastsp = SP;
+	return TRUE;
+}
+
+/* count the call from "from" to "to" */
+static void
+addedge(struct profinfo *p, word from, word to)
+{
+	unsigned long h = PROFHASH(from, to);
+	int i;
+
+	for (i = 0; i < PROFEDGES; i++, h = (h + 1) & (PROFEDGES - 1))
+		if (p->edges[h].n == 0 || (p->edges[h].from == from &&
+				p->edges[h].to == to))
+		{
+			p->edges[h].from = from;
+			p->edges[h].to = to;
+			p->edges[h].n++;
+			return;
+		}
+
+	p->lostedges++;
+}
+
+/* opcode "t" has just been fetched, from PC - 1 */
+void
+profop(z80info *z80, byte t)
+{
+	struct profinfo *p = z80->prof;
+	word pc = PC - 1;
+
+	/* the routines that have been left */
+	while (p->depth > 0 && SP > p->stack[p->depth - 1].sp)
+	{
+		p->depth--;
+		p->incl[p->stack[p->depth].to] +=
+				p->count - p->stack[p->depth].start;
+
+		if (p->stack[p->depth].fn >= 0)
+			p->bdosins[p->stack[p->depth].fn] +=
+					p->count - p->stack[p->depth].start;
+	}
+
+	/* the one just called */
+	if (ISCALL(p->lastop) && SP == (word)(p->lastsp - 2))
+	{
+		p->calls[pc]++;
+		addedge(p, p->lastpc, pc);
+
+		if (p->depth < PROFDEPTH)
+		{
+			p->stack[p->depth].sp = SP;
+			p->stack[p->depth].to = pc;
+			p->stack[p->depth].fn = pc == 0x0005 ? C : -1;
+			p->stack[p->depth].start = p->count;
+			p->depth++;
+		}
+	}
+
+	p->hits[pc]++;
+	p->count++;
+	p->lastpc = pc;
+	p->lastsp = SP;
+	p->lastop = t;
+}
+
+/* run the BDOS emulation for the function in C, timing it */
+void
+profbdos(z80info *z80)
+{
+	int fn = C;
+	clock_t start = clock();
+
+	check_BDOS_hook(z80);
+
+	if (z80->prof != NULL)
+	{
+		z80->prof->bdoscalls[fn]++;
+		z80->prof->bdostime[fn] += clock() - start;
+	}
+}
+
+/* run BIOS function "fn" with "call", timing it */
+void
+profbios(z80info *z80, int fn, void (*call)(z80info *z80))
+{
+	clock_t start = clock();
+
+	call(z80);
+
+	if (z80->prof != NULL)
+	{
+		z80->prof->bioscalls[fn]++;
+		z80->prof->biostime[fn] += clock() - start;
+	}
+}
+
+
+
+/* the report: the addresses & ranges with the most instructions run,
+   the routines run longest, the commonest calls & the time taken by
+   the BDOS & the BIOS */
+
+/* for sorting the addresses, ranges or edges by a count */
+static const unsigned long *sortcounts;
+
+static int
+cmpcounts(const void *a, const void *b)
+{
+	unsigned long ca = sortcounts[*(const long *)a];
+	unsigned long cb = sortcounts[*(const long *)b];
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* sort the "n" indexes of "counts" that are not zero into "order",
+   biggest first, & return how many there were */
+static long
+sortindex(const unsigned long *counts, long n, long *order)
+{
+	long i, m = 0;
+
+	for (i = 0; i < n; i++)
+		if (counts[i] > 0)
+			order[m++] = i;
+
+	sortcounts = counts;
+	qsort(order, m, sizeof *order, cmpcounts);
+	return m;
+}
+
+/* "n" of "total", in tenths of a percent */
+#define PERMILLE(n, total) \
+	((total) > 0 ? (unsigned long)((double)(n) * 1000 / (total)) : 0)
+
+/* A range is a run of instructions that were all run as many times as
+   each other, with nothing between them but their operands  --  more or
+   less the basic blocks of the program.  This is the one after "a" in
+   its range, or -1 if "a" is the last. */
+static long
+nextinrange(struct profinfo *p, long a)
+{
+	long b;
+
+	for (b = a + 1; b < 0x10000 && b < a + 4; b++)
+		if (p->hits[b] > 0)
+			return p->hits[b] == p->hits[a] ? b : -1;
+
+	return -1;
+}
+
+/* disassemble the instruction at "addr" on "fp", with the count of it
+   & the percent that is of all of them */
+static void
+showinsn(z80info *z80, word addr, unsigned long n, FILE *fp)
+{
+	unsigned long pm = PERMILLE(n, z80->prof->count);
+
+	fprintf(fp, "      %.4X  %12lu %3lu.%lu%%   ", addr, n, pm / 10, pm % 10);
+	disassem(z80, addr, fp);
+	fprintf(fp, "\n");
+}
+
+static void
+showms(clock_t t, FILE *fp)
+{
+	unsigned long us = (unsigned long)((double)t * 1000000 / CLOCKS_PER_SEC);
+
+	fprintf(fp, "%6lu.%03lu ms", us / 1000, us % 1000);
+}
+
+/* show the profile so far on "fp", with at most "max" lines for each
+   part of it */
+void
+showprofile(z80info *z80, FILE *fp, int max)
+{
+	struct profinfo *p = z80->prof;
+	unsigned long *range, edgen[PROFEDGES], pm;
+	long *order, i, j, n, end;
+
+	if (p == NULL)
+	{
+		fprintf(fp, "    Profiling is off\n");
+		return;
+	}
+
+	range = calloc(0x10000, sizeof *range);
+	order = malloc(0x10000 * sizeof *order);
+
+	if (range == NULL || order == NULL)
+	{
+		fprintf(fp, "    No memory for the profile\n");
+		free(range);
+		free(order);
+		return;
+	}
+
+	fprintf(fp, "    %lu instructions profiled\n", p->count);
+
+	/* the hottest single instructions */
+	n = sortindex(p->hits, 0x10000, order);
+
+	if (n > max)
+		n = max;
+
+	if (n > 0)
+		fprintf(fp, "    Addresses run most:\n");
+
+	for (i = 0; i < n; i++)
+		showinsn(z80, order[i], p->hits[order[i]], fp);
+
+	/* the ranges, each counted with its first address */
+	for (i = 0; i < 0x10000; i = end + 1)
+	{
+		if (p->hits[i] == 0)
+		{
+			end = i;
+			continue;
+		}
+
+		for (j = i; j >= 0; j = nextinrange(p, j))
+		{
+			range[i] += p->hits[j];
+			end = j;
+		}
+	}
+
+	n = sortindex(range, 0x10000, order);
+
+	if (n > max)
+		n = max;
+
+	if (n > 0)
+		fprintf(fp, "    Ranges run most:\n");
+
+	for (i = 0; i < n; i++)
+	{
+		pm = PERMILLE(range[order[i]], p->count);
+		fprintf(fp, "    %.4X  %12lu %3lu.%lu%%\n", (word)order[i],
+				range[order[i]], pm / 10, pm % 10);
+
+		/* the code, up to 16 instructions of it */
+		for (j = order[i], end = 0; j >= 0; j = nextinrange(p, j))
+			if (end++ < 16)
+				showinsn(z80, j, p->hits[j], fp);
+
+		if (end > 16)
+			fprintf(fp, "      ... %ld more\n", end - 16);
+	}
+
+	/* the routines that took longest, all that they called included */
+	n = sortindex(p->incl, 0x10000, order);
+
+	if (n > max)
+		n = max;
+
+	if (n > 0)
+		fprintf(fp, "    Routines run longest, with what they call:\n"
+				"      addr         calls  instructions\n");
+
+	for (i = 0; i < n; i++)
+	{
+		pm = PERMILLE(p->incl[order[i]], p->count);
+		fprintf(fp, "      %.4X  %12lu  %12lu %3lu.%lu%%\n",
+				(word)order[i], p->calls[order[i]],
+				p->incl[order[i]], pm / 10, pm % 10);
+	}
+
+	/* the calls made most */
+	for (i = 0; i < PROFEDGES; i++)
+		edgen[i] = p->edges[i].n;
+
+	n = sortindex(edgen, PROFEDGES, order);
+
+	if (n > max)
+		n = max;
+
+	if (n > 0)
+		fprintf(fp, "    Calls made most:\n");
+
+	for (i = 0; i < n; i++)
+		fprintf(fp, "      %.4X -> %.4X  %12lu\n",
+				p->edges[order[i]].from, p->edges[order[i]].to,
+				p->edges[order[i]].n);
+
+	if (p->lostedges > 0)
+		fprintf(fp, "      (%lu more not counted)\n", p->lostedges);
+
+	/* the BDOS & BIOS functions */
+	for (i = j = 0; i < 0x100; i++)
+		if (p->bdoscalls[i] > 0)
+		{
+			if (j++ == 0)
+				fprintf(fp, "    BDOS functions:%33s  host CPU"
+						"  instructions\n", "calls");
+
+			fprintf(fp, "      %3ld %-32s%10lu  ", i, bdos_decode(i),
+					p->bdoscalls[i]);
+			showms(p->bdostime[i], fp);
+			fprintf(fp, "  %12lu\n", p->bdosins[i]);
+		}
+
+	for (i = j = 0; i < MAXBIOSFN; i++)
+		if (p->bioscalls[i] > 0)
+		{
+			if (j++ == 0)
+				fprintf(fp, "    BIOS functions:%33s  host CPU\n",
+						"calls");
+
+			fprintf(fp, "      %3ld %-32s%10lu  ", i, bios_decode(i),
+					p->bioscalls[i]);
+			showms(p->biostime[i], fp);
+			fprintf(fp, "\n");
+		}
+
+	free(range);
+	free(order);
+}
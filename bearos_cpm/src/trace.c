@@ -0,0 +1,194 @@
+/*-----------------------------------------------------------------------*\
+ |  trace.c  --  the trace ring: the last so many instructions run,      |
+ |  kept in memory as they run so that a crash can be looked back on,    |
+ |  and the files they are saved to & decoded from                       |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+
+/* The core puts a "struct tracerec" for every instruction into the ring
+   (see traceop() in z80.c), which costs far less than T(race), as the
+   instructions are neither stopped after nor printed.  A trace file has
+   the ones in the ring, oldest first, after a header with the number of
+   the first of them and how many there are  --  the numbers are written
+   least-significant byte first, as for a snapshot. */
+
+#define TRACEMAGIC	"Z80TRCE"
+#define TRACEVERSION	1
+
+
+/* turn the trace ring on, to keep the last "n" instructions (rounded up
+   to a power of 2), or off if "n" is 0  --  FALSE if out of memory */
+boolean
+tracering(z80info *z80, unsigned long n)
+{
+	unsigned long size;
+
+	free(z80->tracering);
+	z80->tracering = NULL;
+	z80->tracesize = 0;
+	z80->traced = 0;
+
+	if (n == 0)
+		return TRUE;
+
+	for (size = 1; size < n; size <<= 1)
+		;
+
+	if ((z80->tracering = malloc(size * sizeof *z80->tracering)) == NULL)
+	{
+		fprintf(stderr, "No memory for a trace ring of %lu\r\n", size);
+		return FALSE;
+	}
+
+	z80->tracesize = size;
+	return TRUE;
+}
+
+/* show instruction number "n" of a trace, from "tr", in the same form
+   as the T(race) of the monitor  --  it is disassembled from the bytes
+   in the record, since the code may well have changed since it ran */
+static void
+showrec(unsigned long n, const struct tracerec *tr, FILE *fp)
+{
+	char buf[DISASSEMSIZE];
+
+	disassemble(tr->op, tr->pc, buf);
+	fprintf(fp, "%10lu  a%.2X f%.2X bc%.4X de%.4X hl%.4X ", n,
+			tr->af >> 8, tr->af & MASK8, tr->bc, tr->de, tr->hl);
+	fprintf(fp, "ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  %s\n",
+			tr->ix, tr->iy, tr->sp, tr->pc, tr->op[0], buf);
+}
+
+/* show the last "n" instructions in the trace ring (or as many as it
+   has) on "fp", oldest first */
+void
+showtrace(z80info *z80, unsigned long n, FILE *fp)
+{
+	unsigned long i;
+
+	if (z80->tracering == NULL)
+		return;
+
+	if (n > z80->tracesize)
+		n = z80->tracesize;
+
+	if (n > z80->traced)
+		n = z80->traced;
+
+	for (i = z80->traced - n; i != z80->traced; i++)
+		showrec(i, &z80->tracering[i & (z80->tracesize - 1)], fp);
+}
+
+/* write what is in the trace ring to "fname" */
+boolean
+savetrace(z80info *z80, const char *fname)
+{
+	struct tracerec *tr;
+	unsigned long i, n;
+	FILE *fp;
+	int err;
+
+	if (z80->tracering == NULL)
+		return FALSE;
+
+	if ((fp = fopen(fname, "wb")) == NULL)
+	{
+		perror(fname);
+		return FALSE;
+	}
+
+	n = z80->traced < z80->tracesize ? z80->traced : z80->tracesize;
+
+	fwrite(TRACEMAGIC, 1, sizeof TRACEMAGIC - 1, fp);
+	putc(TRACEVERSION, fp);
+	snapput(fp, z80->traced - n, 8);
+	snapput(fp, n, 8);
+
+	for (i = z80->traced - n; i != z80->traced; i++)
+	{
+		tr = &z80->tracering[i & (z80->tracesize - 1)];
+		snapput(fp, tr->pc, 2);
+		fwrite(tr->op, 1, 4, fp);
+		snapput(fp, tr->af, 2);
+		snapput(fp, tr->bc, 2);
+		snapput(fp, tr->de, 2);
+		snapput(fp, tr->hl, 2);
+		snapput(fp, tr->ix, 2);
+		snapput(fp, tr->iy, 2);
+		snapput(fp, tr->sp, 2);
+	}
+
+	err = ferror(fp);
+
+	if (fclose(fp) || err)
+	{
+		fprintf(stderr, "error writing trace %s\r\n", fname);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* show the instructions in the trace file "fname" on "fp" (--decode-trace) */
+boolean
+decodetrace(const char *fname, FILE *fp)
+{
+	char magic[sizeof TRACEMAGIC];
+	struct tracerec tr;
+	unsigned long first, n, i;
+	FILE *in;
+
+	if ((in = fopen(fname, "rb")) == NULL)
+	{
+		perror(fname);
+		return FALSE;
+	}
+
+	if (fread(magic, 1, sizeof magic, in) != sizeof magic ||
+			memcmp(magic, TRACEMAGIC, sizeof magic - 1) ||
+			magic[sizeof magic - 1] != TRACEVERSION)
+	{
+		fprintf(stderr, "%s is not a trace\n", fname);
+		fclose(in);
+		return FALSE;
+	}
+
+	first = snapget(in, 8);
+	n = snapget(in, 8);
+
+	for (i = 0; i < n; i++)
+	{
+		tr.pc = snapget(in, 2);
+
+		if (fread(tr.op, 1, 4, in) != 4)
+			break;
+
+		tr.af = snapget(in, 2);
+		tr.bc = snapget(in, 2);
+		tr.de = snapget(in, 2);
+		tr.hl = snapget(in, 2);
+		tr.ix = snapget(in, 2);
+		tr.iy = snapget(in, 2);
+		tr.sp = snapget(in, 2);
+
+		if (feof(in))
+			break;
+
+		showrec(first + i, &tr, fp);
+	}
+
+	fclose(in);
+
+	if (i < n)
+	{
+		fprintf(stderr, "%s: only %lu of %lu instructions\n", fname, i, n);
+		return FALSE;
+	}
+
+	return TRUE;
+}
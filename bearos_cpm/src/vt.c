@@ -1,94 +1,196 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#ifndef BEAROS
+#include <sys/time.h>
+#ifndef _WIN32
+#include <poll.h>
+#define KPOLL	/* poll() says when the keyboard can be read */
+#endif
+#endif
 #include "vt.h"
 
-int last = -1;
+vtinfo *vtnew(int in, int out)
+{
+	vtinfo *vt = calloc(1, sizeof *vt);
 
-int kpoll(int w)
+	if (vt) {
+		vt->in = in;
+		vt->out = out;
+	}
+	return vt;
+}
+
+void vtdelete(vtinfo *vt)
 {
+	if (vt) {
+		vtflush(vt);
+		free(vt);
+	}
+}
+
+/* Wait up to "ms" for the keyboard to have something to read - BearOS
+   only gives the time to anything else that wants it */
+static int kready(vtinfo *vt, int ms)
+{
+#ifdef KPOLL
+	struct pollfd p;
+
+	p.fd = vt->in;
+	p.events = POLLIN;
+	p.revents = 0;
+	return poll(&p, 1, ms) > 0;
+#else
+	(void)vt;
+	if (ms)
+		usleep(1000);
+	return 1;
+#endif
+}
+
+/* Keyboard input: a ring buffer, filled by reading as much as the
+   keyboard has at once - so that a paste arrives whole, and any escape
+   sequence from a cursor key with it.  The escape sequences that kget()
+   turns into something else are put back at the front. */
+
+#define KCOUNT()	(vt->ktail - vt->khead)
+
+/* The end of the script, with a program waiting for a key */
+static void kended(vtinfo *vt)
+{
+	if (vt->ended)
+		vt->ended(vt->arg);
+	exit(0);
+}
+
+/* Read what there is from the keyboard into kbuf: if "w" is 0, wait */
+static void kfill(vtinfo *vt, int w)
+{
+	unsigned i, n;
 	int c;
-	unsigned char d;
-	int tries;
-	if (last != -1) {
-		c = last;
-		last = -1;
-		return c;
+
+	if (KCOUNT() == KBUFSIZE)
+		return;
+	if (!w) {
+		vtflush(vt);	/* the user must see what we are waiting on */
+		if (vt->waiting)
+			vt->waiting(vt->arg);
 	}
-	for (tries = 0; tries != 1; ++tries) {
-#ifndef _WIN32
+	/* just the part up to the end of kbuf, or up to "khead" */
+	i = vt->ktail & (KBUFSIZE - 1);
+	n = KBUFSIZE - KCOUNT();
+	if (n > KBUFSIZE - i)
+		n = KBUFSIZE - i;
+	{
+#ifdef KPOLL
+		if (w && !kready(vt, 0))
+			return;
+#elif !defined _WIN32
 		int flags;
 		if (w) {
-			flags = fcntl(fileno(stdin), F_GETFL);
-			fcntl(fileno(stdin), F_SETFL, flags | O_NONBLOCK);
+			flags = fcntl(vt->in, F_GETFL);
+			fcntl(vt->in, F_SETFL, flags | O_NONBLOCK);
 		}
 #endif
-		c = read(fileno(stdin), &d, 1);
-#ifndef _WIN32
+		c = read(vt->in, vt->kbuf + i, n);
+#if !defined KPOLL && !defined _WIN32
 		if (w) {
-			fcntl(fileno(stdin), F_SETFL, flags);
+			fcntl(vt->in, F_SETFL, flags);
 		}
 #endif
-		if (c == 1) {
-/*			printf("\r\nkpoll got %d \r\n", d); */
-			return d;
-		}
-/*		usleep(1); */
 	}
-/*	printf("\r\n--- no char after esc? ---\r\n"); fflush(stdout); */
-	return -1;
+	if (c > 0) {
+		if (vt->script)
+			for (n = i; n != i + c; ++n)
+				if (vt->kbuf[n] == '\n')
+					vt->kbuf[n] = '\r';
+		vt->ktail += c;
+	}
+	else if (vt->script && c == 0) {
+		vt->eof = 1;
+		/* nothing more will come if we were waiting for it */
+		if (!w)
+			kended(vt);
+	}
 }
 
-int constat()
+/* Put a character back, in front of any others */
+static void kunget(vtinfo *vt, int c)
 {
-	if (last != -1)
-		return 1;
-	last = kpoll(1);
-	if (last != -1)
-		return 1;
-	else
-		return 0;
+	if (c != -1 && KCOUNT() != KBUFSIZE)
+		vt->kbuf[--vt->khead & (KBUFSIZE - 1)] = c;
 }
 
-/* Input FIFO */
+static int kpoll(vtinfo *vt, int w)
+{
+	if (!KCOUNT())
+		kfill(vt, w);
+	if (!KCOUNT())
+		return -1;
+	return vt->kbuf[vt->khead++ & (KBUFSIZE - 1)];
+}
 
-#define FIFO_SIZE 4
-int stuff[FIFO_SIZE];
-int stuff_ptr;
+int constat(vtinfo *vt)
+{
+	vtdue(vt);
+	if (!KCOUNT())
+		kfill(vt, 1);
+	return KCOUNT() != 0;
+}
+
+/* A program that keeps asking whether a key is ready, and neither does
+   much else nor prints anything in between, is waiting for one: after
+   IDLEPOLLS such polls in a row the emulator sleeps until there is
+   input, for IDLEMS at most  --  or, at the end of a script, the machine
+   is done, as when it reads a key there.  MBASIC looks for a ^C every
+   400 or so instructions while it runs a program, so IDLEINSNS is kept
+   under that */
 
-void kpush(int c)
+#define IDLEPOLLS	64
+#define IDLEINSNS	250	/* instructions between the polls, at most */
+#define IDLEMS		10
+
+int kstat(vtinfo *vt, unsigned long insns)
 {
-	if (c != -1 && stuff_ptr != FIFO_SIZE) {
-		stuff[stuff_ptr++] = c;
+	if (constat(vt)) {
+		vt->idle = 0;
+		return 1;
 	}
+	if (insns - vt->lastpoll > IDLEINSNS || vt->count != vt->lastout)
+		vt->idle = 0;
+	vt->lastpoll = insns;
+	vt->lastout = vt->count;
+	if (++vt->idle < IDLEPOLLS)
+		return 0;
+	/* a script that has run out will not give it the key it wants */
+	if (vt->script && vt->eof)
+		kended(vt);
+	vt->idle = IDLEPOLLS;
+	if (vt->waiting)
+		vt->waiting(vt->arg);
+	vtflush(vt);
+	kready(vt, IDLEMS);
+	return constat(vt);
 }
 
-int kget(int w)
+int kget(vtinfo *vt, int w)
 {
         int c;
-        if (stuff_ptr) {
-        	int x;
-        	c = stuff[0];
-        	for (x = 0; x != stuff_ptr - 1; ++x) {
-        		stuff[x] = stuff[x + 1];
-        	}
-		stuff_ptr--;
-        	stuff[x] = 0;
-        	return c;
-        }
 
-        c = kpoll(w);
+        c = kpoll(vt, w);
         if (c != 27) {
                 return c;
         }
         /* We got ESC.. see if any chars follow */
-        c = kpoll(1);
+        c = kpoll(vt, 1);
 
         if (c == -1) { /* Just ESC */
         	return 27;
         } else if (c == '[') {
-                c = kpoll(0);
+                c = kpoll(vt, 0);
                 if (c == 'A') { /* Up arrow */
                         return 'E' - '@';
                 } else if (c == 'B') { /* Down arrow */
@@ -98,38 +200,38 @@ int kget(int w)
                 } else if (c == 'D') { /* Left arrow */
                         return 'S' - '@';
                 } else if (c == '3') { /* Delete key */
-                        c = kpoll(0);
+                        c = kpoll(vt, 0);
                         return 'G' - '@';
                 } else if (c == '2') { /* Insert key */
-                        c = kpoll(0);
+                        c = kpoll(vt, 0);
                         return 'V' - '@';
                 } else if (c == '5') { /* PgUp */
-                        c = kpoll(0);
+                        c = kpoll(vt, 0);
                         return 'R' - '@';
                 } else if (c == '6') { /* PgDn */
-                        c = kpoll(0);
+                        c = kpoll(vt, 0);
                         return 'C' - '@';
                 } else if (c == '1' || c == '7') { /* Home */
-                	kpush('s');
-                        c = kpoll(0);
+                        c = kpoll(vt, 0);
+                	kunget(vt, 's');
                         return 'Q' - '@';
                 } else if (c == '4' || c == '8') { /* End */
-                        kpush('d');
-                        c = kpoll(0);
+                        c = kpoll(vt, 0);
+                        kunget(vt, 'd');
                         return 'Q' - '@';
                 } else if (c == 'H') { /* Home */
-                        kpush('s');
+                        kunget(vt, 's');
                         return 'Q' - '@';
                 } else if (c == 'F') { /* End */
-                        kpush('d');
+                        kunget(vt, 'd');
                         return 'Q' - '@';
                 } else {
-                	kpush('[');
-                	kpush(c);
+                	kunget(vt, c);
+                	kunget(vt, '[');
                         return 27;
 		}
         } else if (c == 'O') {
-                c = kpoll(0);
+                c = kpoll(vt, 0);
                 if (c == 'A') { /* Up arrow */
                         return 'E' - '@';
                 } else if (c == 'B') { /* Down arrow */
@@ -143,20 +245,20 @@ int kget(int w)
                 } else if (c == 'c') { /* Ctrl right arrow (rxvt) */
                         return 'F' - '@';
                 } else if (c == 'H') { /* Home */
-                        kpush('s');
+                        kunget(vt, 's');
                         return 'Q' - '@';
                 } else if (c == 'F') { /* End */
-                        kpush('d');
+                        kunget(vt, 'd');
                         return 'Q' - '@';
 		} else if (c == 'P' || c == 'Q' || c == 'R' || c == 'S') {
 			return INTR_CHAR;
                 } else {
-                	kpush('O');
-                	kpush(c);
+                	kunget(vt, c);
+                	kunget(vt, 'O');
                 	return 27;
 		}
         } else {
-        	kpush(c);
+        	kunget(vt, c);
         	return 27;
         }
 }
@@ -170,16 +272,104 @@ int kget(int w)
 Oc  Ctrl-Rtarw
 */
 
-void putch(int c) {	/* output character without postprocessing */
-    write(fileno(stdout), &c, 1);
+/* Console output is gathered in "buf" and written out when it is full,
+   before a read that waits for a key, or once the oldest of it has
+   waited VTFLUSHMS for a program that polls the keyboard */
+
+#ifndef BEAROS
+#define VTFLUSHMS 20
+
+/* the time in ms, for how long output has waited - it wraps around */
+static unsigned long vtms(void) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (unsigned long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+#endif
+
+void vtflush(vtinfo *vt) {
+    int i, n;
+
+    for (i = 0; i < vt->len; i += n)
+	if ((n = write(vt->out, vt->buf + i, vt->len - i)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		n = 0;
+	    else
+		break;
+	}
+    vt->len = 0;
+}
+
+/* Flush the output if it has waited long enough */
+void vtdue(vtinfo *vt) {
+#ifdef VTFLUSHMS
+    if (!vt->len || vtms() - vt->since < VTFLUSHMS)
+	return;
+#endif
+    vtflush(vt);
+}
+
+/* Make room for n more characters in the buffer */
+static void vtroom(vtinfo *vt, int n) {
+    ++vt->count;
+    if (vt->len + n > VTBUFSIZE)
+	vtflush(vt);
+#ifdef VTFLUSHMS
+    if (!vt->len)
+	vt->since = vtms();
+#endif
+}
+
+static void vtwrite(vtinfo *vt, const char *s, size_t n) {
+    size_t i;
+
+    while (n) {
+	i = n < VTBUFSIZE ? n : VTBUFSIZE;
+	vtroom(vt, i);
+	memcpy(vt->buf + vt->len, s, i);
+	vt->len += i;
+	s += i;
+	n -= i;
+    }
+}
+
+/* output character without postprocessing */
+static void putch(vtinfo *vt, int c) {
+    vtroom(vt, 1);
+    vt->buf[vt->len++] = c;
+}
+
+static void putmes(vtinfo *vt, const char *s) {
+    vtwrite(vt, s, strlen(s));
 }
 
-void putmes(const char *s) {
-    write(fileno(stdout), s, strlen(s));
+/* what vt52() would pass through untouched, outside an escape sequence */
+#ifdef DEBUGLOG
+#define VTPLAIN(c)	0	/* so that all of it is logged */
+#else
+#define VTPLAIN(c)	(((c) >= ' ' && (c) < 0x7f) || (c) == '\r' || \
+			 (c) == '\n' || (c) == '\b' || (c) == '\t')
+#endif
+
+void vtputs(vtinfo *vt, const char *s, size_t n) {
+    size_t i;
+
+    while (n) {
+	for (i = 0; i < n && vt->state == 0 && VTPLAIN(s[i]); ++i)
+	    ;
+	if (i) {
+	    vtwrite(vt, s, i);
+	    s += i;
+	    n -= i;
+	} else {
+	    vt52(vt, 0x7F & *s++);
+	    --n;
+	}
+    }
 }
 
-void vt52(int c) {	/* simple vt52,adm3a => ANSI conversion */
-    static int state = 0, x, y;
+void vt52(vtinfo *vt, int c) {	/* simple vt52,adm3a => ANSI conversion */
     char buff[32];
 #ifdef DEBUGLOG
     static FILE *log = NULL;
@@ -187,157 +377,157 @@ void vt52(int c) {	/* simple vt52,adm3a => ANSI conversion */
 	log = fopen("cpm.out", "w");
     fputc(c, log);
 #endif
-    switch (state) {
+    switch (vt->state) {
     case 0:
 	switch (c) {
 #ifdef VBELL
         case 0x07:              /* BEL: flash screen */
-            putmes("\033[?5h\033[?5l");
+            putmes(vt, "\033[?5h\033[?5l");
 	    break;
 #endif
 	case 0x7f:		/* DEL: echo BS, space, BS */
-	    putmes("\b \b");
+	    putmes(vt, "\b \b");
 	    break;
 	case 0x1a:		/* adm3a clear screen */
 	case 0x0c:		/* vt52 clear screen */
-	    putmes("\033[H\033[2J");
+	    putmes(vt, "\033[H\033[2J");
 	    break;
 	case 0x1e:		/* adm3a cursor home */
-	    putmes("\033[H");
+	    putmes(vt, "\033[H");
 	    break;
 	case 0x1b:
-	    state = 1;	/* esc-prefix */
+	    vt->state = 1;	/* esc-prefix */
 	    break;
 	case 1:
-	    state = 2;	/* cursor motion prefix */
+	    vt->state = 2;	/* cursor motion prefix */
 	    break;
 	case 2:		/* insert line */
-	    putmes("\033[L");
+	    putmes(vt, "\033[L");
 	    break;
 	case 3:		/* delete line */
-	    putmes("\033[M");
+	    putmes(vt, "\033[M");
 	    break;
 	case 0x18: case 5:	/* clear to eol */
-	    putmes("\033[K");
+	    putmes(vt, "\033[K");
 	    break;
 	case 0x12: case 0x13:
 	    break;
 	default:
-	    putch(c);
+	    putch(vt, c);
 	}
 	break;
     case 1:	/* esc was sent */
 	switch (c) {
         case 0x1b:
-	    putch(c);
+	    putch(vt, c);
 	    break;
 	case '=':
 	case 'Y':
-	    state = 2;
+	    vt->state = 2;
 	    break;
 	case 'E':	/* insert line */
-	    putmes("\033[L");
+	    putmes(vt, "\033[L");
 	    break;
 	case 'R':	/* delete line */
-	    putmes("\033[M");
+	    putmes(vt, "\033[M");
 	    break;
 	case 'B':	/* enable attribute */
-	    state = 4;
+	    vt->state = 4;
 	    break;
 	case 'C':	/* disable attribute */
-	    state = 5;
+	    vt->state = 5;
 	    break;
         case 'L':       /* set line */
         case 'D':       /* delete line */
-            state = 6;
+            vt->state = 6;
             break;
 	case '*':       /* set pixel */
 	case ' ':       /* clear pixel */
-	    state = 8;
+	    vt->state = 8;
 	    break;
 	default:		/* some true ANSI sequence? */
-	    state = 0;
-	    putch(0x1b);
-	    putch(c);
+	    vt->state = 0;
+	    putch(vt, 0x1b);
+	    putch(vt, c);
 	}
 	break;
     case 2:
-	y = c - ' '+1;
-	state = 3;
+	vt->y = c - ' '+1;
+	vt->state = 3;
 	break;
     case 3:
-	x = c - ' '+1;
-	state = 0;
-	sprintf(buff, "\033[%d;%dH", y, x);
-	putmes(buff);
+	vt->x = c - ' '+1;
+	vt->state = 0;
+	sprintf(buff, "\033[%d;%dH", vt->y, vt->x);
+	putmes(vt, buff);
 	break;
     case 4:	/* <ESC>+B prefix */
-        state = 0;
+        vt->state = 0;
         switch (c) {
 	case '0': /* start reverse video */
-	    putmes("\033[7m");
+	    putmes(vt, "\033[7m");
 	    break;
 	case '1': /* start half intensity */
-	    putmes("\033[1m");
+	    putmes(vt, "\033[1m");
 	    break;
 	case '2': /* start blinking */
-	    putmes("\033[5m");
+	    putmes(vt, "\033[5m");
 	    break;
 	case '3': /* start underlining */
-	    putmes("\033[4m");
+	    putmes(vt, "\033[4m");
 	    break;
 	case '4': /* cursor on */
-	    putmes("\033[?25h");
+	    putmes(vt, "\033[?25h");
 	    break;
 	case '6': /* remember cursor position */
-	    putmes("\033[s");
+	    putmes(vt, "\033[s");
 	    break;
 	case '5': /* video mode on */
 	case '7': /* preserve status line */
 	    break;
 	default:
-	    putch(0x1b);
-	    putch('B');
-	    putch(c);
+	    putch(vt, 0x1b);
+	    putch(vt, 'B');
+	    putch(vt, c);
         }
 	break;
     case 5:	/* <ESC>+C prefix */
-        state = 0;
+        vt->state = 0;
         switch (c) {
 	case '0': /* stop reverse video */
-	    putmes("\033[27m");
+	    putmes(vt, "\033[27m");
 	    break;
 	case '1': /* stop half intensity */
-	    putmes("\033[m");
+	    putmes(vt, "\033[m");
 	    break;
 	case '2': /* stop blinking */
-	    putmes("\033[25m");
+	    putmes(vt, "\033[25m");
 	    break;
 	case '3': /* stop underlining */
-	    putmes("\033[24m");
+	    putmes(vt, "\033[24m");
 	    break;
 	case '4': /* cursor off */
-	    putmes("\033[?25l");
+	    putmes(vt, "\033[?25l");
 	    break;
 	case '6': /* restore cursor position */
-	    putmes("\033[u");
+	    putmes(vt, "\033[u");
 	    break;
 	case '5': /* video mode off */
 	case '7': /* don't preserve status line */
 	    break;
 	default:
-	    putch(0x1b);
-	    putch('C');
-	    putch(c);
+	    putch(vt, 0x1b);
+	    putch(vt, 'C');
+	    putch(vt, c);
         }
 	break;
 /* set/clear line/point */
     case 6:
     case 7:
     case 8:
-        state ++;
+        vt->state ++;
 	break;
     case 9:
-	state = 0;
+	vt->state = 0;
     } 
 }
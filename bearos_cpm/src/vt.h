@@ -1,14 +1,78 @@
 
+/* The console of one emulated machine: the keyboard it reads and the
+   screen it writes, as file descriptors, with what is buffered for each
+   (see vt.c).  Several can be in use at once, one for each machine. */
+
+#ifdef BEAROS
+#define KBUFSIZE 256
+#define VTBUFSIZE 512
+#else
+#define KBUFSIZE 4096	/* must be a power of 2 */
+#define VTBUFSIZE 8192
+#endif
+
+typedef struct vtinfo {
+    int in, out;	/* keyboard & screen */
+
+    /* Set when "in" is a script of keystrokes (--bench) rather than the
+       terminal: newlines in it are typed as Return, and the machine is
+       done once a program waits for a key after the end of it  --  by
+       reading one, or by asking for one IDLEPOLLS times (see kstat()) */
+    int script;
+    int eof;		/* the end of the script has been read */
+
+    /* If set, "waiting" is called with "arg" when a program waits for a
+       key: when it reads one and there are none, or it keeps asking if
+       there is one.  "ended" is called with it at the end of the script
+       instead of exit(0), and does not return. */
+    void (*waiting)(void *arg);
+    void (*ended)(void *arg);
+    void *arg;
+
+    /* the keyboard ring buffer: next to take, next to fill */
+    unsigned char kbuf[KBUFSIZE];
+    unsigned khead, ktail;
+
+    /* for kstat(): when it was last asked, and how many times in a row */
+    unsigned long lastpoll, lastout;
+    int idle;
+
+    /* the output not written yet, and when the first of it came (ms) */
+    char buf[VTBUFSIZE];
+    int len;
+    unsigned long since;
+    unsigned long count;	/* how many times output was added */
+
+    int state, x, y;	/* of the vt52() escape sequence decoding */
+} vtinfo;
+
+/* Make a console for the file descriptors, NULL if out of memory;
+   vtdelete() writes out what is left, but does not close them */
+vtinfo *vtnew(int in, int out);
+void vtdelete(vtinfo *vt);
+
 /* Return true if input character available */
-int constat();
+int constat(vtinfo *vt);
+
+/* As constat(), but sleeps while a program does nothing but poll:
+   "insns" counts the instructions run so far */
+int kstat(vtinfo *vt, unsigned long insns);
 
 /* Get input character:
     w = 0: wait until we have a character
     w = 1: return -1 if we don' have one
     */
-int kget(int w);
+int kget(vtinfo *vt, int w);
 
 /* Write character to terminal */
-void vt52(int c);
+void vt52(vtinfo *vt, int c);
+
+/* Write n characters of a CP/M string to terminal, without bit 7 */
+void vtputs(vtinfo *vt, const char *s, size_t n);
+
+/* Write out the buffered terminal output: vtdue() only does so once
+   it has been held back for long enough */
+void vtflush(vtinfo *vt);
+void vtdue(vtinfo *vt);
 
 #define INTR_CHAR	31	/* control-underscore */
@@ -9,10 +9,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "defs.h"
+#include "vt.h"
 
 int nobdos;
 int strace;
-int bdos_return = -1;
 
 /* All the following macros assume access to a parameter named "z80" */
 
@@ -27,6 +27,52 @@ int bdos_return = -1;
 #define REGIXY		z80->regixy
 #define REGIR		z80->regir
 
+#ifdef BLOCK_CACHE
+/* a write over the opcodes of the block being run also has to stop it */
+#	undef CODEWRITE
+#	define CODEWRITE(addr)	\
+		(CODEBYTE(addr) ? (z80_invalidate(z80, addr, 1, TRUE), UNRUN(), \
+		(void)0) : (void)0)
+#endif
+
+
+/* Unless NO_COMPUTED_GOTO is defined, GCC's "labels as values" are used
+   to jump straight from one opcode to the next through a table of label
+   addresses per prefix group, instead of going back through the big
+   "switch" statements  --  each opcode then has its own indirect jump,
+   which the host CPU predicts much better than the single one at the top
+   of the "switch".  Straight-line instructions chain to the next one
+   with NEXT, as do branches that are not taken  --  only taken branches,
+   I/O, HALT/DI/EI and undefined opcodes "break" back to "infloop" to
+   count down and look for events.  They are not ISO C, so a strict
+   -ansi build uses the "switch" statements. */
+
+#if defined __GNUC__ && !defined __STRICT_ANSI__ && !defined NO_COMPUTED_GOTO
+#	define THREADED_DISPATCH
+#endif
+
+#ifdef THREADED_DISPATCH
+#	define OP(grp, n)	case n: grp##_##n
+#	define OPDEFAULT(grp)	default: grp##_default
+#	define DISPATCH(tbl)	goto *tbl[t]
+#	ifdef BLOCK_CACHE
+	/* each handler goes straight on to the next micro-op of the block,
+	   if there is one, so that it has its own indirect jump to it */
+#	define RUNUOP		\
+		{ PC = uop->next; t = uop->op; rr = uop->reg; \
+		cyc += uop->cyc; goto *uop->label; }
+#	define NEXT		\
+		do { if (uop != uend) { uop++; RUNUOP } goto next; } while (0)
+#	else
+#	define NEXT		goto next
+#	endif
+#else
+#	define OP(grp, n)	case n
+#	define OPDEFAULT(grp)	default
+#	define DISPATCH(tbl)
+#	define NEXT		break
+#endif
+
 
 /* bit masks for jump/call/return group instructions */
 static const byte flagmask[] =
@@ -41,18 +87,148 @@ static const byte bitmask[] =
 	BIT4, BIT5, BIT6, BIT7
 };
 
-/* parity setting array - initialized in init_z80info() below */
-static int parityarr[0x100];
-static boolean parity_inited = FALSE;
+/* flag lookup tables - initialized in init_z80info() below */
+static byte sztab[0x100];	/* SIGN and ZERO for a result byte */
+static byte szptab[0x100];	/* SIGN, ZERO and PARITY for a result byte */
+static byte inctab[0x100];	/* SIGN, ZERO, HALF, OVERFLOW after an "inc" */
+static byte dectab[0x100];	/* the same, plus NEGATIVE, after a "dec" */
+static boolean flagtabs_inited = FALSE;
+
+/* T-states for each opcode, indexed like "ophist" in the z80info  --  for
+   conditional and repeating opcodes this is the time when the branch is
+   not taken or the opcode does not repeat, and their handlers add the
+   rest with TSTATES()  --  also initialized in init_z80info() */
+static byte cyctab[OPS_GROUPS << 8];
+
+/* T-states of the unprefixed opcodes - the prefixes have none of their
+   own, as the time for the whole opcode is kept with its group */
+static const byte cycmain[0x100] =
+{
+	4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,
+	8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,
+	7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,
+	7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11,
+	5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  0,  7, 11,
+	5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,
+	5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  0,  7, 11
+};
+
+/* T-states of the ED-prefixed opcodes from 0x40 to 0x7F, by the low 3
+   bits (the ones ending in 7 are sorted out in opcycles()) */
+static const byte cycedx[8] =
+{
+	12, 12, 15, 20, 8, 14, 8, 9
+};
+
+/* half-carry and overflow for 8-bit add/subtract, indexed by bit 3 (or
+   bit 7) of the accumulator, the operand and the result packed into
+   bits 0, 1 and 2  --  see the "lookup" computation in arith8() */
+static const byte halfadd[8] =
+{
+	0, HALF, HALF, HALF, 0, 0, 0, HALF
+};
+static const byte halfsub[8] =
+{
+	0, 0, HALF, 0, HALF, 0, HALF, HALF
+};
+static const byte overadd[8] =
+{
+	0, 0, 0, OVERFLOW, OVERFLOW, 0, 0, 0
+};
+static const byte oversub[8] =
+{
+	0, OVERFLOW, 0, 0, 0, 0, OVERFLOW, 0
+};
+
+/* the undocumented bits 3 & 5 of F are never changed by this emulator */
+#define FLAGKEEP (BIT5 | BIT3)
+
+
+/* count opcode "t" of OPS_* group "grp" as it is dispatched, and add
+   T-states for the slow path of conditional & repeating ones  --  these
+   go into locals which are added to the z80info at "infloop"  --  each
+   instruction goes into the trace ring & the profile too, while they
+   are kept */
+#define COUNTOP(grp)	\
+	{ \
+		cyc += cyctab[((grp) << 8) | t]; \
+		ins += (grp) == OPS_MAIN; \
+		if (hist != NULL) \
+			hist[((grp) << 8) | t]++; \
+		if ((grp) == OPS_MAIN && z80->tracering != NULL) \
+		{ \
+			syncflags(); \
+			traceop(z80, t); \
+		} \
+		if ((grp) == OPS_MAIN && z80->prof != NULL) \
+			profop(z80, t); \
+	}
+/* the block cache's operands are read before it is run, so the core
+   that checks for watchpoints does without it too (see z80core.inc) */
+#define ONEBYONE()	(BRKCORE || hist != NULL || \
+			 z80->tracering != NULL || z80->prof != NULL)
+#define TSTATES(n)	(cyc += (n))
+
+/* a block's micro-ops are counted as instructions all at once when it
+   is started, so take off the ones that were not run when it is left
+   early - this also stops the block */
+#ifdef BLOCK_CACHE
+#	define UNRUN()	(ins -= uend - uop, uend = uop)
+#else
+#	define UNRUN()	((void)0)
+#endif
+
+
+
+/* With LAZY_FLAGS the 8-bit add/subtract/compare, logical and inc/dec
+   instructions do not build F themselves  --  they just note the kind of
+   operation in "lz" along with its operands and result, and F is worked
+   out from those by syncflags() when something actually looks at it.
+   Everything that reads or changes F must call syncflags() first (the
+   macros below do so), as must the emulator before leaving z80_emulator()
+   or calling out of it, so that the rest of the world always sees a
+   proper F.  Most results are overwritten before they are ever tested,
+   but with the flags coming from lookup tables anyway the bookkeeping
+   costs more than it saves on the hosts tried so far, so this is not on
+   by default. */
+
+#ifdef LAZY_FLAGS
+#	define LAZY_NONE	0	/* F is up to date */
+#	define LAZY_ADD	1	/* add/adc: "la" + "lv" gave "lr" */
+#	define LAZY_SUB	2	/* sub/sbc/cp/neg: "la" - "lv" gave "lr" */
+#	define LAZY_AND	3	/* and: the result is in "lr" */
+#	define LAZY_LOGIC	4	/* or/xor: the result is in "lr" */
+#	define LAZY_INC	5	/* inc: the result is in "lr" */
+#	define LAZY_DEC	6	/* dec: the result is in "lr" */
+
+#	define syncflags() \
+		(lz ? (void)(F = lazyflags(F, lz, la, lv, lr), lz = LAZY_NONE) \
+		: (void)0)
+#	define dropflags() (lz = LAZY_NONE)	/* F has just been loaded */
+#else
+#	define syncflags() ((void)0)
+#	define dropflags() ((void)0)
+#endif
 
 
 
 /* handy defines for playing with the F(lag) register */
 
-#define flagon(flag) (F |= (flag))
-#define flagoff(flag) (F &= ~(flag))
-#define setflag(flag,val) ((val) ? flagon(flag) : flagoff(flag))
-#define resetflag(flag,val) ((val) ? flagoff(flag) : flagon(flag))
+#define flagon(flag) (syncflags(), F |= (flag))
+#define flagoff(flag) (syncflags(), F &= ~(flag))
+#define setflag(flag,val) \
+	(syncflags(), (val) ? (F |= (flag)) : (F &= ~(flag)))
+#define resetflag(flag,val) \
+	(syncflags(), (val) ? (F &= ~(flag)) : (F |= (flag)))
 
 #define setsign() setflag(SIGN, A & BIT7)
 #define setzero() setflag(ZERO, !A)
@@ -74,7 +250,8 @@ static boolean parity_inited = FALSE;
 
 /* set the parity flag based on the value specified */
 
-#define setparity(val)	setflag(PARITY, parityarr[val & 0xFF])
+#define setparity(val)	\
+	(syncflags(), F = (F & ~PARITY) | (szptab[(val) & 0xFF] & PARITY))
 
 
 
@@ -83,51 +260,35 @@ static boolean parity_inited = FALSE;
 #define flags(val) \
 {\
 	v = val;\
-	setflag(SIGN, v & BIT7);\
-	setflag(ZERO, !v);\
-	flagoff(HALF);\
-	flagoff(NEGATIVE);\
-	setparity(v);\
+	syncflags();\
+	F = (F & (FLAGKEEP | CARRY)) | szptab[v];\
 }
 
 
 
+#ifdef LAZY_FLAGS
+
 /* for generic 8-bit arithmetic instructions */
 
 #define arith8(val, carry, sub) \
 {\
 	vv = val;\
+	tt = ((carry) && (syncflags(), F & CARRY)) ? 1 : 0;\
 	s = sub;\
+	la = A;\
+	lv = vv;\
 	if (s)\
 	{\
-		flagon(NEGATIVE);\
-		tt = A - vv;\
-		hh = (A & MASK4) - (vv & MASK4);\
-		if ((carry) && (F & CARRY)) {\
-			tt -= 1;\
-			hh -= 1;\
-		}\
-		setflag(HALF, hh & BIT4);\
-		setflag(OVERFLOW, ((A & BIT7) != (vv & BIT7)) &&\
-			((A & BIT7) != (tt & BIT7)));\
+		tt = A - vv - tt;\
+		lz = LAZY_SUB;\
 	}\
 	else\
 	{\
-		flagoff(NEGATIVE);\
-		tt = A + vv;\
-		hh = (A & MASK4) + (vv & MASK4);\
-		if ((carry) && (F & CARRY)) {\
-			tt += 1;\
-			hh += 1;\
-		}\
-		setflag(HALF, hh & BIT4);\
-		setflag(OVERFLOW, ((A & BIT7) == (vv & BIT7)) &&\
-			((A & BIT7) != (tt & BIT7)));\
+		tt = A + vv + tt;\
+		lz = LAZY_ADD;\
 	}\
-	setflag(SIGN, tt & BIT7);\
-	setflag(CARRY, tt & BIT8);\
+	lr = tt;\
 	v = tt;\
-	setflag(ZERO, !v);\
 }
 
 
@@ -136,1830 +297,609 @@ static boolean parity_inited = FALSE;
 
 #define logical(hval) \
 {\
-	h = hval;\
-	setflag(SIGN, A & BIT7);\
-	setflag(ZERO, !A);\
-	setflag(HALF, h);\
-	setparity(A);\
-	flagoff(NEGATIVE);\
-	flagoff(CARRY);\
+	lz = (hval) ? LAZY_AND : LAZY_LOGIC;\
+	lr = A;\
 }
 
 
 
-/* for incrementing/decrementing of a register */
+/* for incrementing/decrementing of a register  --  these keep the carry,
+   so that much of any pending operation has to be put into F now */
 
 #define increment(reg, neg) \
 {\
 	i = reg;\
-	n = neg;\
-	tt = i;\
-	if (n)\
+	if (lz != LAZY_NONE && lz < LAZY_INC)\
+		F = (F & ~CARRY) | (lz <= LAZY_SUB ? (lr >> 8) & CARRY : 0);\
+	if (neg)\
 	{\
-		setflag(HALF, !(tt-- & MASK4));\
-		setflag(OVERFLOW, (i & BIT7) && !(tt & BIT7));\
+		tt = (i - 1) & MASK8;\
+		lz = LAZY_DEC;\
 	}\
 	else\
 	{\
-		setflag(HALF, !(++tt & MASK4));\
-		setflag(OVERFLOW, !(i & BIT7) && (tt & BIT7));\
+		tt = (i + 1) & MASK8;\
+		lz = LAZY_INC;\
 	}\
-	setflag(SIGN, tt & BIT7);\
-	setflag(ZERO, !(tt & MASK8));\
-	setflag(NEGATIVE, n);\
+	lr = tt;\
 }
 
+#else /* LAZY_FLAGS */
 
+/* for generic 8-bit arithmetic instructions */
 
-
-/*-----------------------------------------------------------------------*\
- |  z80  --  emulate a z80  --  labels & gotos are used here (if you
- |  don't like 'em, tough!)
-\*-----------------------------------------------------------------------*/
-
-boolean
-z80_emulator(z80info *z80, int count)
-{
-	byte t = 0, t1, t2, cy, v, *r = NULL;
-	word tt, tt2, hh, vv, *rr;
-	longword ttt;
-	int i, j, h, n, s;
-
-	/* main loop  --  all "goto"s eventually end up here */
-infloop:
-
-	/* only execute "count" instructions at one whack */
-	if (count-- <= 0)
-		return TRUE;
-
-	/* see if the z80 is to be interrupted for any reason */
-	if (EVENT)
-	{
-		EVENT = FALSE;
-
-		/* HALT execution if desired - this is for tracing & such */
-		if (HALT)
-			haltcpu(z80);
-
-		/* "i" is used to see if we need to get the next opcode or not*/
-		i = TRUE;
-
-		/* get the interrupt type  --  use a sequence of "if" statements
-		   instead of a "switch" since the order is important  --  each
-		   interrupt resets itself only so that another one will run */
-
-		if (RESET)		/* RESET "line" has been "pulled" */
-		{
-			IFF = 0;
-			IFF2 = 0;
-			I = 0;
-			R = 0;
-			PC = 0;
-			IMODE = 0;
-			RESET = FALSE;
-			if (NMI || INTR)	/* catch these the next time */
-				EVENT = TRUE;
-		}
-		else if (NMI)			/* non-maskable interrupt */
-		{
-			--SP;
-			SETMEM(SP, PC >> 8);
-			--SP;
-			SETMEM(SP, PC & MASK8);
-			PC = 0x66;
-			IFF = 0;
-			NMI = FALSE;
-			if (INTR)		/* catch this the next time */
-				EVENT = TRUE;
-		}
-		else if (INTR && IFF)	/* normal masked interrupt */
-		{
-			/* we have three interrupt modes in the z80 */
-			switch (IMODE)
-			{
-				case 0:			/* 8080-mode -- this is NOT correct */
-					/* get the next instruction from the interrupting
-					   device - this may be more than one byte but we
-					   cannot handle that yet */
-					i = FALSE;
-					t = INTR;
-					break;
-				case 1:			/* like a "rst" to 0x38 */
-				default:
-					--SP;
-					SETMEM(SP, PC >> 8);
-					--SP;
-					SETMEM(SP, PC & MASK8);
-					PC = 0x38;
-					break;
-				case 2:	/* most powerful/flexible mode */
-					--SP;
-					SETMEM(SP, PC >> 8);
-					--SP;
-					SETMEM(SP, PC & MASK8);
-					tt = (I << 8) | (INTR & 0xFF);
-					PC = MEM(tt);
-					tt++;
-					PC |= MEM(tt) << 8;
-					break;
-			}
-			IFF = IFF2 = 0;
-			INTR = 0;
-		}
-		else if (INTR)			/* try again the next time around */
-			EVENT = TRUE;
-
-		/* get the next opcode to execute if we do not have it yet */
-		if (i)
-		{
-			t = MEM(PC);
-			PC++;
-		}
-	}
-	else
-	{
-		/* just get the next opcode */
-		t = MEM(PC);
-		PC++;
-	}
+#define arith8(val, carry, sub) \
+{\
+	vv = val;\
+	s = sub;\
+	if (s)\
+	{\
+		tt = A - vv;\
+		if ((carry) && (F & CARRY))\
+			tt -= 1;\
+		h = ((A & 0x88) >> 3) | ((vv & 0x88) >> 2) | ((tt & 0x88) >> 1);\
+		F = (F & FLAGKEEP) | NEGATIVE | halfsub[h & MASK3] |\
+			oversub[h >> 4] | sztab[tt & MASK8] | ((tt >> 8) & CARRY);\
+	}\
+	else\
+	{\
+		tt = A + vv;\
+		if ((carry) && (F & CARRY))\
+			tt += 1;\
+		h = ((A & 0x88) >> 3) | ((vv & 0x88) >> 2) | ((tt & 0x88) >> 1);\
+		F = (F & FLAGKEEP) | halfadd[h & MASK3] |\
+			overadd[h >> 4] | sztab[tt & MASK8] | ((tt >> 8) & CARRY);\
+	}\
+	v = tt;\
+}
 
 
-	/* main "switch" for initial opcode */
-	switch (t)
-	{
-	/* go to other switch statements for the multi-byte opcodes */
-	case 0xDD:
-	case 0xFD:			/* index-register instructions */
-		goto ireginstr;
-		break;
-	case 0xED:			/* extended instructions */
-		goto extinstr;
-		break;
-	case 0xCB:			/* bit-twiddling instructions */
-		goto bitinstr;
-		break;
 
+/* set flags for most logical (AND, OR, ...) instructions */
 
-	/* 8-bit load group */
-
-	case 0x40:					/* ld b,b */
-	case 0x41:					/* ld b,c */
-	case 0x42:					/* ld b,d */
-	case 0x43:					/* ld b,e */
-	case 0x44:					/* ld b,h */
-	case 0x45:					/* ld b,l */
-	case 0x47:					/* ld b,a */
-	case 0x48:					/* ld c,b */
-	case 0x49:					/* ld c,c */
-	case 0x4A:					/* ld c,d */
-	case 0x4B:					/* ld c,e */
-	case 0x4C:					/* ld c,h */
-	case 0x4D:					/* ld c,l */
-	case 0x4F:					/* ld c,a */
-	case 0x50:					/* ld d,b */
-	case 0x51:					/* ld d,c */
-	case 0x52:					/* ld d,d */
-	case 0x53:					/* ld d,e */
-	case 0x54:					/* ld d,h */
-	case 0x55:					/* ld d,l */
-	case 0x57:					/* ld d,a */
-	case 0x58:					/* ld e,b */
-	case 0x59:					/* ld e,c */
-	case 0x5A:					/* ld e,d */
-	case 0x5B:					/* ld e,e */
-	case 0x5C:					/* ld e,h */
-	case 0x5D:					/* ld e,l */
-	case 0x5F:					/* ld e,a */
-	case 0x60:					/* ld h,b */
-	case 0x61:					/* ld h,c */
-	case 0x62:					/* ld h,d */
-	case 0x63:					/* ld h,e */
-	case 0x64:					/* ld h,h */
-	case 0x65:					/* ld h,l */
-	case 0x67:					/* ld h,a */
-	case 0x68:					/* ld l,b */
-	case 0x69:					/* ld l,c */
-	case 0x6A:					/* ld l,d */
-	case 0x6B:					/* ld l,e */
-	case 0x6C:					/* ld l,h */
-	case 0x6D:					/* ld l,l */
-	case 0x6F:					/* ld l,a */
-	case 0x78:					/* ld a,b */
-	case 0x79:					/* ld a,c */
-	case 0x7A:					/* ld a,d */
-	case 0x7B:					/* ld a,e */
-	case 0x7C:					/* ld a,h */
-	case 0x7D:					/* ld a,l */
-	case 0x7F:					/* ld a,a */
-		*REG[(t >> 3) & MASK3] = *REG[t & MASK3];
-		break;
+#define logical(hval) \
+{\
+	F = (F & FLAGKEEP) | szptab[A] | ((hval) ? HALF : 0);\
+}
 
-	case 0x46:					/* ld b,(hl) */
-	case 0x4E:					/* ld c,(hl) */
-	case 0x56:					/* ld d,(hl) */
-	case 0x5E:					/* ld e,(hl) */
-	case 0x66:					/* ld h,(hl) */
-	case 0x6E:					/* ld l,(hl) */
-	case 0x7E:					/* ld a,(hl) */
-		*REG[(t >> 3) & MASK3] = MEM(HL);
-		break;
 
-	case 0x70:					/* ld (hl),b */
-	case 0x71:					/* ld (hl),c */
-	case 0x72:					/* ld (hl),d */
-	case 0x73:					/* ld (hl),e */
-	case 0x74:					/* ld (hl),h */
-	case 0x75:					/* ld (hl),l */
-	case 0x77:					/* ld (hl),a */
-		SETMEM(HL, *REG[t & MASK3]);
-		break;
 
-	case 0x06:					/* ld b,n */
-	case 0x0E:					/* ld c,n */
-	case 0x16:					/* ld d,n */
-	case 0x1E:					/* ld e,n */
-	case 0x26:					/* ld h,n */
-	case 0x2E:					/* ld l,n */
-	case 0x3E:					/* ld a,n */
-		*REG[(t >> 3) & MASK3] = MEM(PC);
-		PC++;
-		break;
-	case 0x36:					/* ld (hl),nn */
-		t1 = MEM(PC);
-		PC++;
-		SETMEM(HL, t1);
-		break;
+/* for incrementing/decrementing of a register */
 
-	case 0x0A:					/* ld a,(bc) */
-	case 0x1A:					/* ld a,(de) */
-		A = MEM(*REGPAIRAF[t >> 4]);
-		break;
+#define increment(reg, neg) \
+{\
+	i = reg;\
+	if (neg)\
+	{\
+		tt = (i - 1) & MASK8;\
+		F = (F & (FLAGKEEP | CARRY)) | dectab[tt];\
+	}\
+	else\
+	{\
+		tt = (i + 1) & MASK8;\
+		F = (F & (FLAGKEEP | CARRY)) | inctab[tt];\
+	}\
+}
 
-	case 0x02:					/* ld (bc),a */
-	case 0x12:					/* ld (de),a */
-		SETMEM(*REGPAIRAF[t >> 4], A);
-		break;
+#endif /* LAZY_FLAGS */
 
-	case 0x3A:					/* ld a,(nn) */
-		t = MEM(PC);
-		PC++;
-		t1 = MEM(PC);
-		A = MEM((t1 << 8) | t);
-		PC++;
-		break;
-	case 0x32:					/* ld (nn),a */
-		t = MEM(PC);
-		PC++;
-		t1 = MEM(PC);
-		PC++;
-		SETMEM((t1 << 8) | t, A);
-		break;
 
 
-	/* 16-bit load group */
+#ifdef LAZY_FLAGS
 
-	case 0x01:					/* ld bc,nn */
-	case 0x11:					/* ld de,nn */
-	case 0x21:					/* ld hl,nn */
-	case 0x31:					/* ld sp,nn */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		*REGPAIRSP[(t >> 4) & MASK2] = tt;
-		break;
+/* work out F for the operation noted down by one of the macros above,
+   given what F was before it */
 
-	case 0x2A:					/* ld hl,(nn) */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		L = MEM(tt);
-		tt++;
-		H = MEM(tt);
-		break;
+static byte
+lazyflags(byte f, int kind, byte a, byte v, word r)
+{
+	int h = ((a & 0x88) >> 3) | ((v & 0x88) >> 2) | ((r & 0x88) >> 1);
 
-	case 0x22:					/* ld (nn),hl */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		SETMEM(tt, L);
-		tt++;
-		SETMEM(tt, H);
-		break;
+	switch (kind)
+	{
+	case LAZY_ADD:
+		return (f & FLAGKEEP) | halfadd[h & MASK3] | overadd[h >> 4] |
+			sztab[r & MASK8] | ((r >> 8) & CARRY);
+	case LAZY_SUB:
+		return (f & FLAGKEEP) | NEGATIVE | halfsub[h & MASK3] |
+			oversub[h >> 4] | sztab[r & MASK8] | ((r >> 8) & CARRY);
+	case LAZY_AND:
+		return (f & FLAGKEEP) | szptab[r & MASK8] | HALF;
+	case LAZY_LOGIC:
+		return (f & FLAGKEEP) | szptab[r & MASK8];
+	case LAZY_INC:
+		return (f & (FLAGKEEP | CARRY)) | inctab[r & MASK8];
+	case LAZY_DEC:
+		return (f & (FLAGKEEP | CARRY)) | dectab[r & MASK8];
+	}
 
-	case 0xF9:					/* ld sp,hl */
-		SP = HL;
-		break;
+	return f;
+}
 
-	case 0xC5:					/* push bc */
-	case 0xD5:					/* push de */
-	case 0xE5:					/* push hl */
-	case 0xF5:					/* push af */
-		tt = *REGPAIRAF[(t >> 4) & MASK2];
-		--SP;
-		SETMEM(SP, tt >> 8);
-		--SP;
-		SETMEM(SP, tt & MASK8);
-		break;
+#endif /* LAZY_FLAGS */
 
-	case 0xC1:					/* pop bc */
-	case 0xD1:					/* pop de */
-	case 0xE1:					/* pop hl */
-	case 0xF1:					/* pop af */
-		rr = REGPAIRAF[(t >> 4) & MASK2];
-		*rr = MEM(SP);
-		SP++;
-		*rr |= MEM(SP) << 8;
-		SP++;
-		break;
 
 
-	/* exchange group and block transfer & search group */
+#ifdef BLOCK_CACHE
+/* The block cache keeps straight-line runs of instructions ("basic
+   blocks") already decoded, so that the prefix bytes and the dispatch
+   tables are only looked at once per block instead of once per pass.
+   Each micro-op holds the label of its handler, its opcode and the PC
+   the handler expects, so it is mostly run by jumping straight into the
+   "switch" code below  --  jumps and calls get handlers of their own
+   with the target address already worked out.  A block runs on
+   through branches that are not taken; everything that changes the
+   flow goes back through "infloop", so the opcodes that do that (and
+   the repeating LDIR & friends) end a block.  Blocks are keyed by their
+   starting PC in a direct-mapped table, and a write over a byte that was
+   decoded drops every block in its 256-byte page.  A page whose code
+   keeps on being written by the program itself is not cached at all. */
 
-	case 0x08:					/* ex af,af2 */
-		swapw(AF, AF2);
-		break;
-	case 0xEB:					/* ex de,hl */
-		swapw(DE, HL);
-		break;
-	case 0xD9:					/* exx */
-		swapw(BC, BC2);
-		swapw(DE, DE2);
-		swapw(HL, HL2);
-		break;
-	case 0xE3:					/* ex (sp),hl */
-		t1 = L;
-		L = MEM(SP);
-		SETMEM(SP, t1);
-		t1 = H;
-		H = MEM((SP + 1) & MASK16);
-		SETMEM((SP + 1) & MASK16, t1);
-		break;
+#define BLOCK_SLOTS	2048	/* must be a power of 2 */
+#define BLOCK_OPS	32	/* max micro-ops per block */
 
+#define BLOCK_HASH(pc)	(((pc) ^ ((pc) >> 12)) & (BLOCK_SLOTS - 1))
+#define BLOCK_EMPTY	0x10000L	/* "pc" of an unused slot */
+#define BLOCK_SMC	16	/* writes over code before a page is left out */
 
-	/* 8-bit arithmetic & logical group */
-
-	case 0x80:					/* add a,b */
-	case 0x81:					/* add a,c */
-	case 0x82:					/* add a,d */
-	case 0x83:					/* add a,e */
-	case 0x84:					/* add a,h */
-	case 0x85:					/* add a,l */
-	case 0x87:					/* add a,a */
-	case 0x88:					/* adc a,b */
-	case 0x89:					/* adc a,c */
-	case 0x8A:					/* adc a,d */
-	case 0x8B:					/* adc a,e */
-	case 0x8C:					/* adc a,h */
-	case 0x8D:					/* adc a,l */
-	case 0x8F:					/* adc a,a */
-	case 0x90:					/* sub b */
-	case 0x91:					/* sub c */
-	case 0x92:					/* sub d */
-	case 0x93:					/* sub e */
-	case 0x94:					/* sub h */
-	case 0x95:					/* sub l */
-	case 0x97:					/* sub a */
-	case 0x98:					/* sbc a,b */
-	case 0x99:					/* sbc a,c */
-	case 0x9A:					/* sbc a,d */
-	case 0x9B:					/* sbc a,e */
-	case 0x9C:					/* sbc a,h */
-	case 0x9D:					/* sbc a,l */
-	case 0x9F:					/* sbc a,a */
-		arith8(*REG[t & MASK3], t & BIT3, t & BIT4);
-		A = v;
-		break;
-	case 0x86:					/* add a,(hl) */
-	case 0x8E:					/* adc a,(hl) */
-	case 0x96:					/* sub (hl) */
-	case 0x9E:					/* sbc a,(hl) */
-		arith8(MEM(HL), t & BIT3, t & BIT4);
-		A = v;
-		break;
-	case 0xC6:					/* add a,n */
-	case 0xCE:					/* adc a,n */
-	case 0xD6:					/* sub n */
-	case 0xDE:					/* sbc a,n */
-		arith8(MEM(PC), t & BIT3, t & BIT4);
-		PC++;
-		A = v;
-		break;
+#define SMCPAGE(addr)	(z80->smcwrites[(word)(addr) >> 8] >= BLOCK_SMC)
 
-	case 0xA0:					/* and b */
-	case 0xA1:					/* and c */
-	case 0xA2:					/* and d */
-	case 0xA3:					/* and e */
-	case 0xA4:					/* and h */
-	case 0xA5:					/* and l */
-	case 0xA7:					/* and a */
-		A &= *REG[t & MASK3];
-		logical(1);
-		break;
-	case 0xA6:					/* and (hl) */
-		A &= MEM(HL);
-		logical(1);
-		break;
-	case 0xE6:					/* and n */
-		A &= MEM(PC);
-		PC++;
-		logical(1);
-		break;
+struct z80uop
+{
+	const void *label;	/* handler for the opcode */
+	void *reg;		/* IX/IY for DD/FD opcodes, or the register */
+	word next;		/* PC on entry to the handler */
+	word imm;		/* operand for the resolve()d micro-ops */
+	byte op;		/* opcode as seen by the handler ("t") */
+	byte cyc;		/* T-states from "cyctab" */
+};
 
-	case 0xA8:					/* xor b */
-	case 0xA9:					/* xor c */
-	case 0xAA:					/* xor d */
-	case 0xAB:					/* xor e */
-	case 0xAC:					/* xor h */
-	case 0xAD:					/* xor l */
-	case 0xAF:					/* xor a */
-		A ^= *REG[t & MASK3];
-		logical(0);
-		break;
-	case 0xAE:					/* xor (hl) */
-		A ^= MEM(HL);
-		logical(0);
-		break;
-	case 0xEE:					/* xor n */
-		A ^= MEM(PC);
-		PC++;
-		logical(0);
-		break;
+struct z80block
+{
+	unsigned long pc;	/* start address, or BLOCK_EMPTY */
+	word last;		/* address of the last byte decoded */
+	int n;
+	struct z80uop uop[BLOCK_OPS];
+};
 
-	case 0xB0:					/* or b */
-	case 0xB1:					/* or c */
-	case 0xB2:					/* or d */
-	case 0xB3:					/* or e */
-	case 0xB4:					/* or h */
-	case 0xB5:					/* or l */
-	case 0xB7:					/* or a */
-		A |= *REG[t & MASK3];
-		logical(0);
-		break;
-	case 0xB6:					/* or (hl) */
-		A |= MEM(HL);
-		logical(0);
-		break;
-	case 0xF6:					/* or n */
-		A |= MEM(PC);
-		PC++;
-		logical(0);
-		break;
+/* the label tables for each prefix group as used by decode_block() */
+enum { TBL_MAIN, TBL_CB, TBL_XY, TBL_ED, TBL_XYCB, TBL_UOP };
 
-	case 0xB8:					/* cp b */
-	case 0xB9:					/* cp c */
-	case 0xBA:					/* cp d */
-	case 0xBB:					/* cp e */
-	case 0xBC:					/* cp h */
-	case 0xBD:					/* cp l */
-	case 0xBF:					/* cp a */
-		arith8(*REG[t & MASK3], 0, 1);
-		break;
-	case 0xBE:					/* cp (hl) */
-		arith8(MEM(HL), 0, 1);
-		break;
-	case 0xFE:					/* cp n */
-		arith8(MEM(PC), 0, 1);
-		PC++;
-		break;
+/* the resolve()d micro-ops in "uoptbl" */
+enum { UOP_JP, UOP_JPF, UOP_JPNF, UOP_JRF, UOP_JRNF, UOP_DJNZ, UOP_CALL,
+	UOP_CALLF, UOP_CALLNF };
 
-#ifdef NO_LARGE_SWITCH
-	/* this is for compilers that cannot handle a large switch statement */
-	/* neat, eh? */
 
-	default:
-		goto contsw;
-	}
+/* length of an unprefixed opcode */
+static int
+oplen(byte t)
+{
+	if ((t & 0xC7) == 0x06 || (t & 0xC7) == 0xC6)	/* ld r,n & alu n */
+		return 2;
+	if ((t & 0xC7) == 0x00 && t >= 0x10)		/* djnz & jr */
+		return 2;
+	if (t == 0xD3 || t == 0xDB)			/* out/in (n),a */
+		return 2;
+	if ((t & 0xCF) == 0x01 || (t & 0xE7) == 0x22)	/* 16-bit loads */
+		return 3;
+	if ((t & 0xC7) == 0xC2 || (t & 0xC7) == 0xC4)	/* jp/call cc */
+		return 3;
+	if (t == 0xC3 || t == 0xCD)
+		return 3;
+	return 1;
+}
 
-	goto infloop;
+/* does an unprefixed opcode always go back through "infloop"? */
+static boolean
+opends(byte t)
+{
+	if ((t & 0xC7) == 0xC7)		/* rst */
+		return TRUE;
 
-contsw:
 	switch (t)
 	{
-#endif /* NO_LARGE_SWITCH */
-
-	/* still the 8-bit arithmetic & logical group */
-
-	case 0x04:					/* inc b */
-	case 0x05:					/* dec b */
-	case 0x0C:					/* inc c */
-	case 0x0D:					/* dec c */
-	case 0x14:					/* inc d */
-	case 0x15:					/* dec d */
-	case 0x1C:					/* inc e */
-	case 0x1D:					/* dec e */
-	case 0x24:					/* inc h */
-	case 0x25:					/* dec h */
-	case 0x2C:					/* inc l */
-	case 0x2D:					/* dec l */
-	case 0x3C:					/* inc a */
-	case 0x3D:					/* dec a */
-		r = REG[(t >> 3) & MASK3];
-		increment(*r, t & BIT0);
-		*r = tt;
-		break;
-	case 0x34:					/* inc (hl) */
-	case 0x35:					/* dec (hl) */
-		increment(MEM(HL), t & BIT0);
-		SETMEM(HL, tt);
-		break;
-
-
-	/* general purpose arithmetic & CPU control groups */
-
-	case 0x27:					/* daa */
-		i = 0;
-		t = 0x00;
-		if (F & CARRY || A > 0x99) {
-			t |= 0x60;
-			i = 1;
-		}
-		if (F & HALF || (A & MASK4) > 9)
-			t |= 0x06;
-		arith8(t, 0, F & NEGATIVE);
-		setflag(CARRY, i);
-		A = v;
-		setparity(A);
-		break;
-
-	case 0x2F:					/* cpl */
-		A = ~A;
-		flagon(HALF);
-		flagon(NEGATIVE);
-		break;
-
-	case 0x3F:					/* ccf */
-		setflag(HALF, F & CARRY);
-		setflag(CARRY, !(F & CARRY));
-		flagoff(NEGATIVE);
-		break;
-	case 0x37:					/* scf */
-		flagon(CARRY);
-		flagoff(HALF);
-		flagoff(NEGATIVE);
-		break;
-
-	case 0x00:					/* nop */
-		break;
-	case 0x76:					/* HALT */
-		/*while (!EVENT)
-			sleep(1);*/
-		EVENT = HALT = TRUE;
-		break;
-
-	case 0xF3:					/* di */
-		IFF = IFF2 = 0;
-		break;
-	case 0xFB:					/* ei */
-		IFF = IFF2 = 1;
-		break;
-
-
-	/* 16-bit arithmetic group */
-
-	case 0x09:					/* add hl,bc */
-	case 0x19:					/* add hl,de */
-	case 0x29:					/* add hl,hl */
-	case 0x39:					/* add hl,sp */
-		ttt = HL + *REGPAIRSP[(t >> 4) & MASK2];
-		hh = (HL & MASK12) + (*REGPAIRSP[(t >> 4) & MASK2] & MASK12);
-		flagoff(NEGATIVE);
-		setflag(CARRY, ttt & BIT16);
-		setflag(HALF, hh & BIT12);
-		HL = ttt;
-		break;
-
-	case 0x03:					/* inc bc */
-	case 0x13:					/* inc de */
-	case 0x23:					/* inc hl */
-	case 0x33:					/* inc sp */
-	case 0x0B:					/* dec bc */
-	case 0x1B:					/* dec de */
-	case 0x2B:					/* dec hl */
-	case 0x3B:					/* dec sp */
-		*REGPAIRSP[(t >> 4) & MASK2] += (t & BIT3) ? -1 : 1;
-		break;
+	case 0x18: case 0x76: case 0xC3: case 0xC9: case 0xCD: case 0xD3:
+	case 0xDB: case 0xE9: case 0xF3: case 0xFB:
+		return TRUE;
+	}
 
+	return FALSE;
+}
 
-	/* rotate & shift group */
+/* does an ED-prefixed opcode always go back through "infloop"? */
+static boolean
+edends(byte t)
+{
+	if ((t & 0xC0) == 0x40)		/* in/out (c), retn/reti, im, ... */
+		return (t & MASK3) <= 1 || (t & MASK3) == 5;
 
-	case 0x07:					/* rlca */
-	case 0x17:					/* rla */
-	case 0x0F:					/* rrca */
-	case 0x1F:					/* rra */
-		t1 = F & CARRY;
-		if (t & BIT3)
-		{
-			setflag(CARRY, A & BIT0);
-			A >>= 1;
-			t2 = BIT7;
-		}
-		else
-		{
-			setflag(CARRY, A & BIT7);
-			A <<= 1;
-			t2 = BIT0;
-		}
-		if (t & BIT4)
-		{
-			if (t1)
-				A |= t2;
-		}
-		else
-		{
-			if (F & CARRY)
-				A |= t2;
-		}
-		flagoff(HALF);
-		flagoff(NEGATIVE);
-		break;
+	/* ini/outi & friends, and the repeating ldir & friends */
+	return (t & 0xE6) == 0xA2 || (t & 0xF4) == 0xB0;
+}
 
 
-	/* jump group */
+/* make "u" a micro-op with its target worked out if "t" (at "pc") is a
+   jump or call to a constant address  --  returns FALSE for anything
+   else  --  constants other than branch targets are left to be read as
+   the code runs, since programs such as MBASIC keep variables in them */
+static boolean
+resolve(z80info *z80, struct z80uop *u, word pc, byte t,
+		const void *const uoptbl[])
+{
+	word nn = z80->mem[(word)(pc + 1)] | (z80->mem[(word)(pc + 2)] << 8);
+	word e = pc + 2 + (signed char)z80->mem[(word)(pc + 1)];
 
+	switch (t)
+	{
 	case 0xC3:					/* jp nn */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC = tt;
+		u->label = uoptbl[UOP_JP];
+		u->imm = nn;
 		break;
-	case 0xC2:					/* jp nz,nn */
-	case 0xD2:					/* jp nc,nn */
-	case 0xE2:					/* jp po,nn */
-	case 0xF2:					/* jp p,nn */
-		if (F & flagmask[(t >> 4) & MASK2])
-			PC += 2;
-		else
-		{
-			tt = MEM(PC);
-			PC++;
-			tt |= MEM(PC) << 8;
-			PC = tt;
-		}
+	case 0xC2: case 0xD2: case 0xE2: case 0xF2:	/* jp nz,nn ... */
+		u->label = uoptbl[UOP_JPNF];
+		u->op = flagmask[(t >> 4) & MASK2];
+		u->imm = nn;
 		break;
-	case 0xCA:					/* jp z,nn */
-	case 0xDA:					/* jp c,nn */
-	case 0xEA:					/* jp p,nn */
-	case 0xFA:					/* jp m,nn */
-		if (F & flagmask[(t >> 4) & MASK2])
-		{
-			tt = MEM(PC);
-			PC++;
-			tt |= MEM(PC) << 8;
-			PC = tt;
-		}
-		else
-			PC += 2;
+	case 0xCA: case 0xDA: case 0xEA: case 0xFA:	/* jp z,nn ... */
+		u->label = uoptbl[UOP_JPF];
+		u->op = flagmask[(t >> 4) & MASK2];
+		u->imm = nn;
 		break;
-
 	case 0x18:					/* jr e */
-		PC += ((signed char)MEM(PC)) + 1;
+		u->label = uoptbl[UOP_JP];
+		u->imm = e;
 		break;
-	case 0x20:					/* jr nz,e */
-	case 0x30:					/* jr nc,e */
-		if (!(F & flagmask[(t >> 4) & MASK1]))
-			PC += ((signed char)MEM(PC)) + 1;
-		else
-			PC += 1;
+	case 0x20: case 0x30:				/* jr nz,e & jr nc,e */
+		u->label = uoptbl[UOP_JRNF];
+		u->op = flagmask[(t >> 4) & MASK1];
+		u->imm = e;
 		break;
-	case 0x28:					/* jr z,e */
-	case 0x38:					/* jr c,e */
-		if (F & flagmask[(t >> 4) & MASK1])
-			PC += ((signed char)MEM(PC)) + 1;
-		else
-			PC += 1;
-		break;
-
-	case 0xE9:					/* jp (hl) */
-		PC = HL;
+	case 0x28: case 0x38:				/* jr z,e & jr c,e */
+		u->label = uoptbl[UOP_JRF];
+		u->op = flagmask[(t >> 4) & MASK1];
+		u->imm = e;
 		break;
 	case 0x10:					/* djnz e */
-		if (--B)
-			PC += ((signed char)MEM(PC)) + 1;
-		else
-			PC += 1;
+		u->label = uoptbl[UOP_DJNZ];
+		u->imm = e;
 		break;
-
-
-	/* call & return group */
-
 	case 0xCD:					/* call nn */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		--SP;
-		SETMEM(SP, PC >> 8);
-		--SP;
-		SETMEM(SP, PC & MASK8);
-		PC = tt;
-		break;
-	case 0xC4:					/* call nz,nn */
-	case 0xD4:					/* call nc,nn */
-	case 0xE4:					/* call po,nn */
-	case 0xF4:					/* call p,nn */
-		if (F & flagmask[(t >> 4) & MASK2])
-			PC += 2;
-		else
-		{
-			tt = MEM(PC);
-			PC++;
-			tt |= MEM(PC) << 8;
-			PC++;
-			--SP;
-			SETMEM(SP, PC >> 8);
-			--SP;
-			SETMEM(SP, PC & MASK8);
-			PC = tt;
-		}
-		break;
-	case 0xCC:					/* call z,nn */
-	case 0xDC:					/* call c,nn */
-	case 0xEC:					/* call pe,nn */
-	case 0xFC:					/* call m,nn */
-		if (F & flagmask[(t >> 4) & MASK2])
-		{
-			tt = MEM(PC);
-			PC++;
-			tt |= MEM(PC) << 8;
-			PC++;
-			--SP;
-			SETMEM(SP, PC >> 8);
-			--SP;
-			SETMEM(SP, PC & MASK8);
-			PC = tt;
-		}
-		else
-			PC += 2;
-		break;
-
-	case 0xC9:					/* ret */
-		PC = MEM(SP);
-		SP++;
-		PC |= MEM(SP) << 8;
-		SP++;
+		u->label = uoptbl[UOP_CALL];
+		u->imm = nn;
 		break;
-	case 0xC0:					/* ret nz */
-	case 0xD0:					/* ret nc */
-	case 0xE0:					/* ret po */
-	case 0xF0:					/* ret p */
-		if (!(F & flagmask[(t >> 4) & MASK2]))
-		{
-			PC = MEM(SP);
-			SP++;
-			PC |= MEM(SP) << 8;
-			SP++;
-		}
+	case 0xC4: case 0xD4: case 0xE4: case 0xF4:	/* call nz,nn ... */
+		u->label = uoptbl[UOP_CALLNF];
+		u->op = flagmask[(t >> 4) & MASK2];
+		u->imm = nn;
 		break;
-	case 0xC8:					/* ret z */
-	case 0xD8:					/* ret c */
-	case 0xE8:					/* ret pe */
-	case 0xF8:					/* ret m */
-		if (F & flagmask[(t >> 4) & MASK2])
-		{
-			PC = MEM(SP);
-			SP++;
-			PC |= MEM(SP) << 8;
-			SP++;
-		}
+	case 0xCC: case 0xDC: case 0xEC: case 0xFC:	/* call z,nn ... */
+		u->label = uoptbl[UOP_CALLF];
+		u->op = flagmask[(t >> 4) & MASK2];
+		u->imm = nn;
 		break;
-
-	case 0xC7:					/* rst 0 */
-	case 0xCF:					/* rst 8 */
-	case 0xD7:					/* rst 16 */
-	case 0xDF:					/* rst 24 */
-	case 0xE7:					/* rst 32 */
-	case 0xEF:					/* rst 40 */
-	case 0xF7:					/* rst 48 */
-	case 0xFF:					/* rst 56 */
-		--SP;
-		SETMEM(SP, PC >> 8);
-		--SP;
-		SETMEM(SP, PC & MASK8);
-		PC = t & 0x38;
-		break;
-
-
-	/* input & output group */
-
-	case 0xDB:					/* in a,n */
-		if (!input(z80, A, MEM(PC), &t1))
-			return FALSE;
-
-		A = t1;
-		PC++;
-		break;
-	case 0xD3:					/* out a,n */
-		output(z80, A, MEM(PC), A);
-		PC++;
-		break;
-
-
-	default: 
-		undefinstr(z80, t);
-		break;
-	}					/* end of main "switch" */
-
-	/* Trace system calls */
-	if (strace && PC == BDOS_HOOK)
-	{
-	        printf("\r\nbdos call %d %s (AF=%04x BC=%04x DE=%04x HL =%04x SP=%04x STACK=", C, bdos_decode(C), AF, BC, DE, HL, SP);
-		for (i = 0; i < 8; ++i)
-		    printf(" %4x", z80->mem[SP + 2*i]
-			   + 256 * z80->mem[SP + 2*i + 1]);
-		printf(")\r\n");
-		bdos_return = SP + 2;
-		if (bdos_fcb(C))
-			bdos_fcb_dump(z80);
-	}
-
-	if (SP == bdos_return)
-	{
-	        printf("\r\nbdos return %d %s (AF=%04x BC=%04x DE=%04x HL =%04x SP=%04x STACK=", C, bdos_decode(C), AF, BC, DE, HL, SP);
-		for (i = 0; i < 8; ++i)
-		    printf(" %4x", z80->mem[SP + 2*i]
-			   + 256 * z80->mem[SP + 2*i + 1]);
-		printf(")\r\n");
-		bdos_return = -1;
-		if (bdos_fcb(C))
-			bdos_fcb_dump(z80);
-	}
-
-	if (!nobdos && PC == BDOS_HOOK)
-	{
-		check_BDOS_hook(z80);
+	default:
+		return FALSE;
 	}
 
-	goto infloop;
+	return TRUE;
+}
 
 
+/* note that "addr" was decoded, so that writes to it drop its blocks */
+#define MARKCODE(addr)	\
+	(z80->codemap[(word)(addr) >> 3] |= 1 << ((addr) & MASK3))
 
-	/* bit-twiddling instructions */
-bitinstr:
-	t = MEM(PC);
-	PC++;
+/* decode the block starting at "pc" into "blk" */
+static void
+decode_block(z80info *z80, struct z80block *blk, word pc,
+		const void *const *const tbl[])
+{
+	struct z80uop *u;
+	word start = pc, next;
+	byte t, op;
+	int len, n, grp;
+	boolean end = FALSE, xycb, plain;
 
-	switch (t)
+	for (n = 0; n < BLOCK_OPS && !end; n++)
 	{
-	/* rotate & shift group */
-
-	case 0x00:					/* rlc b */
-	case 0x01:					/* rlc c */
-	case 0x02:					/* rlc d */
-	case 0x03:					/* rlc e */
-	case 0x04:					/* rlc h */
-	case 0x05:					/* rlc l */
-	case 0x07:					/* rlc a */
-	case 0x08:					/* rrc b */
-	case 0x09:					/* rrc c */
-	case 0x0A:					/* rrc d */
-	case 0x0B:					/* rrc e */
-	case 0x0C:					/* rrc h */
-	case 0x0D:					/* rrc l */
-	case 0x0F:					/* rrc a */
-	case 0x10:					/* rl b */
-	case 0x11:					/* rl c */
-	case 0x12:					/* rl d */
-	case 0x13:					/* rl e */
-	case 0x14:					/* rl h */
-	case 0x15:					/* rl l */
-	case 0x17:					/* rl a */
-	case 0x18:					/* rr b */
-	case 0x19:					/* rr c */
-	case 0x1A:					/* rr d */
-	case 0x1B:					/* rr e */
-	case 0x1C:					/* rr h */
-	case 0x1D:					/* rr l */
-	case 0x1F:					/* rr a */
-	case 0x20:					/* sla b */
-	case 0x21:					/* sla c */
-	case 0x22:					/* sla d */
-	case 0x23:					/* sla e */
-	case 0x24:					/* sla h */
-	case 0x25:					/* sla l */
-	case 0x27:					/* sla a */
-	case 0x28:					/* sra b */
-	case 0x29:					/* sra c */
-	case 0x2A:					/* sra d */
-	case 0x2B:					/* sra e */
-	case 0x2C:					/* sra h */
-	case 0x2D:					/* sra l */
-	case 0x2F:					/* sra a */
-	case 0x38:					/* srl b */
-	case 0x39:					/* srl c */
-	case 0x3A:					/* srl d */
-	case 0x3B:					/* srl e */
-	case 0x3C:					/* srl h */
-	case 0x3D:					/* srl l */
-	case 0x3F:					/* srl a */
-		r = REG[t & MASK3];
-		cy = F & CARRY;
-		if (t & BIT3)
+		u = &blk->uop[n];
+		t = z80->mem[pc];
+		op = z80->mem[(word)(pc + 1)];
+		u->reg = NULL;
+		next = pc + 2;
+		xycb = plain = FALSE;
+
+		switch (t)
 		{
-			setflag(CARRY, *r & BIT0);
-			*r >>= 1;
-			t2 = BIT7;
-		}
-		else
-		{
-			setflag(CARRY, *r & BIT7);
-			*r <<= 1;
-			t2 = BIT0;
-		}
-		if (t & BIT5)
-		{
-			if (t2 == BIT7 && !(t & BIT4))
-				if (*r & BIT6)
-					*r |= BIT7;
-		}
-		else
-		{
-			if (t & BIT4)
+		case 0xCB:
+			u->label = tbl[TBL_CB][op];
+			grp = OPS_CB;
+			len = 2;
+			break;
+
+		case 0xED:
+			u->label = tbl[TBL_ED][op];
+			grp = OPS_ED;
+			len = ((op & 0xC7) == 0x43) ? 4 : 2;
+			end = edends(op);
+			break;
+
+		case 0xDD:
+		case 0xFD:
+			u->reg = REGIXY[(t >> 5) & MASK1];
+
+			if (op == 0xCB)
 			{
-				if (cy)
-					*r |= t2;
+				op = z80->mem[(word)(pc + 3)];
+				u->label = tbl[TBL_XYCB][op];
+				grp = OPS_XYCB;
+				len = 4;
+				xycb = TRUE;
+				break;
 			}
-			else
-			{
-				if (F & CARRY)
-					*r |= t2;
-			}
-		}
-		flags(*r);
-		break;
 
-	case 0x06:					/* rlc (hl) */
-	case 0x0E:					/* rrc (hl) */
-	case 0x16:					/* rl (hl) */
-	case 0x1E:					/* rr (hl) */
-	case 0x26:					/* sla (hl) */
-	case 0x2E:					/* sra (hl) */
-	case 0x3E:					/* srl (hl) */
-		cy = F & CARRY;
-		t1 = MEM(HL);
-		if (t & BIT3)
-		{
-			setflag(CARRY, t1 & BIT0);
-			t1 >>= 1;
-			t2 = BIT7;
-		}
-		else
-		{
-			setflag(CARRY, t1 & BIT7);
-			t1 <<= 1;
-			t2 = BIT0;
+			u->label = tbl[TBL_XY][op];
+			grp = OPS_XY;
+			len = 1 + oplen(op);
+
+			/* (ir+d) takes one more byte */
+			if (op == 0x34 || op == 0x35 || op == 0x36 ||
+					((op & 0xC7) == 0x46 && op != 0x76) ||
+					((op & 0xF8) == 0x70 && op != 0x76) ||
+					(op & 0xC7) == 0x86)
+				len++;
+
+			end = (op == 0xE9 || op == 0xDD || op == 0xFD ||
+					op == 0xED);
+			break;
+
+		default:
+			op = t;
+			next = pc + 1;
+			u->label = tbl[TBL_MAIN][op];
+			grp = OPS_MAIN;
+			len = oplen(op);
+			end = opends(op);
+			plain = TRUE;
+			break;
 		}
-		if (t & BIT5)
-		{
-			if (t2 == BIT7 && !(t & BIT4))
-				if (t1 & BIT6)
-					t1 |= BIT7;
-		}
-		else
+
+		/* stay within the page the block starts in and the next one,
+		   and out of pages with self-modifying code */
+		if (n > 0 && (((((word)(pc + len - 1) >> 8) - (start >> 8)) & 0xFE)
+				|| SMCPAGE(pc + len - 1)))
+			break;
+
+		u->next = next;
+		u->op = op;
+		u->cyc = cyctab[(grp << 8) | op];
+
+		/* only the opcode bytes matter unless the operand was resolved,
+		   as the handlers read the operands when they run */
+		MARKCODE(pc);
+		if (next != (word)(pc + 1))
+			MARKCODE(pc + 1);
+		if (xycb)
+			MARKCODE(pc + 3);
+
+		if (plain && resolve(z80, u, pc, t, tbl[TBL_UOP]))
 		{
-			if (t & BIT4)
-			{
-				if (cy)
-					t1 |= t2;
-			}
-			else
-			{
-				if (F & CARRY)
-					t1 |= t2;
-			}
+			u->next = pc + len;
+			for (next = pc + 1; next != u->next; next++)
+				MARKCODE(next);
 		}
-		SETMEM(HL, t1);
-		flags(t1);
-		break;
-
-
-	/* bit set, reset, and test group */
-
-	case 0x40:					/* bit 0,b */
-	case 0x41:					/* bit 0,c */
-	case 0x42:					/* bit 0,d */
-	case 0x43:					/* bit 0,e */
-	case 0x44:					/* bit 0,h */
-	case 0x45:					/* bit 0,l */
-	case 0x47:					/* bit 0,a */
-	case 0x48:					/* bit 1,b */
-	case 0x49:					/* bit 1,c */
-	case 0x4A:					/* bit 1,d */
-	case 0x4B:					/* bit 1,e */
-	case 0x4C:					/* bit 1,h */
-	case 0x4D:					/* bit 1,l */
-	case 0x4F:					/* bit 1,a */
-	case 0x50:					/* bit 2,b */
-	case 0x51:					/* bit 2,c */
-	case 0x52:					/* bit 2,d */
-	case 0x53:					/* bit 2,e */
-	case 0x54:					/* bit 2,h */
-	case 0x55:					/* bit 2,l */
-	case 0x57:					/* bit 2,a */
-	case 0x58:					/* bit 3,b */
-	case 0x59:					/* bit 3,c */
-	case 0x5A:					/* bit 3,d */
-	case 0x5B:					/* bit 3,e */
-	case 0x5C:					/* bit 3,h */
-	case 0x5D:					/* bit 3,l */
-	case 0x5F:					/* bit 3,a */
-	case 0x60:					/* bit 4,b */
-	case 0x61:					/* bit 4,c */
-	case 0x62:					/* bit 4,d */
-	case 0x63:					/* bit 4,e */
-	case 0x64:					/* bit 4,h */
-	case 0x65:					/* bit 4,l */
-	case 0x67:					/* bit 4,a */
-	case 0x68:					/* bit 5,b */
-	case 0x69:					/* bit 5,c */
-	case 0x6A:					/* bit 5,d */
-	case 0x6B:					/* bit 5,e */
-	case 0x6C:					/* bit 5,h */
-	case 0x6D:					/* bit 5,l */
-	case 0x6F:					/* bit 5,a */
-	case 0x70:					/* bit 6,b */
-	case 0x71:					/* bit 6,c */
-	case 0x72:					/* bit 6,d */
-	case 0x73:					/* bit 6,e */
-	case 0x74:					/* bit 6,h */
-	case 0x75:					/* bit 6,l */
-	case 0x77:					/* bit 6,a */
-	case 0x78:					/* bit 7,b */
-	case 0x79:					/* bit 7,c */
-	case 0x7A:					/* bit 7,d */
-	case 0x7B:					/* bit 7,e */
-	case 0x7C:					/* bit 7,h */
-	case 0x7D:					/* bit 7,l */
-	case 0x7F:					/* bit 7,a */
-		r = REG[t & MASK3];
-		resetflag(ZERO, *r & bitmask[(t >> 3) & MASK3]);
-		flagon(HALF);
-		flagoff(NEGATIVE);
-		break;
-	case 0x46:					/* bit 0,(hl) */
-	case 0x4E:					/* bit 1,(hl) */
-	case 0x56:					/* bit 2,(hl) */
-	case 0x5E:					/* bit 3,(hl) */
-	case 0x66:					/* bit 4,(hl) */
-	case 0x6E:					/* bit 5,(hl) */
-	case 0x76:					/* bit 6,(hl) */
-	case 0x7E:					/* bit 7,(hl) */
-		resetflag(ZERO, MEM(HL) & bitmask[(t >> 3) & MASK3]);
-		flagon(HALF);
-		flagoff(NEGATIVE);
-		break;
-
-	case 0x80:					/* res 0,b */
-	case 0x81:					/* res 0,c */
-	case 0x82:					/* res 0,d */
-	case 0x83:					/* res 0,e */
-	case 0x84:					/* res 0,h */
-	case 0x85:					/* res 0,l */
-	case 0x87:					/* res 0,a */
-	case 0x88:					/* res 1,b */
-	case 0x89:					/* res 1,c */
-	case 0x8A:					/* res 1,d */
-	case 0x8B:					/* res 1,e */
-	case 0x8C:					/* res 1,h */
-	case 0x8D:					/* res 1,l */
-	case 0x8F:					/* res 1,a */
-	case 0x90:					/* res 2,b */
-	case 0x91:					/* res 2,c */
-	case 0x92:					/* res 2,d */
-	case 0x93:					/* res 2,e */
-	case 0x94:					/* res 2,h */
-	case 0x95:					/* res 2,l */
-	case 0x97:					/* res 2,a */
-	case 0x98:					/* res 3,b */
-	case 0x99:					/* res 3,c */
-	case 0x9A:					/* res 3,d */
-	case 0x9B:					/* res 3,e */
-	case 0x9C:					/* res 3,h */
-	case 0x9D:					/* res 3,l */
-	case 0x9F:					/* res 3,a */
-	case 0xA0:					/* res 4,b */
-	case 0xA1:					/* res 4,c */
-	case 0xA2:					/* res 4,d */
-	case 0xA3:					/* res 4,e */
-	case 0xA4:					/* res 4,h */
-	case 0xA5:					/* res 4,l */
-	case 0xA7:					/* res 4,a */
-	case 0xA8:					/* res 5,b */
-	case 0xA9:					/* res 5,c */
-	case 0xAA:					/* res 5,d */
-	case 0xAB:					/* res 5,e */
-	case 0xAC:					/* res 5,h */
-	case 0xAD:					/* res 5,l */
-	case 0xAF:					/* res 5,a */
-	case 0xB0:					/* res 6,b */
-	case 0xB1:					/* res 6,c */
-	case 0xB2:					/* res 6,d */
-	case 0xB3:					/* res 6,e */
-	case 0xB4:					/* res 6,h */
-	case 0xB5:					/* res 6,l */
-	case 0xB7:					/* res 6,a */
-	case 0xB8:					/* res 7,b */
-	case 0xB9:					/* res 7,c */
-	case 0xBA:					/* res 7,d */
-	case 0xBB:					/* res 7,e */
-	case 0xBC:					/* res 7,h */
-	case 0xBD:					/* res 7,l */
-	case 0xBF:					/* res 7,a */
-		*REG[t & MASK3] &= ~bitmask[(t >> 3) & MASK3];
-		break;
-	case 0x86:					/* res 0,(hl) */
-	case 0x8E:					/* res 1,(hl) */
-	case 0x96:					/* res 2,(hl) */
-	case 0x9E:					/* res 3,(hl) */
-	case 0xA6:					/* res 4,(hl) */
-	case 0xAE:					/* res 5,(hl) */
-	case 0xB6:					/* res 6,(hl) */
-	case 0xBE:					/* res 7,(hl) */
-		t1 = MEM(HL) & ~bitmask[(t >> 3) & MASK3];
-		SETMEM(HL, t1);
-		break;
-
-
-	case 0xC0:					/* set 0,b */
-	case 0xC1:					/* set 0,c */
-	case 0xC2:					/* set 0,d */
-	case 0xC3:					/* set 0,e */
-	case 0xC4:					/* set 0,h */
-	case 0xC5:					/* set 0,l */
-	case 0xC7:					/* set 0,a */
-	case 0xC8:					/* set 1,b */
-	case 0xC9:					/* set 1,c */
-	case 0xCA:					/* set 1,d */
-	case 0xCB:					/* set 1,e */
-	case 0xCC:					/* set 1,h */
-	case 0xCD:					/* set 1,l */
-	case 0xCF:					/* set 1,a */
-	case 0xD0:					/* set 2,b */
-	case 0xD1:					/* set 2,c */
-	case 0xD2:					/* set 2,d */
-	case 0xD3:					/* set 2,e */
-	case 0xD4:					/* set 2,h */
-	case 0xD5:					/* set 2,l */
-	case 0xD7:					/* set 2,a */
-	case 0xD8:					/* set 3,b */
-	case 0xD9:					/* set 3,c */
-	case 0xDA:					/* set 3,d */
-	case 0xDB:					/* set 3,e */
-	case 0xDC:					/* set 3,h */
-	case 0xDD:					/* set 3,l */
-	case 0xDF:					/* set 3,a */
-	case 0xE0:					/* set 4,b */
-	case 0xE1:					/* set 4,c */
-	case 0xE2:					/* set 4,d */
-	case 0xE3:					/* set 4,e */
-	case 0xE4:					/* set 4,h */
-	case 0xE5:					/* set 4,l */
-	case 0xE7:					/* set 4,a */
-	case 0xE8:					/* set 5,b */
-	case 0xE9:					/* set 5,c */
-	case 0xEA:					/* set 5,d */
-	case 0xEB:					/* set 5,e */
-	case 0xEC:					/* set 5,h */
-	case 0xED:					/* set 5,l */
-	case 0xEF:					/* set 5,a */
-	case 0xF0:					/* set 6,b */
-	case 0xF1:					/* set 6,c */
-	case 0xF2:					/* set 6,d */
-	case 0xF3:					/* set 6,e */
-	case 0xF4:					/* set 6,h */
-	case 0xF5:					/* set 6,l */
-	case 0xF7:					/* set 6,a */
-	case 0xF8:					/* set 7,b */
-	case 0xF9:					/* set 7,c */
-	case 0xFA:					/* set 7,d */
-	case 0xFB:					/* set 7,e */
-	case 0xFC:					/* set 7,h */
-	case 0xFD:					/* set 7,l */
-	case 0xFF:					/* set 7,a */
-		*REG[t & MASK3] |= bitmask[(t >> 3) & MASK3];
-		break;
-
-	case 0xC6:					/* set 0,(hl) */
-	case 0xCE:					/* set 1,(hl) */
-	case 0xD6:					/* set 2,(hl) */
-	case 0xDE:					/* set 3,(hl) */
-	case 0xE6:					/* set 4,(hl) */
-	case 0xEE:					/* set 5,(hl) */
-	case 0xF6:					/* set 6,(hl) */
-	case 0xFE:					/* set 7,(hl) */
-		t1 = MEM(HL) | bitmask[(t >> 3) & MASK3];
-		SETMEM(HL, t1);
-		break;
 
-	default: 
-		undefinstr(z80, t);
-		break;
-	}	/* end of "bitinstr" "switch" */
-
-	goto infloop;
+		blk->last = pc + len - 1;
+		pc += len;
+	}
 
+	blk->pc = start;
+	blk->n = n;
+}
 
 
-	/* index-register instructions */
-ireginstr:
+/* drop the decoded blocks from the pages that "addr" to "addr + len"
+   overwrite decoded code in  --  SETMEM() calls this for the bytes marked
+   in "codemap", and anything else that loads code into "mem" (disk
+   reads, the monitor) must do so too  --  "smc" is only set for a write
+   by the Z80 code itself, which is counted to find self-modifying code */
+void
+z80_invalidate(z80info *z80, word addr, unsigned int len, boolean smc)
+{
+	struct z80block *blk;
+	word p;
 
-	/* pointer to either the IX or the IY register */
-	rr = REGIXY[(t >> 5) & MASK1];
-	t = MEM(PC);
-	PC++;
+	if (len > 0x10000L)
+		len = 0x10000L;
 
-	/* note: in comments below, "ir" is either "ix" or "iy" */
-	switch (t)
+	for (; len > 0; len--, addr++)
 	{
-	case 0xCB:		/* index-register bit-twiddling instructions */
-		goto iregbitinstr;
-		break;
-
-
-	/* 8-bit load group */
-
-	case 0x46:					/* ld b,(ir+d) */
-	case 0x4E:					/* ld c,(ir+d) */
-	case 0x56:					/* ld d,(ir+d) */
-	case 0x5E:					/* ld e,(ir+d) */
-	case 0x66:					/* ld h,(ir+d) */
-	case 0x6E:					/* ld l,(ir+d) */
-	case 0x7E:					/* ld a,(ir+d) */
-		i = (t >> 3) & MASK3;
-		j = (int)((signed char)MEM(PC));
-		PC++;
-		*REG[i] = MEM(((int)*rr + j) & MASK16);
-		break;
-
-	case 0x70:					/* ld (ir+d),b */
-	case 0x71:					/* ld (ir+d),c */
-	case 0x72:					/* ld (ir+d),d */
-	case 0x73:					/* ld (ir+d),e */
-	case 0x74:					/* ld (ir+d),h */
-	case 0x75:					/* ld (ir+d),l */
-	case 0x77:					/* ld (ir+d),a */
-		t1 = MEM(PC);
-		PC++;
-		SETMEM(((int)*rr + ((signed char)t1)) & MASK16, *REG[t &MASK3]);
-		break;
-
-
-	/* 16-bit load group */
-
-	case 0x36:					/* ld (ir+d),n */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		t1 = MEM(PC);
-		PC++;
-		SETMEM(tt, t1);
-		break;
-
-	case 0x21:					/* ld ir,nn */
-		*rr = MEM(PC);
-		PC++;
-		*rr |= MEM(PC) << 8;
-		PC++;
-		break;
-
-	case 0x2A:					/* ld ir,(nn) */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		*rr = MEM(tt);
-		tt++;
-		*rr |= MEM(tt) << 8;
-		break;
-
-	case 0x22:					/* ld (nn),ir */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		SETMEM(tt, *rr & MASK8);
-		tt++;
-		SETMEM(tt, *rr >> 8);
-		break;
-
-	case 0xF9:					/* ld sp,ir */
-		SP = *rr;
-		break;
-
-	case 0xE5:					/* push ir */
-		--SP;
-		SETMEM(SP, *rr >> 8);
-		--SP;
-		SETMEM(SP, *rr & MASK8);
-		break;
-
-	case 0xE1:					/* pop ir */
-		*rr = MEM(SP);
-		SP++;
-		*rr |= MEM(SP) << 8;
-		SP++;
-		break;
-
-
-	/* exchange group */
-
-	case 0xE3:					/* ex sp,ir */
-		tt = MEM(SP);
-		tt |= MEM(SP + 1) << 8;
-		SETMEM(SP, *rr & MASK8);
-		SETMEM(SP + 1, *rr >> 8);
-		*rr = tt;
-		break;
+		if (!CODEBYTE(addr))
+			continue;
 
+		/* all the blocks in the page go, so forget all of its opcodes */
+		p = addr >> 8;
+		memset(&z80->codemap[p << 5], 0, 0x100 / 8);
+		z80->blkinvals++;
 
-	/* 8-bit arithmetic group */
-
-	case 0x86:					/* add a,(ir+d) */
-	case 0x8E:					/* adc a,(ir+d) */
-	case 0x96:					/* sub (ir+d) */
-	case 0x9E:					/* sbc a,(ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		arith8(MEM(tt), t & BIT3, t & BIT4);
-		A = v;
-		break;
-
-	case 0x34:					/* inc (ir+d) */
-	case 0x35:					/* dec (ir+d) */
-		tt2 = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		increment(MEM(tt2), t & BIT0);
-		SETMEM(tt2, tt);
-		break;
-
-	case 0xA6:					/* and (ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		A &= MEM(tt);
-		logical(1);
-		break;
-	case 0xAE:					/* xor (ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		A ^= MEM(tt);
-		logical(0);
-		break;
-	case 0xB6:					/* or (ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		A |= MEM(tt);
-		logical(0);
-		break;
-	case 0xBE:					/* cp (ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		arith8(MEM(tt), 0, 1);
-		break;
+		if (smc && z80->smcwrites[p] < BLOCK_SMC)
+			z80->smcwrites[p]++;
 
+		for (blk = z80->blocks; blk < z80->blocks + BLOCK_SLOTS; blk++)
+			if (blk->pc != BLOCK_EMPTY &&
+					((blk->pc >> 8) == p || (blk->last >> 8) == p))
+				blk->pc = BLOCK_EMPTY;
+	}
+}
+#endif /* BLOCK_CACHE */
 
-	/* 16-bit arithmetic group */
-
-	case 0x09:					/* add ir,bc */
-	case 0x19:					/* add ir,de */
-	case 0x29:					/* add ir,rr */
-	case 0x39:					/* add ir,sp */
-		REGPAIRXY[XYPAIR] = rr;
-		i = *rr;
-		j = *REGPAIRXY[(t >> 4) & MASK2];
-		ttt = i + j;
-		hh = (i & MASK12) + (j & MASK12);
-		flagoff(NEGATIVE);
-		setflag(CARRY, ttt & BIT16);
-		setflag(HALF, hh & BIT12);
-		*rr = ttt;
-		break;
 
-	case 0x23:					/* inc ir */
-	case 0x2B:					/* dec ir */
-		*rr += (t & BIT3) ? -1 : 1;
-		break;
 
 
-	/* jump group */
+/* put the instruction that opcode "t" has just been fetched for into the
+   trace ring, over the oldest one there if it is full  --  the bytes are
+   taken from "mem" so as not to trip the read breakpoints */
+static void
+traceop(z80info *z80, byte t)
+{
+	struct tracerec *tr;
+	word pc = PC - 1;
+
+	tr = &z80->tracering[z80->traced++ & (z80->tracesize - 1)];
+	tr->pc = pc;
+	tr->op[0] = t;
+	tr->op[1] = z80->mem[(word)(pc + 1)];
+	tr->op[2] = z80->mem[(word)(pc + 2)];
+	tr->op[3] = z80->mem[(word)(pc + 3)];
+	tr->af = AF;
+	tr->bc = BC;
+	tr->de = DE;
+	tr->hl = HL;
+	tr->ix = IX;
+	tr->iy = IY;
+	tr->sp = SP;
+}
 
-	case 0xE9:					/* jp (ir) */
-		PC = *rr;
-		break;
 
 
-	default:
-		undefinstr(z80, t);
-		break;
-	}	/* end of "ireginstr" "switch" */
+/* The core is built twice from z80core.inc: z80_fast() reads & writes
+   memory as it is, and with MEM_BREAK, z80_brk() looks in "membrk" for a
+   breakpoint or watchpoint first  --  only in the pages "brkpage" says
+   have one, and without the block cache, whose operands are read ahead
+   of time.  z80_emulator() runs z80_brk() only while something is set,
+   and each hands over to the other at the next event once that changes
+   (see z80_setbrk()), so the checks cost nothing the rest of the time. */
+
+#ifdef MEM_BREAK
+#	define OTHERCORE()	(BRKCORE ? z80->numbrks == 0 : z80->numbrks != 0)
+#else
+#	define OTHERCORE()	0
+#endif
+
+#undef MEM
+#undef SETMEM
+#define MEM(addr)		RAWMEM(addr)
+#define SETMEM(addr, val)	RAWSETMEM(addr, val)
+#define CORE			z80_fast
+#define BRKCORE			0
+#include "z80core.inc"
+
+#ifdef MEM_BREAK
+#undef MEM
+#undef SETMEM
+#undef CORE
+#undef BRKCORE
+#define MEM(addr)		BRKMEM(addr)
+#define SETMEM(addr, val)	BRKSETMEM(addr, val)
+#define CORE			z80_brk
+#define BRKCORE			1
+#include "z80core.inc"
+#endif
 
-	goto infloop;
+boolean
+z80_emulator(z80info *z80, int count)
+{
+#ifdef MEM_BREAK
+	if (z80->numbrks != 0)
+		return z80_brk(z80, count);
+#endif
+	return z80_fast(z80, count);
+}
 
+#ifdef MEM_BREAK
+/* set ("on") or clear the M_* "flags" for "addr" in "membrk", keeping
+   count of the bytes & pages with any set  --  the core running sees
+   the change at the next event, which this makes sure there is */
+void
+z80_setbrk(z80info *z80, word addr, byte flags, boolean on)
+{
+	byte old = z80->membrk[addr];
 
+	z80->membrk[addr] = on ? old | flags : old & ~flags;
 
-	/* extended instructions */
-extinstr: 
-	t = MEM(PC);
-	PC++;
-	switch (t)
+	if (!old && z80->membrk[addr])
 	{
-	/* 8-bit load group */
-
-	case 0x57:					/* ld a,i */
-	case 0x5F:					/* ld a,r */
-		A = *REGIR[(t >> 3) & MASK1];
-		setsign();
-		setzero();
-		flagoff(HALF);
-		setflag(PARITY, IFF2);
-		flagoff(NEGATIVE);
-		break;
-
-	case 0x47:					/* ld i,a */
-	case 0x4F:					/* ld r,a */
-		*REGIR[(t >> 3) & MASK1] = A;
-		break;
-
-
-	/* 16-bit load group */
-
-	case 0x4B:					/* ld bc,(nn) */
-	case 0x5B:					/* ld de,(nn) */
-	case 0x6B:					/* ld hl,(nn) */
-	case 0x7B:					/* ld sp,(nn) */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		tt2 = MEM(tt);
-		tt++;
-		tt2 |= MEM(tt) << 8;
-		*REGPAIRSP[(t >> 4) & MASK2] = tt2;
-		break;
-
-	case 0x43:					/* ld (nn),bc */
-	case 0x53:					/* ld (nn),de */
-	case 0x63:					/* ld (nn),hl */
-	case 0x73:					/* ld (nn),sp */
-		tt = MEM(PC);
-		PC++;
-		tt |= MEM(PC) << 8;
-		PC++;
-		tt2 = *REGPAIRSP[(t >> 4) & MASK2];
-		SETMEM(tt, tt2 & MASK8);
-		tt++;
-		SETMEM(tt, tt2 >> 8);
-		break;
-
-
-	/* block transfer and search group */
-
-	case 0xA0:					/* ldi */
-	case 0xA8:					/* ldd */
-	case 0xB0:					/* ldir */
-	case 0xB8:					/* lddr */
-		if (t & BIT3)
-		{
-			t1 = MEM(HL);
-			HL--;
-			SETMEM(DE, t1);
-			DE--;
-		}
-		else
-		{
-			t1 = MEM(HL);
-			HL++;
-			SETMEM(DE, t1);
-			DE++;
-		}
-
-		setflag(OVERFLOW, --BC);
-
-		if ((t & BIT4) && BC)
-			PC -= 2;
-
-		flagoff(HALF);
-		flagoff(NEGATIVE);
-		break;
-
-	case 0xA1:					/* cpi */
-	case 0xA9:					/* cpd */
-	case 0xB1:					/* cpir */
-	case 0xB9:					/* cpdr */
-		t1 = MEM(HL);
-
-		if (t & BIT3)
-		    HL--;
-		else
-		    HL++;
-
-		t2 = A - t1;
-		setflag(SIGN, t2 & BIT7);
-		setflag(ZERO, !t2);
-		setflag(HALF, (A & MASK4) < (t1 & MASK4));
-		setflag(OVERFLOW, --BC);
-		flagon(NEGATIVE);
-		if ((t & BIT4) && t2 && BC)
-			PC -= 2;
-		break;
-
-
-	/* general purpose arithmetic and cpu control groups */
-
-	case 0x44:					/* neg */
-		t1 = A;
-		A = 0;
-		arith8(t1, 0, 1);
-		A = v;
-		/* flagon(HALF); */
-		flagon(NEGATIVE);
-		break;
+		z80->brkpage[addr >> 8]++;
+		z80->numbrks++;
+	}
+	else if (old && !z80->membrk[addr])
+	{
+		z80->brkpage[addr >> 8]--;
+		z80->numbrks--;
+	}
 
-	case 0x46:					/* im 0 */
-		IMODE = 0;
-		break;
-	case 0x56:					/* im 1 */
-		IMODE = 1;
-		break;
-	case 0x5E:					/* im 2 */
-		IMODE = 2;
-		break;
+	EVENT = TRUE;
+}
+#endif
 
 
-	/* 16-bit arithmetic group */
 
-	case 0x4A:					/* adc hl,bc */
-	case 0x5A:					/* adc hl,de */
-	case 0x6A:					/* adc hl,hl */
-	case 0x7A:					/* adc hl,sp */
-	case 0x42:					/* sbc hl,bc */
-	case 0x52:					/* sbc hl,de */
-	case 0x62:					/* sbc hl,hl */
-	case 0x72:					/* sbc hl,sp */
-		vv = *REGPAIRSP[(t >> 4) & MASK2];
-		n = !(t & BIT3);
-		if (n)
-		{
-			ttt = (int)HL - (int)vv - ((F & CARRY) ? 1 : 0);
-			hh = (int)(HL & MASK12) - (int)(vv & MASK12) -
-			    ((F & CARRY) ? 1 : 0);
-			setflag(OVERFLOW, (HL & BIT15) != (vv & BIT15) &&
-					(vv & BIT15) == (ttt & BIT15));
-		}
-		else
-		{
-			ttt = (int)HL + (int)vv + ((F & CARRY) ? 1 : 0);
-			hh = (int)(HL & MASK12) + (int)(vv & MASK12) +
-			    ((F & CARRY) ? 1 : 0);
-			setflag(OVERFLOW, (HL & BIT15) == (vv & BIT15) &&
-					(vv & BIT15) != (ttt & BIT15));
-		}
-		setflag(SIGN, ttt & BIT15);
-		setflag(ZERO, !ttt);
-		setflag(NEGATIVE, n);
-		setflag(CARRY, ttt & BIT16);
-		setflag(HALF, hh & BIT12);
-		HL = ttt;
-		break;
+/* T-states for opcode "t" of OPS_* group "grp" - see "cyctab" */
+static int
+opcycles(int grp, int t)
+{
+	switch (grp)
+	{
+	case OPS_MAIN:
+		return cycmain[t];
 
+	case OPS_CB:			/* bit b,(hl) only reads (hl) */
+		if ((t & MASK3) != 6)
+			return 8;
+		return (t & 0xC0) == 0x40 ? 12 : 15;
 
-	/* rotate & shift group */
+	case OPS_XYCB:
+		return (t & 0xC0) == 0x40 ? 20 : 23;
 
-	case 0x67:				/* rrd */
-	case 0x6F:				/* rld */
-		t1 = MEM(HL);
-		if (t & BIT3)
-		{
-			SETMEM(HL, (t1 << 4) | (A & MASK4));
-			A = (A & MASKU4) | (t1 >> 4);
-		}
-		else
+	case OPS_ED:
+		if ((t & 0xC0) == 0x40)
 		{
-			SETMEM(HL, (t1 >> 4) | (A << 4));
-			A = (A & MASKU4) | (t1 & MASK4);
+			if ((t & MASK3) == 7 && t >= 0x60)	/* rrd, rld */
+				return t >= 0x70 ? 8 : 18;
+			return cycedx[t & MASK3];
 		}
-		flags(A);
-		break;
-
-
-	/* call & return group */
-
-	case 0x45:					/* retn */
-		IFF = IFF2;
-		PC = MEM(SP);
-		SP++;
-		PC |= MEM(SP) << 8;
-		SP++;
-		break;
-	case 0x4D:					/* reti */
-		PC = MEM(SP);
-		SP++;
-		PC |= MEM(SP) << 8;
-		SP++;
-		break;
-
-
-	/* input & output group */
-
-	case 0x40:					/* in b,c */
-	case 0x48:					/* in c,c */
-	case 0x50:					/* in d,c */
-	case 0x58:					/* in e,c */
-	case 0x60:					/* in h,c */
-	case 0x68:					/* in l,c */
-	case 0x70:					/* in ?,c */
-	case 0x78:					/* in a,c */
-		if (!input(z80, B, C, &t1))
-			return FALSE;
-
-		v = *REG[(t >> 3) & MASK3] = t1;
-		setflag(SIGN, v & BIT7);
-		resetflag(ZERO, v);
-		flagoff(HALF);
-		setparity(v);
-		flagoff(NEGATIVE);
-		break;
-
-	case 0x49:					/* out c,c */
-	case 0x51:					/* out d,c */
-	case 0x59:					/* out e,c */
-	case 0x61:					/* out h,c */
-	case 0x69:					/* out l,c */
-	case 0x79:					/* out a,c */
-	case 0x41:					/* out b,c */
-		output(z80, B, C, *REG[(t >> 3) & MASK3]);
-		break;
-
-	case 0xA2:					/* ini */
-	case 0xAA:					/* ind */
-	case 0xB2:					/* inir */
-	case 0xBA:					/* indr */
-		if (!input(z80, B, C, &t1))
-			return FALSE;
-
-		SETMEM(HL, t1);
-
-		if (t & BIT3)
-			HL--;
-		else
-			HL++;
-
-		resetflag(ZERO, --B);
-		flagon(NEGATIVE);
-
-		if ((t & BIT4) && B)
-			PC -= 2;
-
-		break;
-
-	case 0xA3:					/* outi */
-	case 0xAB:					/* outd */
-	case 0xB3:					/* otir */
-	case 0xBB:					/* otdr */
-		resetflag(ZERO, --B);
-		output(z80, B, C, MEM(HL));
-
-		if (t & BIT3)
-			HL--;
-		else
-			HL++;
-
-		flagon(NEGATIVE);
-
-		if ((t & BIT4) && B)
-			PC -= 2;
-
-		break;
-
-
-	default:
-		undefinstr(z80, t);
-		break;
-	}	/* end of "extinstr" "switch" */
-
-	goto infloop;
-
+		if ((t & 0xE4) == 0xA0)		/* ldi, cpi, ini, outi, ... */
+			return 16;
+		return 8;
 
-	/* index-register bit-twiddling instuctions */
-iregbitinstr:
-
-	/* note: we have to look ahead 1 byte for the opcode  -- the PC is
-	   bumped later after the "switch" */
-	switch (t = MEM((PC + 1) & 0xFFFF))
-	{
-
-	/* rotate & shift group */
-
-	case 0x06:					/* rlc (ir+d) */
-	case 0x0E:					/* rrc (ir+d) */
-	case 0x16:					/* rl (ir+d) */
-	case 0x1E:					/* rr (ir+d) */
-	case 0x26:					/* sla (ir+d) */
-	case 0x2E:					/* sra (ir+d) */
-	case 0x3E:					/* srl (ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		t1 = MEM(tt);
-		cy = F & CARRY;
-		if (t & BIT3)
-		{
-			setflag(CARRY, t1 & BIT0);
-			t1 >>= 1;
-			t2 = BIT7;
-		}
-		else
-		{
-			setflag(CARRY, t1 & BIT7);
-			t1 <<= 1;
-			t2 = BIT0;
-		}
-		if (t & BIT5)
-		{
-			if (t2 == BIT7 && !(t & BIT4))
-				if (t1 & BIT6)
-					t1 |= BIT7;
-		}
-		else
+	case OPS_XY:
+		switch (t)
 		{
-			if (t & BIT4)
-			{
-				if (cy)
-					t1 |= t2;
-			}
-			else
-			{
-				if (F & CARRY)
-					t1 |= t2;
-			}
+		case 0xCB:			/* counted in OPS_XYCB */
+			return 0;
+		case 0x09: case 0x19: case 0x29: case 0x39:	/* add ir,rr */
+		case 0xE5:					/* push ir */
+			return 15;
+		case 0x21: case 0xE1:		/* ld ir,nn & pop ir */
+			return 14;
+		case 0x22: case 0x2A:		/* ld (nn),ir & ld ir,(nn) */
+			return 20;
+		case 0x23: case 0x2B: case 0xF9:	/* inc/dec ir, ld sp,ir */
+			return 10;
+		case 0x34: case 0x35: case 0xE3:	/* inc/dec (ir+d), ex */
+			return 23;
+		case 0x36:			/* ld (ir+d),n */
+			return 19;
+		case 0xE9:			/* jp (ir) */
+			return 8;
 		}
-		SETMEM(tt, t1);
-		flags(t1);
-		break;
-
-
-	/* bit set, reset, & test group */
-
-	case 0x46:					/* bit 0,(ir+d) */
-	case 0x4E:					/* bit 1,(ir+d) */
-	case 0x56:					/* bit 2,(ir+d) */
-	case 0x5E:					/* bit 3,(ir+d) */
-	case 0x66:					/* bit 4,(ir+d) */
-	case 0x6E:					/* bit 5,(ir+d) */
-	case 0x76:					/* bit 6,(ir+d) */
-	case 0x7E:					/* bit 7,(ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		resetflag(ZERO, MEM(tt) & bitmask[(t >> 3) & MASK3]);
-		flagon(HALF);
-		flagoff(NEGATIVE);
-		break;
-
-	case 0x86:					/* res 0,(ir+d) */
-	case 0x8E:					/* res 1,(ir+d) */
-	case 0x96:					/* res 2,(ir+d) */
-	case 0x9E:					/* res 3,(ir+d) */
-	case 0xA6:					/* res 4,(ir+d) */
-	case 0xAE:					/* res 5,(ir+d) */
-	case 0xB6:					/* res 6,(ir+d) */
-	case 0xBE:					/* res 7,(ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		t1 = MEM(tt) & ~bitmask[(t >> 3) & MASK3];
-		SETMEM(tt, t1);
-		break;
 
-	case 0xC6:					/* set 0,(ir+d) */
-	case 0xCE:					/* set 1,(ir+d) */
-	case 0xD6:					/* set 2,(ir+d) */
-	case 0xDE:					/* set 3,(ir+d) */
-	case 0xE6:					/* set 4,(ir+d) */
-	case 0xEE:					/* set 5,(ir+d) */
-	case 0xF6:					/* set 6,(ir+d) */
-	case 0xFE:					/* set 7,(ir+d) */
-		tt = (int)*rr + ((signed char)MEM(PC));
-		PC++;
-		t1 = MEM(tt) | bitmask[(t >> 3) & MASK3];
-		SETMEM(tt, t1);
-		break;
-
-
-	default: 
-		undefinstr(z80, t);
-		break;
-	}	/* end of "iregbitinstr" "switch" */
-
-	PC++;	/* bump the PC here instead */
-	goto infloop;
-
-}		/* end of "z80_emulator()" */
+		/* ld r,(ir+d), ld (ir+d),r & the arithmetic ops on (ir+d) */
+		if (((t & 0xC7) == 0x46 || (t & 0xF8) == 0x70 ||
+				(t & 0xC7) == 0x86) && t != 0x76)
+			return 19;
+		return 8;
+	}
 
+	return 0;
+}
 
 
 /* initialize the z80 struct with sane stuff */
 z80info *
 init_z80info(z80info *z80)
 {
-	int i;
+	int i, j;
 
 	/* clear it the easy way */
 	memset(z80, 0, sizeof *z80);
@@ -1967,6 +907,16 @@ init_z80info(z80info *z80)
 	/* could allocate memory if need be here - check for NULL malloc */
 	/* z80->mem = malloc(0x10000L); */
 
+#ifdef BLOCK_CACHE
+	/* the block cache is not essential, so just run without it if there
+	   is no memory for it */
+	z80->blocks = malloc(BLOCK_SLOTS * sizeof *z80->blocks);
+
+	if (z80->blocks != NULL)
+		for (i = 0; i < BLOCK_SLOTS; i++)
+			z80->blocks[i].pc = BLOCK_EMPTY;
+#endif
+
 	/* initialize the generic byte registers */
 	REG[0] = &B;
 	REG[1] = &C;
@@ -2008,7 +958,9 @@ init_z80info(z80info *z80)
 	z80->trace = FALSE;
 	z80->step = FALSE;
 	z80->sig = 0;
+	z80->quitsig = 0;
 	z80->syscall = FALSE;
+	z80->bdosret = -1;
 
 	/* initialize the CP/M BIOS data */
 	z80->drive = 0;
@@ -2016,8 +968,8 @@ init_z80info(z80info *z80)
 	z80->track = 0;
 	z80->sector = 1;
 
-	/* initialize the global parity array if necessary */
-	if (!parity_inited)
+	/* initialize the global flag tables if necessary */
+	if (!flagtabs_inited)
 	{
 		for (i = 0; i <= 0xFF; i++)
 		{
@@ -2028,10 +980,26 @@ init_z80info(z80info *z80)
 				if (i & t)
 					tt++;
 
-			parityarr[i] = tt & BIT0;
+			sztab[i] = (i & SIGN) | (i ? 0 : ZERO);
+			szptab[i] = sztab[i] | ((tt & BIT0) ? PARITY : 0);
+
+			inctab[i] = sztab[i];
+			if ((i & MASK4) == 0)
+				inctab[i] |= HALF;
+			if (i == 0x80)
+				inctab[i] |= OVERFLOW;
+
+			dectab[i] = sztab[i] | NEGATIVE;
+			if ((i & MASK4) == MASK4)
+				dectab[i] |= HALF;
+			if (i == 0x7F)
+				dectab[i] |= OVERFLOW;
+
+			for (j = 0; j < OPS_GROUPS; j++)
+				cyctab[(j << 8) | i] = opcycles(j, i);
 		}
 
-		parity_inited = TRUE;
+		flagtabs_inited = TRUE;
 	}
 
 	return z80;
@@ -2042,6 +1010,14 @@ destroy_z80info(z80info *z80)
 {
 	/* free the mem array if allocated above */
 	/* free(z80->mem); */
+#ifdef BLOCK_CACHE
+	free(z80->blocks);
+	z80->blocks = NULL;
+#endif
+	free(z80->tracering);
+	z80->tracering = NULL;
+	free(z80->prof);
+	z80->prof = NULL;
 	return z80;
 }
 
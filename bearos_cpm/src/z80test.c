@@ -0,0 +1,614 @@
+/*-----------------------------------------------------------------------*\
+ |  z80test.c  --  writes Z80TEST.COM, an instruction exerciser for the  |
+ |  emulator's Z80 core in the manner of zexdoc: each test runs an       |
+ |  instruction in many machine states & prints a CRC of the results     |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Each test has an instruction and a machine state  --  the operand in
+   memory, IY, IX, HL, DE, BC, AF & SP  --  with a mask of the bits that
+   vary.  The exerciser makes "count" states from them, each with the
+   masked bits from a 16-bit linear congruential generator, runs the
+   instruction in each, and takes a CRC-32 of the state it leaves, with
+   the two undocumented flags masked off.  Only the documented
+   instructions are tried, as they are all the core has.
+
+   The CRCs are not from a real Z80.  The golden output, in
+   src/tests/z80test.out, is the same as the original core of this
+   emulator gives, before any of the work on its speed, so "make check"
+   shows that a changed core still does what that one did  --  and not
+   only that it agrees with itself.  It is only as right as that core.
+
+   There is no Z80 assembler here, so the program is written as the
+   bytes of its instructions, with the Z80 code alongside. */
+
+typedef unsigned char byte;
+typedef unsigned short word;
+
+#define ORG		0x0100
+#define BDOS		0x0005
+
+/* the CRC-32 table, a page for each byte of the entries */
+#define CRCTAB		0x1000
+
+/* the variables, past the end of the file */
+#define CRC		0x1400		/* 4 bytes, least significant first */
+#define RND		0x1404
+#define SAVESP		0x1406
+#define CNT		0x1408
+#define TPTR		0x140A		/* the test being run */
+#define STATE		0x1410		/* the instruction & the state in */
+#define OUT		0x1430		/* the state out */
+#define MEMOP		0x1450		/* the operand in memory */
+#define STACK		0x1600
+
+#define STATESIZE	20		/* instruction, memop, IY ... SP */
+#define OUTSIZE		16		/* memop, IY ... SP */
+#define TESTSIZE	(4 + 2 * STATESIZE)
+
+#define FLAGMASK	0xD7		/* all but the undocumented 5 & 3 */
+
+static byte com[CRCTAB + 0x400 - ORG];
+static word pc;
+
+
+/* the labels, as their addresses are found on the first pass */
+enum { L_TLOOP, L_ILOOP, L_BLOOP, L_CLOOP, L_NEXT, L_IUT, L_DONE, L_RAND,
+	L_CRCBYTE, L_PHEX, L_PNIB, L_HELLO, L_CRCMSG, L_CRLF, L_BYE, L_TESTS,
+	NLABELS };
+
+static word labels[NLABELS];
+
+#define label(l)	(labels[l] = pc)
+
+static void
+b(int x)
+{
+	com[pc++ - ORG] = x;
+}
+
+static void
+w(int x)
+{
+	b(x & 0xFF);
+	b(x >> 8 & 0xFF);
+}
+
+static void
+str(const char *s)
+{
+	while (*s != '\0')
+		b(*s++);
+}
+
+/* a JR or DJNZ to "l" */
+static void
+jr(int op, int l)
+{
+	b(op);
+	b((labels[l] - (pc + 1)) & 0xFF);
+}
+
+
+/* the tests: a name, how many states, & the instruction and state with
+   the bits that vary set in their masks */
+struct test
+{
+	const char *name;
+	unsigned count;
+	byte instr[4], imask[4];
+	word memop, iy, ix, hl, de, bc, af, sp;
+	word mmemop, miy, mix, mhl, mde, mbc, maf, msp;
+};
+
+#define R	0xFFFF		/* all random */
+#define M	MEMOP
+
+static const struct test tests[] =
+{
+	/* 8-bit arithmetic & logic */
+	{ "alu a,<b,c,d,e,h,l,(hl),a>", 8192,
+		{ 0x80 }, { 0x3F },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "alu a,n", 8192,
+		{ 0xC6, 0 }, { 0x38, 0xFF },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, 0 },
+	{ "alu a,(<ix,iy>+1)", 4096,
+		{ 0xDD, 0x86, 0x01 }, { 0x20, 0x38, 0 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "inc/dec <b,c,d,e,h,l,(hl),a>", 4096,
+		{ 0x04 }, { 0x39 },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "inc/dec (<ix,iy>+1)", 2048,
+		{ 0xDD, 0x34, 0x01 }, { 0x20, 0x01, 0 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "daa,cpl,scf,ccf", 8192,
+		{ 0x27 }, { 0x18 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, 0 },
+	{ "neg", 2048,
+		{ 0xED, 0x44 }, { 0, 0 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, 0 },
+
+	/* 16-bit arithmetic */
+	{ "inc/dec <bc,de,hl,sp>", 2048,
+		{ 0x03 }, { 0x38 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, R },
+	{ "inc/dec <ix,iy>", 1024,
+		{ 0xDD, 0x23 }, { 0x20, 0x08 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, 0 },
+	{ "add hl,<bc,de,hl,sp>", 4096,
+		{ 0x09 }, { 0x30 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, R },
+	{ "add <ix,iy>,<bc,de,ix/iy,sp>", 4096,
+		{ 0xDD, 0x09 }, { 0x20, 0x30 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, R },
+	{ "<adc,sbc> hl,<bc,de,hl,sp>", 8192,
+		{ 0xED, 0x42 }, { 0, 0x38 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, R },
+
+	/* rotates, shifts & bits */
+	{ "<rlca,rrca,rla,rra>", 2048,
+		{ 0x07 }, { 0x18 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, 0 },
+	{ "cb <rlc,rrc,rl,rr> <r>", 4096,
+		{ 0xCB, 0x00 }, { 0, 0x1F },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "cb <sla,sra> <r>", 2048,
+		{ 0xCB, 0x20 }, { 0, 0x0F },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "cb srl <r>", 1024,
+		{ 0xCB, 0x38 }, { 0, 0x07 },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "cb <bit,set> n,<r>", 8192,
+		{ 0xCB, 0x40 }, { 0, 0xBF },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "cb res n,<r>", 4096,
+		{ 0xCB, 0x80 }, { 0, 0x3F },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "<ix,iy> cb 1 <rlc,rrc,rl,rr>", 2048,
+		{ 0xDD, 0xCB, 0x01, 0x06 }, { 0x20, 0, 0, 0x18 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "<ix,iy> cb 1 <sla,sra>", 1024,
+		{ 0xDD, 0xCB, 0x01, 0x26 }, { 0x20, 0, 0, 0x08 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "<ix,iy> cb 1 srl", 512,
+		{ 0xDD, 0xCB, 0x01, 0x3E }, { 0x20, 0, 0, 0 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "<ix,iy> cb 1 <bit,set> n", 4096,
+		{ 0xDD, 0xCB, 0x01, 0x46 }, { 0x20, 0, 0, 0xB8 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "<ix,iy> cb 1 res n", 2048,
+		{ 0xDD, 0xCB, 0x01, 0x86 }, { 0x20, 0, 0, 0x38 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "<rrd,rld>", 2048,
+		{ 0xED, 0x67 }, { 0, 0x08 },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+
+	/* loads */
+	{ "ld <b,c,d,e,h,l,(hl),a>,<...>", 4096,
+		{ 0x40 }, { 0x3F },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "ld <b,c,d,e,h,l,(hl),a>,n", 2048,
+		{ 0x06, 0 }, { 0x38, 0xFF },
+		0, 0, 0, M, 0, 0, 0, 0,
+		R, R, R, 0, R, R, R, 0 },
+	{ "ld <r>,(<ix,iy>+1)", 2048,
+		{ 0xDD, 0x46, 0x01 }, { 0x20, 0x38, 0 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "ld (<ix,iy>+1),<r>", 2048,
+		{ 0xDD, 0x70, 0x01 }, { 0x20, 0x07, 0 },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "ld (<ix,iy>+1),n", 1024,
+		{ 0xDD, 0x36, 0x01, 0 }, { 0x20, 0, 0, 0xFF },
+		0, M - 1, M - 1, 0, 0, 0, 0, 0,
+		R, 0, 0, R, R, R, R, 0 },
+	{ "ld <bc,de,hl,sp>,nn", 1024,
+		{ 0x01, 0, 0 }, { 0x30, 0xFF, 0xFF },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, R },
+	{ "ld <(bc),(de)>,a & back", 1024,
+		{ 0x02 }, { 0x18 },
+		0, 0, 0, 0, M, M, 0, 0,
+		R, R, R, R, 0, 0, R, 0 },
+	{ "ld <(nn),hl,(nn),a> & back", 1024,
+		{ 0x22, M & 0xFF, M >> 8 }, { 0x18, 0, 0 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		R, R, R, R, R, R, R, 0 },
+	{ "ld (nn),<bc,de,hl,sp> & back", 1024,
+		{ 0xED, 0x43, M & 0xFF, M >> 8 }, { 0, 0x38, 0, 0 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		R, R, R, R, R, R, R, R },
+	{ "ld (nn),<ix,iy> & back", 1024,
+		{ 0xDD, 0x22, M & 0xFF, M >> 8 }, { 0x20, 0x08, 0, 0 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		R, R, R, R, R, R, R, 0 },
+	{ "ld sp,<ix,iy>", 1024,
+		{ 0xDD, 0xF9 }, { 0x20, 0 },
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, R, R, R, R, R, R, R },
+	{ "push <bc,de,hl,af>; pop <...>", 2048,
+		{ 0xC5, 0xC1 }, { 0x30, 0x30 },
+		0, 0, 0, 0, 0, 0, 0, M + 2,
+		0, R, R, R, R, R, R, 0 },
+
+	/* exchanges & blocks */
+	{ "ex de,hl; ex (sp),hl", 1024,
+		{ 0xEB, 0xE3 }, { 0, 0 },
+		0, 0, 0, 0, 0, 0, 0, M,
+		R, R, R, R, R, R, R, 0 },
+	{ "ex (sp),<ix,iy>", 1024,
+		{ 0xDD, 0xE3 }, { 0x20, 0 },
+		0, 0, 0, 0, 0, 0, 0, M,
+		R, R, R, R, R, R, R, 0 },
+	{ "<ldi,cpi,ldd,cpd>", 4096,
+		{ 0xED, 0xA0 }, { 0, 0x09 },
+		0, 0, 0, M, M, 0, 0, 0,
+		R, R, R, 0, 0, R, R, 0 },
+	{ "<ldir,cpir,lddr,cpdr>", 4096,
+		{ 0xED, 0xB0 }, { 0, 0x09 },
+		0, 0, 0, M, M, 2, 0, 0,
+		R, R, R, 0, 0, 1, R, 0 },
+	{ NULL }
+};
+
+
+/* the exerciser */
+static void
+program(void)
+{
+	const struct test *t;
+	word names;
+	int i, n;
+
+	pc = ORG;
+	b(0x31); w(STACK);		/* LD	SP,STACK */
+	b(0x21); w(CRC);		/* LD	HL,CRC */
+	b(0x36); b(0);			/* LD	(HL),0 */
+	b(0x11); w(CRC + 1);		/* LD	DE,CRC+1 */
+	b(0x01); w(STACK - CRC - 1);	/* LD	BC,STACK-CRC-1 */
+	b(0xED); b(0xB0);		/* LDIR */
+	b(0x11); w(labels[L_HELLO]);	/* LD	DE,HELLO */
+	b(0x0E); b(9);			/* LD	C,9 */
+	b(0xCD); w(BDOS);		/* CALL	BDOS */
+	b(0x21); w(labels[L_TESTS]);	/* LD	HL,TESTS */
+	b(0x22); w(TPTR);		/* LD	(TPTR),HL */
+
+	/* the next test: print its name, & start the CRC & the generator */
+	label(L_TLOOP);
+	b(0x2A); w(TPTR);		/* LD	HL,(TPTR) */
+	b(0x5E);			/* LD	E,(HL) */
+	b(0x23);			/* INC	HL */
+	b(0x56);			/* LD	D,(HL) */
+	b(0x23);			/* INC	HL */
+	b(0x7A);			/* LD	A,D */
+	b(0xB3);			/* OR	E */
+	b(0xCA); w(labels[L_DONE]);	/* JP	Z,DONE */
+	b(0xE5);			/* PUSH	HL */
+	b(0x0E); b(9);			/* LD	C,9 */
+	b(0xCD); w(BDOS);		/* CALL	BDOS */
+	b(0xE1);			/* POP	HL */
+	b(0x5E);			/* LD	E,(HL) */
+	b(0x23);			/* INC	HL */
+	b(0x56);			/* LD	D,(HL) */
+	b(0x23);			/* INC	HL */
+	b(0xED); b(0x53); w(CNT);	/* LD	(CNT),DE */
+	b(0x22); w(TPTR);		/* LD	(TPTR),HL */
+	b(0x21); w(0xFFFF);		/* LD	HL,0FFFFH */
+	b(0x22); w(CRC);		/* LD	(CRC),HL */
+	b(0x22); w(CRC + 2);		/* LD	(CRC+2),HL */
+	b(0x21); w(0x2A5B);		/* LD	HL,2A5BH */
+	b(0x22); w(RND);		/* LD	(RND),HL */
+
+	/* the next state: STATE[i] = base[i] ^ (random & mask[i]) */
+	label(L_ILOOP);
+	b(0x2A); w(TPTR);		/* LD	HL,(TPTR) */
+	b(0x11); w(STATE);		/* LD	DE,STATE */
+	b(0x06); b(STATESIZE);		/* LD	B,STATESIZE */
+	label(L_BLOOP);
+	b(0xC5);			/* PUSH	BC */
+	b(0xCD); w(labels[L_RAND]);	/* CALL	RAND */
+	b(0x01); w(STATESIZE);		/* LD	BC,STATESIZE */
+	b(0xE5);			/* PUSH	HL */
+	b(0x09);			/* ADD	HL,BC */
+	b(0xA6);			/* AND	(HL) */
+	b(0xE1);			/* POP	HL */
+	b(0xAE);			/* XOR	(HL) */
+	b(0x12);			/* LD	(DE),A */
+	b(0x23);			/* INC	HL */
+	b(0x13);			/* INC	DE */
+	b(0xC1);			/* POP	BC */
+	jr(0x10, L_BLOOP);		/* DJNZ	BLOOP */
+
+	/* a HALT would stop the exerciser */
+	b(0x3A); w(STATE);		/* LD	A,(STATE) */
+	b(0xFE); b(0x76);		/* CP	76H */
+	jr(0x28, L_NEXT);		/* JR	Z,NEXT */
+	b(0x3A); w(STATE + 1);		/* LD	A,(STATE+1) */
+	b(0xFE); b(0x76);		/* CP	76H */
+	jr(0x28, L_NEXT);		/* JR	Z,NEXT */
+
+	/* run the instruction with the state */
+	b(0x2A); w(STATE);		/* LD	HL,(STATE) */
+	b(0x22); w(labels[L_IUT]);	/* LD	(IUT),HL */
+	b(0x2A); w(STATE + 2);		/* LD	HL,(STATE+2) */
+	b(0x22); w(labels[L_IUT] + 2);	/* LD	(IUT+2),HL */
+	b(0x2A); w(STATE + 4);		/* LD	HL,(STATE+4) */
+	b(0x22); w(MEMOP);		/* LD	(MEMOP),HL */
+	b(0xED); b(0x73); w(SAVESP);	/* LD	(SAVESP),SP */
+	b(0x31); w(STATE + 6);		/* LD	SP,STATE+6 */
+	b(0xFD); b(0xE1);		/* POP	IY */
+	b(0xDD); b(0xE1);		/* POP	IX */
+	b(0xE1);			/* POP	HL */
+	b(0xD1);			/* POP	DE */
+	b(0xC1);			/* POP	BC */
+	b(0xF1);			/* POP	AF */
+	b(0xED); b(0x7B); w(STATE + 18);	/* LD	SP,(STATE+18) */
+	label(L_IUT);
+	b(0); b(0); b(0); b(0);		/* the instruction */
+	b(0xED); b(0x73); w(OUT + 14);	/* LD	(OUT+14),SP */
+	b(0x31); w(OUT + 14);		/* LD	SP,OUT+14 */
+	b(0xF5);			/* PUSH	AF */
+	b(0xC5);			/* PUSH	BC */
+	b(0xD5);			/* PUSH	DE */
+	b(0xE5);			/* PUSH	HL */
+	b(0xDD); b(0xE5);		/* PUSH	IX */
+	b(0xFD); b(0xE5);		/* PUSH	IY */
+	b(0xED); b(0x7B); w(SAVESP);	/* LD	SP,(SAVESP) */
+	b(0x2A); w(MEMOP);		/* LD	HL,(MEMOP) */
+	b(0x22); w(OUT);		/* LD	(OUT),HL */
+	b(0x21); w(OUT + 12);		/* LD	HL,OUT+12 */
+	b(0x7E);			/* LD	A,(HL) */
+	b(0xE6); b(FLAGMASK);		/* AND	FLAGMASK */
+	b(0x77);			/* LD	(HL),A */
+
+	/* add the state it left to the CRC */
+	b(0x21); w(OUT);		/* LD	HL,OUT */
+	b(0x06); b(OUTSIZE);		/* LD	B,OUTSIZE */
+	label(L_CLOOP);
+	b(0x7E);			/* LD	A,(HL) */
+	b(0xE5);			/* PUSH	HL */
+	b(0xCD); w(labels[L_CRCBYTE]);	/* CALL	CRCBYTE */
+	b(0xE1);			/* POP	HL */
+	b(0x23);			/* INC	HL */
+	jr(0x10, L_CLOOP);		/* DJNZ	CLOOP */
+
+	label(L_NEXT);
+	b(0x2A); w(CNT);		/* LD	HL,(CNT) */
+	b(0x2B);			/* DEC	HL */
+	b(0x22); w(CNT);		/* LD	(CNT),HL */
+	b(0x7C);			/* LD	A,H */
+	b(0xB5);			/* OR	L */
+	b(0xC2); w(labels[L_ILOOP]);	/* JP	NZ,ILOOP */
+
+	/* all its states are done: show the CRC */
+	b(0x11); w(labels[L_CRCMSG]);	/* LD	DE,CRCMSG */
+	b(0x0E); b(9);			/* LD	C,9 */
+	b(0xCD); w(BDOS);		/* CALL	BDOS */
+	for (i = 3; i >= 0; i--)
+	{
+		b(0x3A); w(CRC + i);	/* LD	A,(CRC+i) */
+		b(0xCD); w(labels[L_PHEX]);	/* CALL	PHEX */
+	}
+	b(0x11); w(labels[L_CRLF]);	/* LD	DE,CRLF */
+	b(0x0E); b(9);			/* LD	C,9 */
+	b(0xCD); w(BDOS);		/* CALL	BDOS */
+	b(0x2A); w(TPTR);		/* LD	HL,(TPTR) */
+	b(0x11); w(2 * STATESIZE);	/* LD	DE,2*STATESIZE */
+	b(0x19);			/* ADD	HL,DE */
+	b(0x22); w(TPTR);		/* LD	(TPTR),HL */
+	b(0xC3); w(labels[L_TLOOP]);	/* JP	TLOOP */
+
+	label(L_DONE);
+	b(0x11); w(labels[L_BYE]);	/* LD	DE,BYE */
+	b(0x0E); b(9);			/* LD	C,9 */
+	b(0xCD); w(BDOS);		/* CALL	BDOS */
+	b(0xC3); w(0);			/* JP	0 */
+
+	/* A = the high byte of RND = RND * 5 + 3619H */
+	label(L_RAND);
+	b(0xE5);			/* PUSH	HL */
+	b(0xD5);			/* PUSH	DE */
+	b(0x2A); w(RND);		/* LD	HL,(RND) */
+	b(0x54);			/* LD	D,H */
+	b(0x5D);			/* LD	E,L */
+	b(0x29);			/* ADD	HL,HL */
+	b(0x29);			/* ADD	HL,HL */
+	b(0x19);			/* ADD	HL,DE */
+	b(0x11); w(0x3619);		/* LD	DE,3619H */
+	b(0x19);			/* ADD	HL,DE */
+	b(0x22); w(RND);		/* LD	(RND),HL */
+	b(0x7C);			/* LD	A,H */
+	b(0xD1);			/* POP	DE */
+	b(0xE1);			/* POP	HL */
+	b(0xC9);			/* RET */
+
+	/* add A to the CRC: CRC = TAB[CRC ^ A & FF] ^ CRC >> 8, with
+	   the bytes of TAB in a page each */
+	label(L_CRCBYTE);
+	b(0x21); w(CRC);		/* LD	HL,CRC */
+	b(0xAE);			/* XOR	(HL) */
+	b(0x5F);			/* LD	E,A */
+	b(0x16); b(CRCTAB >> 8);	/* LD	D,HIGH CRCTAB */
+	for (i = 0; i < 3; i++)
+	{
+		b(0x23);		/* INC	HL */
+		b(0x1A);		/* LD	A,(DE) */
+		b(0xAE);		/* XOR	(HL) */
+		b(0x2B);		/* DEC	HL */
+		b(0x77);		/* LD	(HL),A */
+		b(0x23);		/* INC	HL */
+		b(0x14);		/* INC	D */
+	}
+	b(0x1A);			/* LD	A,(DE) */
+	b(0x77);			/* LD	(HL),A */
+	b(0xC9);			/* RET */
+
+	/* print A in hex */
+	label(L_PHEX);
+	b(0xF5);			/* PUSH	AF */
+	b(0x0F);			/* RRCA */
+	b(0x0F);			/* RRCA */
+	b(0x0F);			/* RRCA */
+	b(0x0F);			/* RRCA */
+	b(0xCD); w(labels[L_PNIB]);	/* CALL	PNIB */
+	b(0xF1);			/* POP	AF */
+	label(L_PNIB);
+	b(0xE6); b(0x0F);		/* AND	0FH */
+	b(0xC6); b(0x90);		/* ADD	A,90H */
+	b(0x27);			/* DAA */
+	b(0xCE); b(0x40);		/* ADC	A,40H */
+	b(0x27);			/* DAA */
+	b(0x5F);			/* LD	E,A */
+	b(0x0E); b(2);			/* LD	C,2 */
+	b(0xC3); w(BDOS);		/* JP	BDOS */
+
+	label(L_HELLO);
+	str("Z80 instruction exerciser\r\n$");
+	label(L_CRCMSG);
+	str("  CRC $");
+	label(L_CRLF);
+	str("\r\n$");
+	label(L_BYE);
+	str("Tests complete\r\n$");
+
+	/* the tests, then their names, padded out with dots */
+	label(L_TESTS);
+	for (n = 0; tests[n].name != NULL; n++)
+		;
+
+	names = pc + n * TESTSIZE + 2;
+
+	for (t = tests; t->name != NULL; t++)
+	{
+		word state[2][8];
+
+		w(names);
+		names += 33;
+		w(t->count);
+
+		state[0][0] = t->memop;
+		state[0][1] = t->iy;
+		state[0][2] = t->ix;
+		state[0][3] = t->hl;
+		state[0][4] = t->de;
+		state[0][5] = t->bc;
+		state[0][6] = t->af;
+		state[0][7] = t->sp;
+		state[1][0] = t->mmemop;
+		state[1][1] = t->miy;
+		state[1][2] = t->mix;
+		state[1][3] = t->mhl;
+		state[1][4] = t->mde;
+		state[1][5] = t->mbc;
+		state[1][6] = t->maf;
+		state[1][7] = t->msp;
+
+		for (n = 0; n < 2; n++)
+		{
+			for (i = 0; i < 4; i++)
+				b(n == 0 ? t->instr[i] : t->imask[i]);
+
+			for (i = 0; i < 8; i++)
+				w(state[n][i]);
+		}
+	}
+
+	w(0);
+
+	for (t = tests; t->name != NULL; t++)
+	{
+		str(t->name);
+
+		for (i = strlen(t->name); i < 32; i++)
+			b('.');
+
+		b('$');
+	}
+}
+
+/* the table for the reflected CRC-32, a byte of the entries per page */
+static void
+crctable(void)
+{
+	unsigned long c;
+	int i, k;
+
+	for (i = 0; i < 0x100; i++)
+	{
+		for (c = i, k = 0; k < 8; k++)
+			c = c & 1 ? 0xEDB88320UL ^ c >> 1 : c >> 1;
+
+		for (k = 0; k < 4; k++)
+			com[CRCTAB - ORG + k * 0x100 + i] = c >> (k * 8) & 0xFF;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *fp;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s z80test.com\n", argv[0]);
+		return 1;
+	}
+
+	/* the labels are known after the first pass */
+	program();
+	program();
+
+	if (pc > CRCTAB)
+	{
+		fprintf(stderr, "%s: the program is %X bytes too long\n",
+				argv[0], pc - CRCTAB);
+		return 1;
+	}
+
+	crctable();
+
+	if ((fp = fopen(argv[1], "wb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fwrite(com, 1, sizeof com, fp) != sizeof com || fclose(fp) != 0)
+	{
+		fprintf(stderr, "error writing %s\n", argv[1]);
+		return 1;
+	}
+
+	return 0;
+}